@@ -1,10 +1,7 @@
 #!/usr/bin/env python
 
 import sys, os, os.path, glob
-import threading
-from Queue import Queue
 import subprocess as SP
-import re
 
 from signal import signal, SIGPIPE, SIG_DFL 
 signal(SIGPIPE,SIG_DFL) 
@@ -17,11 +14,24 @@ def getargs():
     P.add_argument('indexfile', help='Channel Archiver index to export')
     P.add_argument('outdir', help='Directory where output .pb file tree is written')
     P.add_argument('-j', '--parallel', type=int, default=2,
-                   help='Number of exporting worker prcesses.  (default 2)')
+                   help='Number of exporting worker threads.  (default 2)')
     P.add_argument('--seps', default=':-{}', help='PV name seperators (default ":-{}")')
     P.add_argument('--progs', default=mydir, help='Directory under which ./bin/*/listpvs helpers are found')
-    P.add_argument('--pv', default='^.*$', help='Regular expression: only PVs that match will be exported')
+    P.add_argument('--pv', default=None,
+                   help='Regular expression (POSIX extended): only PVs whose names start with a match will be exported')
     P.add_argument('--pvlist', default=None, help='Read PVs from file')
+    P.add_argument('--manifest', default='pbexport.manifest',
+                   help='Record of exported PVs, relative to outdir.  PVs with no new data are skipped (default pbexport.manifest)')
+    P.add_argument('--partition', choices=['year', 'month', 'day', 'hour'], default=None,
+                   help='Time covered by each output file (default year)')
+    P.add_argument('--bin', type=int, default=None, metavar='SEC',
+                   help='Write the min, max, mean, last and count of numeric PVs in bins of SEC seconds')
+    P.add_argument('--collapse', action='store_true',
+                   help='Write runs of identical samples as their first, with repeatcount set')
+    P.add_argument('--follow', type=int, default=None, metavar='SEC',
+                   help='Keep running, and export new samples every SEC seconds (needs the manifest)')
+    P.add_argument('--no-manifest', dest='manifest', action='store_const', const=None,
+                   help='Visit every PV, and keep no record')
 
     return P.parse_args()
 
@@ -42,65 +52,47 @@ exportenv = os.environ.copy()
 exportenv['NAMESEPS'] = args.seps
 print 'seps',args.seps
 
-# pull in the PV list
-
-pvs = SP.check_output([listpvs, idxfile])
-
-jobs = Queue(10)
-
-
-regex = re.compile(args.pv)
-
-pvlist = None
+# listpvs selects the PVs, and estimates the cost of each so that
+# pbexport can start with the largest
+listcmd = [listpvs, '-cost']
+if args.pv is not None:
+  listcmd += ['-pv', '^(%s)'%args.pv]
 if args.pvlist is not None:
-  with open(args.pvlist, 'r') as f:
-    pvlist = [line.strip() for line in f]
-
-
-def worker():
-  slave = SP.Popen([pbexport, idxfile],
-                   stdin=SP.PIPE, stdout=SP.PIPE,
-                   cwd=exportdir)
-  while True:
-    # fetch the next PV to process
-    pv = jobs.get()
-    if pv is None:
-      break
-    if regex.match(pv) is None:
-      continue
-    if pvlist is not None and pv not in pvlist:
-      continue
-    print 'pv',pv
-    slave.stdin.write(pv+'\n')
-    # wait for worker to complete
-    X = slave.stdout.readline().strip()
-    if X!='Done':
-      print 'Oops',repr(X)
-      break
-    print 'Done',pv
-
-  slave.stdin.write('<>exit\n') # trigger graceful exit
-  print 'Wait for worker exit'
-  code = slave.wait()
-  print 'Worker exits',code
+  listcmd += ['-pvlist', os.path.abspath(args.pvlist)]
+listcmd.append(idxfile)
 
 nworkers = args.parallel
 print 'nworkers',nworkers
 
-Ts = [threading.Thread(target=worker) for i in range(nworkers)]
-
 sys.stdout.flush() # sync output so far, the rest will be mangled
 
-[T.start() for T in Ts]
-
-print 'Workers running'
-
-for pv in pvs.splitlines():
-  jobs.put(pv)
-
+cmd = [pbexport, '-jobs', str(nworkers)]
+if args.manifest is not None:
+  cmd += ['-manifest', args.manifest]
+if args.partition is not None:
+  cmd += ['-partition', args.partition]
+if args.bin is not None:
+  cmd += ['-bin', str(args.bin)]
+if args.collapse:
+  cmd += ['-collapse']
+if args.follow is not None:
+  cmd += ['-follow', str(args.follow)]
+cmd.append(idxfile)
+
+# a single pbexport process runs the worker threads, reading the PV list
+# as listpvs prints it
+lister = SP.Popen(listcmd, stdout=SP.PIPE)
+slave = SP.Popen(cmd,
+                 stdin=lister.stdout, env=exportenv,
+                 cwd=exportdir)
+lister.stdout.close()
+
+if lister.wait()!=0:
+  print 'listpvs failed',lister.returncode
+  slave.wait()
+  sys.exit(1)
 print 'All jobs queued'
 
-[jobs.put(None) for T in Ts]
-print 'Signaled'
-[T.join() for T in Ts]
-print 'Done'
+code = slave.wait()
+print 'Done',code
+sys.exit(code)
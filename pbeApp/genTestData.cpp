@@ -255,6 +255,102 @@ static void getRepeat(Index& idx)
     writer->add((dbr_time_double*)&val);
 }
 
+// Control information changes after 3 samples
+static void getCtrlChange(Index& idx)
+{
+    stdString name("pv:ctrlchange1");
+    CtrlInfo info;
+    info.setNumeric(0, "tick", 0, 10, 0, 0, 0, 0);
+
+    AutoPtr<DataWriter> writer(new DataWriter(idx, name, info,
+                                              DBR_TIME_DOUBLE, 1, 1.0, 10));
+
+    dbr_time_double val;
+    val.severity = val.status = 0;
+    val.stamp.nsec = 0;
+
+    val.value = 0;
+    val.stamp.secPastEpoch = BASETIME;
+    for(size_t i=0; i<3; i++) {
+        writer->add(&val);
+        val.value++;
+        val.stamp.secPastEpoch++;
+    }
+
+    info.setNumeric(1, "mm", 0, 20, 0, 0, 0, 0);
+    writer.assign(new DataWriter(idx, name, info,
+                                 DBR_TIME_DOUBLE, 1, 1.0, 10));
+
+    for(size_t i=0; i<2; i++) {
+        writer->add(&val);
+        val.value++;
+        val.stamp.secPastEpoch++;
+    }
+}
+
+/* 2015-01-01 00:00:00 UTC */
+#define YEAR2015 (1420070400 - POSIX_TIME_AT_EPICS_EPOCH)
+/* 2016-01-01 00:00:00 UTC */
+#define YEAR2016 (1451606400 - POSIX_TIME_AT_EPICS_EPOCH)
+/* 2017-01-01 00:00:00 UTC */
+#define YEAR2017 (1483228800 - POSIX_TIME_AT_EPICS_EPOCH)
+
+// Disconnected over the new year of 2015, and changes type in 2016
+static void getYears(Index& idx)
+{
+    stdString name("pv:years1");
+    CtrlInfo info;
+    info.setNumeric(0, "tick", 0, 10, 0, 0, 0, 0);
+
+    AutoPtr<DataWriter> writer(new DataWriter(idx, name, info,
+                                              DBR_TIME_DOUBLE, 1, 1.0, 10));
+
+    dbr_time_double val;
+    val.severity = val.status = 0;
+    val.stamp.nsec = 0;
+
+    val.value = 1;
+    val.stamp.secPastEpoch = YEAR2015-10;
+    writer->add(&val);
+
+    val.value = 0;
+    val.severity = 3904; // Disconnected
+    val.stamp.secPastEpoch = YEAR2015-5;
+    writer->add(&val);
+
+    val.severity = 3872; // Archive off
+    val.stamp.secPastEpoch = YEAR2015-2;
+    writer->add(&val);
+
+    val.severity = 0;
+    val.value = 2;
+    val.stamp.secPastEpoch = YEAR2015+5;
+    writer->add(&val);
+
+    val.value = 3;
+    val.stamp.secPastEpoch = YEAR2015+100;
+    writer->add(&val);
+
+    val.value = 4;
+    val.stamp.secPastEpoch = YEAR2016+5;
+    writer->add(&val);
+
+    writer.assign(new DataWriter(idx, name, info,
+                                 DBR_TIME_LONG, 1, 1.0, 10));
+
+    dbr_time_long lval;
+    lval.severity = lval.status = 0;
+    lval.stamp.nsec = 0;
+
+    lval.value = 5;
+    lval.stamp.secPastEpoch = YEAR2016+10;
+    writer->add((dbr_time_double*)&lval);
+
+    lval.value = 6;
+    lval.stamp.secPastEpoch = YEAR2017+5;
+    writer->add((dbr_time_double*)&lval);
+}
+
 int main(int argc, char *argv[])
 {
     if(argc<2)
@@ -269,6 +365,8 @@ int main(int argc, char *argv[])
         getRestart(idx);
         getDisable(idx);
         getRepeat(idx);
+        getCtrlChange(idx);
+        getYears(idx);
         return 0;
     }catch(std::exception& e){
         std::cerr<<"Error: "<<e.what()<<"\n";
@@ -1,4 +1,3 @@
-
 #include <time.h>
 #include <string.h>
 #include <errno.h>
@@ -12,6 +11,7 @@
 #include <fstream>
 #include <stdexcept>
 #include <algorithm>
+#include <iomanip>
 
 // Base
 #include <epicsVersion.h>
@@ -26,14 +26,131 @@
 #include <SpreadsheetReader.h>
 #include <AutoIndex.h>
 
+namespace {
+
+// Selects PVs by a regular expression and/or a list of names
+class PVFilter
+{
+    RegularExpression *regex;
+    std::vector<std::string> names; // sorted
+    bool uselist;
+
+    PVFilter(const PVFilter&);
+    PVFilter& operator=(const PVFilter&);
+public:
+    PVFilter() :regex(0), uselist(false) {}
+    ~PVFilter()
+    {
+        if(regex)
+            regex->release();
+    }
+
+    void setPattern(const char *pattern)
+    {
+        regex = RegularExpression::reference(pattern);
+    }
+
+    // One name per line, surrounding whitespace ignored
+    void readList(const char *fname)
+    {
+        std::ifstream F(fname);
+        if(!F.is_open())
+            throw std::runtime_error(std::string("Can't open ")+fname);
+        std::string line;
+        while(std::getline(F, line)) {
+            size_t first = line.find_first_not_of(" \t\r\n"),
+                   last = line.find_last_not_of(" \t\r\n");
+            if(first!=std::string::npos)
+                names.push_back(line.substr(first, last-first+1));
+        }
+        std::sort(names.begin(), names.end());
+        uselist = true;
+    }
+
+    bool match(const stdString& name) const
+    {
+        if(regex && !regex->doesMatch(name.c_str()))
+            return false;
+        if(uselist && !std::binary_search(names.begin(), names.end(), std::string(name.c_str())))
+            return false;
+        return true;
+    }
+};
+
+/* An estimate of the work to export a PV, from the index.
+ * The number of data blocks stands in for the number of samples.
+ * The element count is that of the first sample, so find() reads the
+ * first block and decodes one sample, but no more.
+ */
+struct PVCost
+{
+    double span;        // seconds from the first to the last sample
+    unsigned long blocks;
+    DbrCount elements;
+
+    PVCost() :span(0.0), blocks(0), elements(0) {}
+    double cost() const { return double(blocks)*(elements ? elements : 1); }
+};
+
+bool estimateCost(Index& idx, DataReader& reader, const stdString& name, PVCost& C)
+{
+    stdString dirname;
+    AutoPtr<RTree> tree(idx.getTree(name, dirname));
+    epicsTime start, end;
+    if(!tree || !tree->getInterval(start, end))
+        return false;
+    C.span = end - start;
+
+    RTree::Node node(tree->getM(), true);
+    RTree::Datablock block;
+    int i;
+    for(bool ok = tree->getFirstDatablock(node, i, block); ok;
+        ok = tree->getNextDatablock(node, i, block)) {
+        C.blocks++;
+        while(tree->getNextChainedBlock(block))
+            C.blocks++;
+    }
+
+    if(reader.find(name, 0))
+        C.elements = reader.getCount();
+    return true;
+}
+
+} // namespace
+
 int main(int argc, char *argv[])
 {
-    if(argc<2)
+    CmdArgParser parser(argc, argv);
+    parser.setArgumentsInfo(" <index file>");
+    parser.setFooter("\nPrints the names of the PVs in the index, sorted.\n"
+                     "With -cost, each is printed as it is found, with columns\n"
+                     "  name cost span(sec) blocks elements\n");
+    CmdArgString pattern(parser, "pv", "<regex>", "Only PVs matching this regular expression");
+    CmdArgString pvlist(parser, "pvlist", "<file>", "Only PVs named in this file, one per line");
+    CmdArgFlag withcost(parser, "cost", "Print an estimate of the cost of exporting each PV");
+
+    if(!parser.parse())
         return 2;
+    if(parser.getArguments().size()!=1) {
+        parser.usage();
+        return 2;
+    }
 try{
     AutoIndex idx;
-    idx.open(argv[1]);
+    idx.open(parser.getArgument(0));
+
+    PVFilter filter;
+    if(!pattern.get().empty())
+        filter.setPattern(pattern.get().c_str());
+    if(!pvlist.get().empty())
+        filter.readList(pvlist.get().c_str());
+
     std::vector<stdString> names;
+    AutoPtr<DataReader> reader;
+    if(withcost)
+        reader = ReaderFactory::create(idx, ReaderFactory::Raw, 0.0);
+
+    std::cout<<std::fixed<<std::setprecision(0);
 
     Index::NameIterator iter;
     if(!idx.getFirstChannel(iter)) {
@@ -41,8 +158,20 @@ try{
         return 1;
     }
     do {
-        names.push_back(iter.getName());
-        //std::cout<<iter.getName().c_str()<<"\n";
+        const stdString& name = iter.getName();
+        if(!filter.match(name))
+            continue;
+        if(!withcost) {
+            names.push_back(name);
+            continue;
+        }
+        PVCost C;
+        if(!estimateCost(idx, *reader, name, C)) {
+            std::cerr<<"WARN: "<<name.c_str()<<": No Data or no times\n";
+            continue;
+        }
+        std::cout<<name.c_str()<<"\t"<<C.cost()<<"\t"<<C.span<<"\t"
+                 <<C.blocks<<"\t"<<C.elements<<"\n";
     }while(idx.getNextChannel(iter));
 
     std::sort(names.begin(), names.end());
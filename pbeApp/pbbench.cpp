@@ -0,0 +1,421 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <map>
+#include <vector>
+
+// Base
+#include <epicsTime.h>
+#include <dbDefs.h>
+// Tools
+#include <AutoPtr.h>
+#include <ArgParser.h>
+// Storage
+#include <IndexFile.h>
+#include <DataWriter.h>
+#include <CtrlInfo.h>
+#include <AutoIndex.h>
+
+#include "pbwriter.h"
+#include "pbreadahead.h"
+#include "pbeutil.h"
+
+/* Export throughput benchmark.
+ *
+ * Generates a Channel Archiver index with one PV for each kind of data
+ * (once, the index is reused by later runs), then exports each PV with
+ * PBWriter in a child process, so peak RSS is measured per PV.
+ * Prints one JSON object per PV to stdout, which can be saved and
+ * passed back with -baseline to detect slowdowns.
+ */
+
+/* 2015-03-04 18:46:20 UTC */
+#define BASETIME (1425494780 - POSIX_TIME_AT_EPICS_EPOCH)
+
+namespace {
+
+struct BenchPV
+{
+    const char *name;
+    DbrType type;
+    bool waveform;
+    // every Nth sample is a disconnect, 0 for never
+    unsigned disconnect;
+};
+
+const BenchPV benchpvs[] = {
+    {"bench:string", DBR_TIME_STRING, false, 0},
+    {"bench:char",   DBR_TIME_CHAR,   false, 0},
+    {"bench:short",  DBR_TIME_SHORT,  false, 0},
+    {"bench:enum",   DBR_TIME_ENUM,   false, 0},
+    {"bench:long",   DBR_TIME_LONG,   false, 0},
+    {"bench:float",  DBR_TIME_FLOAT,  false, 0},
+    {"bench:double", DBR_TIME_DOUBLE, false, 0},
+    {"bench:disconn", DBR_TIME_DOUBLE, false, 100},
+    {"bench:wf:char",   DBR_TIME_CHAR,   true, 0},
+    {"bench:wf:short",  DBR_TIME_SHORT,  true, 0},
+    {"bench:wf:long",   DBR_TIME_LONG,   true, 0},
+    {"bench:wf:float",  DBR_TIME_FLOAT,  true, 0},
+    {"bench:wf:double", DBR_TIME_DOUBLE, true, 0},
+};
+
+const char *typeName(DbrType type)
+{
+    switch(type) {
+    case DBR_TIME_STRING: return "DBR_TIME_STRING";
+    case DBR_TIME_CHAR: return "DBR_TIME_CHAR";
+    case DBR_TIME_SHORT: return "DBR_TIME_SHORT";
+    case DBR_TIME_ENUM: return "DBR_TIME_ENUM";
+    case DBR_TIME_LONG: return "DBR_TIME_LONG";
+    case DBR_TIME_FLOAT: return "DBR_TIME_FLOAT";
+    case DBR_TIME_DOUBLE: return "DBR_TIME_DOUBLE";
+    default: return "?";
+    }
+}
+
+// Size of the generated data
+struct BenchParams
+{
+    unsigned long samples, wfsamples, elements;
+
+    bool operator==(const BenchParams& o) const
+    {
+        return samples==o.samples && wfsamples==o.wfsamples && elements==o.elements;
+    }
+};
+
+// Deterministic pseudo-random values
+struct LCG
+{
+    epicsUInt32 state;
+    LCG() :state(12345u) {}
+    epicsUInt32 next()
+    {
+        state = state*1103515245u + 12345u;
+        return state>>8;
+    }
+};
+
+// Fill element 'i' of a sample of value type T
+template<typename T>
+void fillValue(T *val, size_t i, double x, LCG& rng)
+{
+    val[i] = T(1000.0*sin(x) + (rng.next()%100));
+}
+
+template<>
+void fillValue(dbr_string_t *val, size_t i, double x, LCG&)
+{
+    snprintf(val[i], MAX_STRING_SIZE, "value %.3f", x);
+}
+
+template<>
+void fillValue(dbr_char_t *val, size_t i, double, LCG& rng)
+{
+    val[i] = dbr_char_t(rng.next());
+}
+
+template<>
+void fillValue(dbr_enum_t *val, size_t i, double, LCG& rng)
+{
+    val[i] = dbr_enum_t(rng.next()%4);
+}
+
+void generatePV(Index& idx, const BenchPV& pv, const BenchParams& params)
+{
+    CtrlInfo info;
+    if(pv.type==DBR_TIME_ENUM) {
+        info.allocEnumerated(4, MAX_ENUM_STATES*MAX_ENUM_STRING_SIZE);
+        info.setEnumeratedString(0, "Off");
+        info.setEnumeratedString(1, "On");
+        info.setEnumeratedString(2, "Fault");
+        info.setEnumeratedString(3, "Unknown");
+        info.calcEnumeratedSize();
+    } else {
+        info.setNumeric(3, "mm", -1000, 1000, -900, -800, 800, 900);
+    }
+
+    DbrCount count = pv.waveform ? params.elements : 1;
+    unsigned long nsamples = pv.waveform ? params.wfsamples : params.samples;
+
+    AutoPtr<DataWriter> writer(new DataWriter(idx, pv.name, info,
+                                              pv.type, count, 1.0, 1000));
+
+    RawValue::Data *sample = RawValue::allocate(pv.type, count, 1);
+    try {
+        LCG rng;
+        memset(sample, 0, RawValue::getSize(pv.type, count));
+        for(unsigned long n=0; n<nsamples; n++) {
+            sample->stamp.secPastEpoch = BASETIME + n;
+            sample->stamp.nsec = (n*7919u)%1000000000u;
+            sample->severity = sample->status = 0;
+            if(pv.disconnect && n%pv.disconnect==pv.disconnect-1)
+                sample->severity = 3904; // Disconnected
+
+            double x = n*0.01;
+            for(DbrCount i=0; i<count; i++) {
+                switch(pv.type) {
+#define CASE(DBR, T) case DBR: fillValue(&((T*)sample)->value, i, x+i*0.001, rng); break
+                CASE(DBR_TIME_STRING, dbr_time_string);
+                CASE(DBR_TIME_CHAR, dbr_time_char);
+                CASE(DBR_TIME_SHORT, dbr_time_short);
+                CASE(DBR_TIME_ENUM, dbr_time_enum);
+                CASE(DBR_TIME_LONG, dbr_time_long);
+                CASE(DBR_TIME_FLOAT, dbr_time_float);
+                CASE(DBR_TIME_DOUBLE, dbr_time_double);
+#undef CASE
+                }
+            }
+            writer->add(sample);
+        }
+    } catch(...) {
+        RawValue::free(sample);
+        throw;
+    }
+    RawValue::free(sample);
+}
+
+// Result of exporting one PV, passed from the child process
+struct BenchResult
+{
+    unsigned long samples;
+    unsigned long bytes;
+    double seconds;
+    long peakrss; // kB
+    bool ok;
+};
+
+// Runs in the child process
+void exportPV(const std::string& indexname, const BenchPV& pv, const ExportOptions& opts,
+              BenchResult *result)
+{
+    AutoIndex idx;
+    idx.open(indexname.c_str());
+
+    epicsTime started(epicsTime::getCurrent());
+
+    AutoPtr<DataReader> reader(ReaderFactory::create(idx, ReaderFactory::Raw, 0.0));
+    stdString name(pv.name);
+    if(!reader->find(name, 0))
+        throw std::runtime_error("No data");
+
+    AutoPtr<DataReader> ahead;
+    if(opts.readahead)
+        ahead = new ReadAheadReader(*reader, opts.readahead);
+    PBWriter writer(ahead ? *ahead : *reader, name, opts);
+    writer.write();
+
+    result->seconds = epicsTime::getCurrent() - started;
+    result->samples = writer.nwrote;
+    result->bytes = writer.outpb.nbytes;
+    result->ok = writer.outpb.good();
+
+    // start from scratch next time
+    for(size_t i=0; i<writer.files.size(); i++)
+        unlink(writer.files[i].c_str());
+}
+
+bool runPV(const std::string& indexname, const BenchPV& pv, const ExportOptions& opts,
+           BenchResult *result)
+{
+    int pfd[2];
+    if(pipe(pfd))
+        throw std::runtime_error("pipe() failed");
+
+    pid_t pid = fork();
+    if(pid==-1) {
+        close(pfd[0]);
+        close(pfd[1]);
+        throw std::runtime_error("fork() failed");
+
+    } else if(pid==0) {
+        close(pfd[0]);
+        BenchResult R;
+        memset(&R, 0, sizeof(R));
+        try {
+            exportPV(indexname, pv, opts, &R);
+        } catch(std::exception& e) {
+            std::cerr<<"ERROR: "<<pv.name<<" : "<<e.what()<<"\n";
+            R.ok = false;
+        }
+        ssize_t ret = write(pfd[1], &R, sizeof(R));
+        _exit(ret==sizeof(R) ? 0 : 1);
+    }
+
+    close(pfd[1]);
+    ssize_t ret = read(pfd[0], result, sizeof(*result));
+    close(pfd[0]);
+
+    int status = 0;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage)!=pid)
+        throw std::runtime_error("wait4() failed");
+    result->peakrss = usage.ru_maxrss;
+
+    return ret==sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status)==0 && result->ok;
+}
+
+// Read ns_per_sample by PV from a previous run
+void readBaseline(const char *fname, std::map<std::string, double>& baseline)
+{
+    std::ifstream F(fname);
+    if(!F.is_open())
+        throw std::runtime_error(std::string("Can't open baseline ")+fname);
+
+    std::string line;
+    while(std::getline(F, line)) {
+        static const char pvkey[] = "\"pv\":\"", nskey[] = "\"ns_per_sample\":";
+        size_t pvpos = line.find(pvkey), nspos = line.find(nskey);
+        if(pvpos==line.npos || nspos==line.npos)
+            continue;
+        pvpos += sizeof(pvkey)-1;
+        size_t pvend = line.find('"', pvpos);
+        if(pvend==line.npos)
+            continue;
+        baseline[line.substr(pvpos, pvend-pvpos)] = atof(line.c_str()+nspos+sizeof(nskey)-1);
+    }
+}
+
+bool readParams(const std::string& fname, BenchParams& params)
+{
+    std::ifstream F(fname.c_str());
+    F>>params.samples>>params.wfsamples>>params.elements;
+    return !F.fail();
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    CmdArgParser parser(argc, argv);
+    parser.setArgumentsInfo(" <directory>");
+    parser.setFooter("\nThe benchmark index is created in <directory> on the first run, and reused after.\n"
+                     "Prints a JSON object for each PV exported to stdout.\n");
+    CmdArgInt samples(parser, "samples", "<N>", "Samples of each scalar PV (default 100000)");
+    CmdArgInt wfsamples(parser, "wfsamples", "<N>", "Samples of each waveform PV (default 1000)");
+    CmdArgInt elements(parser, "elements", "<N>", "Elements of each waveform sample (default 4096)");
+    CmdArgString baselinefile(parser, "baseline", "<file>", "Compare with the output of a previous run");
+    CmdArgInt tolerance(parser, "tolerance", "<pct>", "Fail if ns/sample is this much worse than the baseline (default 10)");
+    CmdArgInt readahead(parser, "readahead", "<N>", "Read up to N samples ahead of encoding in a second thread");
+    CmdArgInt uring(parser, "uring", "<N>", "Write through an io_uring with N buffers, if built with USE_IO_URING");
+    samples.set(100000);
+    wfsamples.set(1000);
+    elements.set(4096);
+    tolerance.set(10);
+
+    if(!parser.parse())
+        return 2;
+    if(parser.getArguments().size()!=1 || samples<=0 || wfsamples<=0 || elements<=0) {
+        parser.usage();
+        return 2;
+    }
+
+try{
+    BenchParams params;
+    params.samples = samples;
+    params.wfsamples = wfsamples;
+    params.elements = elements;
+
+    ExportOptions opts;
+    if(readahead>0)
+        opts.readahead = readahead;
+    if(uring>0)
+        opts.uring = uring;
+
+    std::map<std::string, double> baseline;
+    if(!baselinefile.get().empty())
+        readBaseline(baselinefile.get().c_str(), baseline);
+
+    std::string dir(parser.getArgument(0).c_str());
+    if(mkdir(dir.c_str(), 0755) && errno!=EEXIST)
+        throw std::runtime_error("Can't create "+dir);
+
+    std::string indexname(dir+"/index"), paramsname(dir+"/pbbench.params");
+    BenchParams existing;
+    if(readParams(paramsname, existing)) {
+        if(!(existing==params)) {
+            std::cerr<<"ERROR: "<<dir<<" holds data for -samples "<<existing.samples
+                     <<" -wfsamples "<<existing.wfsamples<<" -elements "<<existing.elements
+                     <<".  Remove it to generate new data.\n";
+            return 2;
+        }
+        std::cerr<<"Using existing data in "<<dir<<"\n";
+    } else {
+        std::cerr<<"Generating data in "<<dir<<"\n";
+        {
+            IndexFile idx;
+            idx.open(indexname.c_str(), false);
+            for(size_t i=0; i<NELEMENTS(benchpvs); i++)
+                generatePV(idx, benchpvs[i], params);
+        }
+        std::ofstream F(paramsname.c_str());
+        F<<params.samples<<" "<<params.wfsamples<<" "<<params.elements<<"\n";
+    }
+
+    // exported files are written relative to the working directory
+    std::string outdir(dir+"/out");
+    if(mkdir(outdir.c_str(), 0755) && errno!=EEXIST)
+        throw std::runtime_error("Can't create "+outdir);
+    if(chdir(outdir.c_str()))
+        throw std::runtime_error("Can't chdir to "+outdir);
+    if(indexname[0]!='/')
+        indexname = "../../"+indexname;
+
+    bool ok = true;
+    for(size_t i=0; i<NELEMENTS(benchpvs); i++) {
+        const BenchPV& pv = benchpvs[i];
+        BenchResult R;
+        memset(&R, 0, sizeof(R));
+        if(!runPV(indexname, pv, opts, &R)) {
+            std::cerr<<"ERROR: "<<pv.name<<" export failed\n";
+            ok = false;
+            continue;
+        }
+
+        double nsper = R.samples ? R.seconds*1e9/R.samples : 0.0;
+        std::cout<<"{\"pv\":\""<<pv.name<<"\""
+                 <<",\"type\":\""<<typeName(pv.type)<<"\""
+                 <<",\"elements\":"<<(pv.waveform ? params.elements : 1ul)
+                 <<",\"samples\":"<<R.samples
+                 <<",\"bytes\":"<<R.bytes
+                 <<",\"seconds\":"<<R.seconds
+                 <<",\"samples_per_sec\":"<<(R.seconds>0 ? R.samples/R.seconds : 0.0)
+                 <<",\"mb_per_sec\":"<<(R.seconds>0 ? R.bytes/R.seconds/1e6 : 0.0)
+                 <<",\"ns_per_sample\":"<<nsper
+                 <<",\"peak_rss_kb\":"<<R.peakrss
+                 <<"}\n";
+        std::cout.flush();
+
+        std::map<std::string, double>::const_iterator it(baseline.find(pv.name));
+        if(it!=baseline.end() && it->second>0) {
+            double change = (nsper - it->second)*100.0/it->second;
+            bool slower = change > tolerance;
+            std::cerr<<pv.name<<": "<<nsper<<" ns/sample, baseline "<<it->second
+                     <<" ("<<(change>=0 ? "+" : "")<<change<<"%)"<<(slower ? " SLOWER\n" : "\n");
+            if(slower)
+                ok = false;
+        }
+    }
+
+    return ok ? 0 : 1;
+}catch(std::exception& e){
+    std::cerr<<"Exception: "<<e.what()<<"\n";
+    return 1;
+}
+}
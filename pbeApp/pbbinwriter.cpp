@@ -0,0 +1,388 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "pbbinwriter.h"
+#include "pbencode.h"
+#include "pbeutil.h"
+#include "EPICSEvent.pb.h"
+
+#include <google/protobuf/io/coded_stream.h>
+
+const char * const BinWriter::statNames[BinWriter::NStats] = {"min", "max", "mean", "last", "count"};
+
+static double sampleValue(DbrType type, const RawValue::Data *samp)
+{
+    switch(type) {
+    case DBR_TIME_CHAR: return ((const dbr_time_char*)samp)->value;
+    case DBR_TIME_SHORT: return ((const dbr_time_short*)samp)->value;
+    case DBR_TIME_ENUM: return ((const dbr_time_enum*)samp)->value;
+    case DBR_TIME_LONG: return ((const dbr_time_long*)samp)->value;
+    case DBR_TIME_FLOAT: return ((const dbr_time_float*)samp)->value;
+    case DBR_TIME_DOUBLE: return ((const dbr_time_double*)samp)->value;
+    }
+    return 0.0;
+}
+
+// Start of the last bin in an existing file, or 0 if it has none
+template<class PB>
+static epicsUInt32 lastBin(int fd, const std::string& fname, const epicsTimeStamp& startofyear)
+{
+    std::vector<char> line;
+    bool header;
+    if(!readLastLine(fd, line, &header) || header || line.empty())
+        return 0;
+    std::vector<char> buf(unescape_plan(&line[0], line.size()));
+    PB sample;
+    if(unescape(&line[0], line.size(), &buf[0], buf.size()) ||
+            !sample.ParsePartialFromArray(&buf[0], buf.size()) ||
+            !sample.has_secondsintoyear()) {
+        std::cerr<<"WARN: Can't parse the last bin of "<<fname<<"\n";
+        return 0;
+    }
+    return startofyear.secPastEpoch + sample.secondsintoyear();
+}
+
+BinWriter::BinWriter(DataReader& reader, const stdString& pv, const ExportOptions& opts)
+    :nwrote(0)
+    ,disconnected_epoch(0)
+    ,prev_severity(0)
+    ,onlyyear(0)
+    ,reader(reader)
+    ,samp(reader.get())
+    ,name(pv)
+    ,binsize(opts.binsize)
+    ,partition(opts.partition)
+    ,heartbeat(opts.heartbeat)
+    ,dirs(opts.dirs)
+    ,ok(true)
+    ,write_meta(true)
+    ,last_period(0)
+{
+    if(!binsize)
+        throw std::logic_error("BinWriter with no bin size");
+    last.secPastEpoch = last.nsec = 0;
+    until.secPastEpoch = until.nsec = 0;
+    startofyear = endofpartition = last;
+    memset(&bin, 0, sizeof(bin));
+    if(!dirs) {
+        owndirs = new DirCache;
+        dirs = owndirs;
+    }
+    char N[24];
+    N[formatDecimal(N, binsize)] = '\0';
+    for(size_t i=0; i<NStats; i++)
+        outputs[i] = new Output(opts, std::string(pv.c_str())+"_"+statNames[i]+"_"+N);
+}
+
+BinWriter::~BinWriter()
+{
+    for(size_t i=0; i<NStats; i++)
+        delete outputs[i];
+}
+
+bool BinWriter::binnable(DbrType type, DbrCount count)
+{
+    if(count!=1)
+        return false;
+    switch(type) {
+    case DBR_TIME_CHAR:
+    case DBR_TIME_SHORT:
+    case DBR_TIME_ENUM:
+    case DBR_TIME_LONG:
+    case DBR_TIME_FLOAT:
+    case DBR_TIME_DOUBLE:
+        return true;
+    }
+    return false;
+}
+
+size_t BinWriter::nbytes() const
+{
+    size_t n = 0;
+    for(size_t i=0; i<NStats; i++)
+        n += outputs[i]->out.nbytes;
+    return n;
+}
+
+size_t BinWriter::nsyscalls() const
+{
+    size_t n = 0;
+    for(size_t i=0; i<NStats; i++)
+        n += outputs[i]->out.nsyscalls;
+    return n;
+}
+
+double BinWriter::seconds() const
+{
+    double n = 0.0;
+    for(size_t i=0; i<NStats; i++)
+        n += outputs[i]->out.seconds;
+    return n;
+}
+
+void BinWriter::write()
+{
+    if(reader.getInfo().getType()==CtrlInfo::Numeric)
+        encodeMetadata(metafields, DBR_TIME_DOUBLE, false, reader.getInfo());
+
+    // a bin before 'onlyyear', written by the export of the year before
+    bool skipbin = false;
+    unsigned long nread = 0;
+    try {
+        while(samp && ok) {
+            if((until.secPastEpoch || until.nsec) && notAfter(until, samp->stamp))
+                break; // the end of the window, so the rest isn't read
+            bool timed = (nread++ % StageStats::sampling)==0;
+            DbrType type = reader.getType();
+            if(!binnable(type, reader.getCount())) {
+                std::cerr<<"ERROR: "<<name.c_str()<<": The type changed to "<<type<<" count "
+                         <<reader.getCount()<<", which can't be binned\n";
+                ok = false;
+                break;
+            }
+
+            epicsUInt32 sec = samp->stamp.secPastEpoch,
+                        start = sec - (sec+POSIX_TIME_AT_EPICS_EPOCH)%binsize;
+            if(start!=bin.start) {
+                flush();
+                if(onlyyear) {
+                    epicsTimeStamp t = {start, 0};
+                    int year;
+                    getYear(t, &year);
+                    if(year>onlyyear)
+                        break;
+                    skipbin = year<onlyyear;
+                }
+                if(!skipbin && (!outputs[0]->out.is_open() || start>=endofpartition.secPastEpoch)) {
+                    prepFiles(start);
+                    if(!ok)
+                        break;
+
+                    // step over the bins already written
+                    epicsUInt32 done = outputs[0]->lastbin;
+                    for(size_t i=1; i<NStats; i++)
+                        done = std::min(done, outputs[i]->lastbin);
+                    epicsTimeStamp donestamp = {done, 0};
+                    if(done && (until.secPastEpoch || until.nsec) && notAfter(until, donestamp)) {
+                        // bins are only appended, so what is missing can't be inserted
+                        std::cerr<<"ERROR: "<<name.c_str()<<": already has bins after the end of the window\n";
+                        ok = false;
+                        break;
+                    }
+                    if(done && start<=done) {
+                        StageTimer T(stats, StageStats::Skip);
+                        epicsTimeStamp next = {done+binsize, 0};
+                        epicsTime nexttime(next);
+                        samp = reader.find(name, &nexttime);
+                        while(samp && samp->stamp.secPastEpoch<next.secPastEpoch)
+                            samp = reader.next();
+                        continue;
+                    }
+                }
+                bin.start = start;
+            }
+
+            if(reader.changedInfo() && reader.getInfo().getType()==CtrlInfo::Numeric) {
+                std::string newmeta;
+                encodeMetadata(newmeta, DBR_TIME_DOUBLE, false, reader.getInfo());
+                if(newmeta!=metafields) {
+                    metafields.swap(newmeta);
+                    write_meta = true;
+                }
+            }
+
+            if(!skipbin)
+                add(samp, sampleValue(type, samp));
+            last = samp->stamp;
+
+            StageTimer T(stats, StageStats::Read, timed);
+            samp = reader.next();
+        }
+        flush();
+    } catch(...) {
+        closeFiles();
+        throw;
+    }
+    closeFiles();
+}
+
+void BinWriter::add(const RawValue::Data *samp, double val)
+{
+    int sevr = samp->severity;
+    if(isDisconnected(sevr)) {
+        if(disconnected_epoch==0)
+            disconnected_epoch = samp->stamp.secPastEpoch;
+        if((sevr==3872 || sevr==3848) && prev_severity<4)
+            prev_severity = sevr;
+        return;
+    }
+    if(sevr<=3 && disconnected_epoch!=0) {
+        // two disconnections in one bin are noted as one
+        if(!bin.cnxlost) {
+            bin.cnxlost = disconnected_epoch;
+            bin.cnxseverity = prev_severity;
+        }
+        bin.cnxregained = samp->stamp.secPastEpoch;
+        prev_severity = sevr;
+        disconnected_epoch = 0;
+    }
+
+    if(!bin.count) {
+        bin.min = bin.max = val;
+        bin.sum = 0.0;
+        bin.severity = bin.status = 0;
+    }
+    bin.min = std::min(bin.min, val);
+    bin.max = std::max(bin.max, val);
+    bin.sum += val;
+    bin.last = val;
+    if(sevr<=3 && (!bin.count || sevr>bin.severity)) {
+        bin.severity = sevr;
+        bin.status = samp->status;
+    }
+    bin.count++;
+}
+
+void BinWriter::flush()
+{
+    if(!bin.count) {
+        bin.cnxlost = bin.cnxregained = 0;
+        return;
+    }
+    StageTimer T(stats, StageStats::Encode);
+
+    std::string fields;
+    char num[24];
+    if(bin.cnxlost) {
+        pbwire::appendFieldValue(fields, "cnxlostepsecs", num,
+                                 formatDecimal(num, bin.cnxlost + POSIX_TIME_AT_EPICS_EPOCH));
+        pbwire::appendFieldValue(fields, "cnxregainedepsecs", num,
+                                 formatDecimal(num, bin.cnxregained + POSIX_TIME_AT_EPICS_EPOCH));
+        if(bin.cnxseverity==3872)
+            pbwire::appendFieldValue(fields, "startup", "true");
+        else if(bin.cnxseverity==3848)
+            pbwire::appendFieldValue(fields, "resume", "true");
+    }
+    // only the count has no metadata
+    const std::string countfields(fields);
+    if(heartbeat && bin.start/heartbeat!=last_period)
+        write_meta = true;
+    if(write_meta && !metafields.empty()) {
+        fields += metafields;
+        write_meta = false;
+        if(heartbeat)
+            last_period = bin.start/heartbeat;
+    }
+
+    epicsUInt32 secintoyear = bin.start - startofyear.secPastEpoch;
+    escapingarraystream encbuf;
+
+    dbr_time_double val;
+    val.severity = bin.severity;
+    val.status = bin.status;
+    val.stamp.secPastEpoch = bin.start;
+    val.stamp.nsec = 0;
+    const double vals[Count] = {bin.min, bin.max, bin.sum/bin.count, bin.last};
+    for(size_t i=0; i<Count; i++) {
+        Output& O = *outputs[i];
+        if(bin.start<=O.lastbin)
+            continue;
+        val.value = vals[i];
+        pbwire::serialize(encbuf, pbwire::sampleencoder<DBR_TIME_DOUBLE,0>(&val, 1, secintoyear, fields));
+        O.out.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+        O.lastbin = bin.start;
+        nwrote++;
+    }
+
+    Output& O = *outputs[Count];
+    if(bin.start>O.lastbin) {
+        dbr_time_long count;
+        count.severity = bin.severity;
+        count.status = bin.status;
+        count.stamp = val.stamp;
+        count.value = bin.count;
+        pbwire::serialize(encbuf, pbwire::sampleencoder<DBR_TIME_LONG,0>(&count, 1, secintoyear, countfields));
+        O.out.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+        O.lastbin = bin.start;
+        nwrote++;
+    }
+
+    for(size_t i=0; i<NStats; i++)
+        ok &= outputs[i]->out.good();
+    bin.count = 0;
+    bin.cnxlost = bin.cnxregained = 0;
+}
+
+void BinWriter::prepFiles(epicsUInt32 binstart)
+{
+    closeFiles();
+
+    epicsTimeStamp t = {binstart, 0};
+    int year;
+    getYear(t, &year);
+    getStartOfYear(year, &startofyear);
+    epicsTimeStamp startofpartition;
+    std::string partname;
+    getPartition(t, partition, &startofpartition, &endofpartition, &partname);
+    // as at the start of each raw file
+    write_meta = true;
+
+    for(size_t i=0; i<NStats; i++) {
+        Output& O = *outputs[i];
+        std::string fname(pvpathname(O.pvname.c_str())+":"+partname+".pb");
+
+        int fd = dirs->open(fname, O_RDWR|O_APPEND|O_CREAT);
+        struct stat st;
+        bool fileexists = fd!=-1 && fstat(fd, &st)==0 && st.st_size>0;
+        O.lastbin = 0;
+        if(fileexists) {
+            try {
+                O.lastbin = i==Count ? lastBin<EPICS::ScalarInt>(fd, fname, startofyear)
+                                     : lastBin<EPICS::ScalarDouble>(fd, fname, startofyear);
+            } catch(...) {
+                close(fd);
+                throw;
+            }
+        }
+
+        std::cerr<<"Starting to write "<<fname<<"\n";
+        if(std::find(files.begin(), files.end(), fname)==files.end())
+            files.push_back(fname);
+
+        O.out.open(fd, fname.c_str());
+        if(!fileexists) {
+            EPICS::PayloadInfo header;
+            header.set_type(i==Count ? EPICS::SCALAR_INT : EPICS::SCALAR_DOUBLE);
+            header.set_elementcount(1);
+            header.set_year(year);
+            header.set_pvname(O.pvname);
+
+            escapingarraystream encbuf;
+            {
+                google::protobuf::io::CodedOutputStream encstrm(&encbuf);
+                header.SerializeToCodedStream(&encstrm);
+            }
+            encbuf.finalize();
+            O.out.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+        }
+        ok &= O.out.good();
+    }
+}
+
+void BinWriter::closeFiles()
+{
+    for(size_t i=0; i<NStats; i++) {
+        bufferedfile& out = outputs[i]->out;
+        if(!out.is_open())
+            continue;
+        out.close();
+        ok &= out.good();
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef PBBINWRITER_H
+#define PBBINWRITER_H
+
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+// Tools
+#include <AutoPtr.h>
+// Storage
+#include <DataReader.h>
+
+#include "pbwriter.h"
+
+/* Reduces the samples of a numeric scalar PV to fixed time bins, in one pass.
+ *
+ * Each bin is written to five output PVs, named from the PV and the bin size
+ *   <pv>_min_<N> <pv>_max_<N> <pv>_mean_<N> <pv>_last_<N>  as SCALAR_DOUBLE
+ *   <pv>_count_<N>                                        as SCALAR_INT
+ * in files partitioned as for raw samples.
+ *
+ * Bins start at multiples of N seconds since the POSIX epoch, and are
+ * written at the time of their start.  Empty bins are not written.
+ * As in transcode_samples<>(), disconnected samples are not counted, and the
+ * first bin with a sample after a disconnection notes it in fieldvalues.
+ * Samples with the other special severities are counted, but do not raise
+ * the severity of the bin, which is the highest of its samples.
+ *
+ * On resume, bins up to the last already in a file are not written again,
+ * so samples added to the archive later for those bins are not counted.
+ */
+struct BinWriter
+{
+    enum Stat {Min, Max, Mean, Last, Count, NStats};
+    static const char * const statNames[NStats];
+
+    BinWriter(DataReader& reader, const stdString& pv, const ExportOptions& opts);
+    ~BinWriter();
+
+    // Can samples of this type be binned
+    static bool binnable(DbrType type, DbrCount count);
+
+    void write();
+
+    // false after an error writing, or samples which can't be binned
+    bool good() const { return ok; }
+
+    // Totals over all outputs
+    size_t nbytes() const;
+    size_t nsyscalls() const;
+    double seconds() const;
+
+    // As for PBWriter
+    // Bins written, over all outputs and files
+    unsigned long nwrote;
+    // Time of the last sample read, if any were
+    epicsTimeStamp last;
+    std::vector<std::string> files;
+    StageStats stats;
+    epicsUInt32 disconnected_epoch;
+    int prev_severity;
+    int onlyyear;
+    epicsTimeStamp until;
+
+private:
+    BinWriter(const BinWriter&);
+    BinWriter& operator=(const BinWriter&);
+
+    struct Output {
+        bufferedfile out;
+        const std::string pvname;
+        // Start of the last bin in the file, or 0
+        epicsUInt32 lastbin;
+        Output(const ExportOptions& opts, const std::string& pvname)
+            :out(opts.bufsize, opts.uring), pvname(pvname), lastbin(0)
+        {
+            out.preallocate(opts.prealloc);
+            out.throttle(opts.throttle);
+            out.syncOnClose(opts.manifest!=0);
+        }
+    };
+
+    // The samples of one bin
+    struct Bin {
+        epicsUInt32 start; // 0 if empty
+        epicsUInt32 count;
+        double min, max, sum, last;
+        dbr_short_t severity, status;
+        // when a disconnection noted by the bin started and ended, 0 if none
+        epicsUInt32 cnxlost, cnxregained;
+        int cnxseverity;
+    };
+
+    DataReader& reader;
+    const RawValue::Data *samp;
+    const stdString name;
+    const unsigned binsize;
+    const Partition partition;
+    const unsigned heartbeat;
+    DirCache *dirs;
+    AutoPtr<DirCache> owndirs;
+    Output *outputs[NStats];
+    bool ok;
+
+    epicsTimeStamp startofyear, endofpartition;
+    Bin bin;
+    std::string metafields;
+    bool write_meta;
+    epicsUInt32 last_period;
+
+    void prepFiles(epicsUInt32 binstart);
+    void closeFiles();
+    void add(const RawValue::Data *samp, double val);
+    void flush();
+};
+
+#endif // PBBINWRITER_H
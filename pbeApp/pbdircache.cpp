@@ -0,0 +1,138 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <iostream>
+
+#include <epicsGuard.h>
+
+#include "pbdircache.h"
+
+typedef epicsGuard<epicsMutex> Guard;
+
+DirCache::DirCache(size_t maxopen)
+    :hits(0)
+    ,misses(0)
+    ,maxopen(maxopen)
+{}
+
+DirCache::~DirCache()
+{
+    for(dirs_t::iterator it=dirs.begin(); it!=dirs.end(); ++it)
+        ::close(it->second.fd);
+}
+
+// The directory part of a path, w/o trailing separators, and the offset of the last component.
+// Returns false if there is no directory part.
+static bool splitPath(const std::string& path, std::string *dir, size_t *name)
+{
+    size_t sep = path.find_last_of('/');
+    if(sep==std::string::npos)
+        return false;
+    *name = sep+1;
+    size_t end = path.find_last_not_of('/', sep);
+    *dir = path.substr(0, end==std::string::npos ? 1 : end+1);
+    return true;
+}
+
+int DirCache::open(const std::string& path, int flags, mode_t mode)
+{
+    std::string dir;
+    size_t name;
+    if(!splitPath(path, &dir, &name))
+        return ::open(path.c_str(), flags, mode);
+
+    int dfd = acquire(dir);
+    if(dfd==-1)
+        return -1;
+    int fd = ::openat(dfd, path.c_str()+name, flags, mode);
+    int err = errno;
+    release(dir);
+    errno = err;
+    return fd;
+}
+
+int DirCache::acquire(const std::string& dir)
+{
+    {
+        Guard G(lock);
+        dirs_t::iterator it = dirs.find(dir);
+        if(it!=dirs.end()) {
+            hits++;
+            it->second.refs++;
+            lru.splice(lru.begin(), lru, it->second.use);
+            return it->second.fd;
+        }
+        misses++;
+    }
+
+    // Open the parent first, so only the last component is created and opened here.
+    // Another thread may do the same, the first to finish is kept.
+    std::string parent;
+    size_t name = 0;
+    int pfd = AT_FDCWD;
+    if(dir!="/" && splitPath(dir, &parent, &name)) {
+        pfd = acquire(parent);
+        if(pfd==-1)
+            return -1;
+    }
+
+    int fd = -1;
+    bool created = dir!="/" && mkdirat(pfd, dir.c_str()+name, 0755)==0;
+    if(created)
+        std::cerr<<"Create directory "<<dir<<"\n";
+    if(created || dir=="/" || errno==EEXIST)
+        fd = ::openat(pfd, dir.c_str()+name, O_RDONLY|O_DIRECTORY);
+    int err = errno;
+    if(pfd!=AT_FDCWD)
+        release(parent);
+    if(fd==-1) {
+        errno = err;
+        return -1;
+    }
+
+    Guard G(lock);
+    std::pair<dirs_t::iterator, bool> ins = dirs.insert(std::make_pair(dir, Dir()));
+    Dir& D = ins.first->second;
+    if(ins.second) {
+        D.fd = fd;
+        D.refs = 1;
+        lru.push_front(dir);
+        D.use = lru.begin();
+        evict();
+    } else {
+        // lost the race
+        ::close(fd);
+        D.refs++;
+        lru.splice(lru.begin(), lru, D.use);
+    }
+    return D.fd;
+}
+
+void DirCache::release(const std::string& dir)
+{
+    Guard G(lock);
+    dirs_t::iterator it = dirs.find(dir);
+    if(it!=dirs.end())
+        it->second.refs--;
+    if(dirs.size()>maxopen)
+        evict();
+}
+
+// With the lock held, close the least recently used directories not in use
+// until no more than 'maxopen' remain open.
+void DirCache::evict()
+{
+    std::list<std::string>::iterator it = lru.end();
+    while(dirs.size()>maxopen && it!=lru.begin()) {
+        --it;
+        dirs_t::iterator D = dirs.find(*it);
+        if(D->second.refs)
+            continue;
+        ::close(D->second.fd);
+        dirs.erase(D);
+        it = lru.erase(it);
+    }
+}
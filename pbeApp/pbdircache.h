@@ -0,0 +1,57 @@
+#ifndef PBDIRCACHE_H
+#define PBDIRCACHE_H
+
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <epicsMutex.h>
+
+/* Creates and opens files of the output tree, relative to open descriptors
+ * of their directories.
+ *
+ * A directory is created (mkdirat) and opened once, then files in it are
+ * opened with openat() without walking the path again.  Up to 'maxopen'
+ * directories are kept open, those unused for longest are closed first.
+ * Thread safe, one instance may be shared by all writers.
+ */
+class DirCache
+{
+public:
+    explicit DirCache(size_t maxopen=256);
+    ~DirCache();
+
+    // Open 'path', creating any missing directories.
+    // Returns a file descriptor, or -1 with errno set.
+    int open(const std::string& path, int flags, mode_t mode=0644);
+
+    // Directory lookups which found an open descriptor, and those which didn't
+    size_t hits, misses;
+
+private:
+    DirCache(const DirCache&);
+    DirCache& operator=(const DirCache&);
+
+    struct Dir {
+        int fd;
+        // # of users of 'fd', which is only closed when 0
+        unsigned refs;
+        std::list<std::string>::iterator use;
+    };
+    typedef std::map<std::string, Dir> dirs_t;
+
+    // Descriptor of a directory, to be given back with release()
+    int acquire(const std::string& dir);
+    void release(const std::string& dir);
+    void evict();
+
+    const size_t maxopen;
+    epicsMutex lock;
+    dirs_t dirs;
+    // most recently used first
+    std::list<std::string> lru;
+};
+
+#endif // PBDIRCACHE_H
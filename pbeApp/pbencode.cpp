@@ -0,0 +1,161 @@
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#  include <emmintrin.h>
+#  define USE_SSE2
+#endif
+
+#include "pbencode.h"
+
+namespace pbwire {
+namespace {
+
+/* Packed sint32 arrays of 16 bit values.  The zigzag encoding of each
+ * element is at most 3 bytes, and SSE2 handles 8 elements at a time.
+ *  key() - a 16 bit value which is compared with 'one' and 'two' to find
+ *          the encoded length (1 if <one, 2 if <two, otherwise 3)
+ *  low() - the low 16 bits of the zigzag encoding
+ *  scalar() - the complete zigzag encoding
+ */
+struct shortop {
+    typedef dbr_short_t value_type;
+    enum {one=0x80, two=0x4000};
+#ifdef USE_SSE2
+    static __m128i key(__m128i v) { return _mm_xor_si128(_mm_slli_epi16(v, 1), _mm_srai_epi16(v, 15)); }
+    static __m128i low(__m128i v) { return key(v); }
+#endif
+    static uint32 scalar(value_type v) { return zigzag(v); }
+};
+
+// Positive, so the zigzag encoding is 2*v, which needs 17 bits
+struct enumop {
+    typedef dbr_enum_t value_type;
+    enum {one=0x40, two=0x2000};
+#ifdef USE_SSE2
+    static __m128i key(__m128i v) { return v; }
+    static __m128i low(__m128i v) { return _mm_slli_epi16(v, 1); }
+#endif
+    static uint32 scalar(value_type v) { return zigzag(int32(v)); }
+};
+
+#ifdef USE_SSE2
+// lanes where the unsigned v >= lim
+inline __m128i geu16(__m128i v, int lim)
+{
+    const __m128i bias = _mm_set1_epi16(-0x8000);
+    return _mm_cmpgt_epi16(_mm_xor_si128(v, bias), _mm_set1_epi16(short((lim-1)^0x8000)));
+}
+
+// count of 16 bit lanes set in a mask
+inline size_t lanes(__m128i mask)
+{
+    return __builtin_popcount(_mm_movemask_epi8(mask))/2;
+}
+#endif
+
+template<class Op>
+size_t packedVarintSize(const typename Op::value_type *val, size_t count)
+{
+    size_t len = count, i = 0;
+#ifdef USE_SSE2
+    for(; count-i >= 8; i+=8) {
+        __m128i K = Op::key(_mm_loadu_si128((const __m128i*)&val[i]));
+        len += lanes(geu16(K, Op::one)) + lanes(geu16(K, Op::two));
+    }
+#endif
+    for(; i<count; i++)
+        len += varintSize(Op::scalar(val[i]))-1;
+    return len;
+}
+
+template<class Op>
+char* putPackedVarint(char *p, const typename Op::value_type *val, size_t count)
+{
+    size_t i = 0;
+#ifdef USE_SSE2
+    for(; count-i >= 8; i+=8) {
+        __m128i V = _mm_loadu_si128((const __m128i*)&val[i]);
+        if(!_mm_movemask_epi8(geu16(Op::key(V), Op::one))) {
+            // all single byte
+            _mm_storel_epi64((__m128i*)p, _mm_packus_epi16(Op::low(V), _mm_setzero_si128()));
+            p += 8;
+        } else {
+            for(size_t j=i; j<i+8; j++)
+                p = putVarint(p, Op::scalar(val[j]));
+        }
+    }
+#endif
+    for(; i<count; i++)
+        p = putVarint(p, Op::scalar(val[i]));
+    return p;
+}
+
+} // namespace
+
+size_t packedSize(const dbr_short_t *val, size_t count)
+{
+    return packedVarintSize<shortop>(val, count);
+}
+
+char* putPacked(char *p, const dbr_short_t *val, size_t count)
+{
+    return putPackedVarint<shortop>(p, val, count);
+}
+
+size_t packedSize(const dbr_enum_t *val, size_t count)
+{
+    return packedVarintSize<enumop>(val, count);
+}
+
+char* putPacked(char *p, const dbr_enum_t *val, size_t count)
+{
+    return putPackedVarint<enumop>(p, val, count);
+}
+
+bool samplerun::push()
+{
+    // the value, severity and status, between the time and the fieldvalues
+    size_t len = next.fields-next.value;
+    if(held && next.fields==next.buf.size() && repeats<0xffffffffu
+            && first.fields-first.value==len
+            && memcmp(&first.buf[first.value], &next.buf[next.value], len)==0) {
+        repeats++;
+        last.swap(next);
+        return true;
+    }
+    if(held)
+        put(first, repeats);
+    first.swap(next);
+    held = true;
+    repeats = 0;
+    return false;
+}
+
+void samplerun::finish()
+{
+    if(!held)
+        return;
+    if(repeats) {
+        put(first, repeats-1);
+        put(last, 0);
+    } else {
+        put(first, 0);
+    }
+    held = false;
+    repeats = 0;
+}
+
+void samplerun::put(const message& msg, uint32 repeatcount)
+{
+    // repeatcount goes before the fieldvalues, as the generated classes order fields by number
+    esc.escape(&msg.buf[0], msg.fields);
+    if(repeatcount) {
+        char field[6];
+        field[0] = tag(6, Varint);
+        esc.escape(field, putVarint(field+1, repeatcount)-field);
+    }
+    esc.escape(&msg.buf[0]+msg.fields, msg.buf.size()-msg.fields);
+    esc.outbuf.push_back('\n');
+    nlines++;
+}
+
+} // namespace pbwire
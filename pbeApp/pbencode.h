@@ -0,0 +1,501 @@
+#ifndef PBENCODE_H
+#define PBENCODE_H
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <epicsTypes.h>
+#include <epicsEndian.h>
+#include <db_access.h>
+// Storage
+#include <RawValue.h>
+
+#include <google/protobuf/stubs/common.h>
+
+#include "pbstreams.h"
+#include "EPICSEvent.pb.h"
+
+/* Type information lookup, indexed by DBR_* type, and whether the PV is an array.
+ * Looks up:
+ *  typename dbrstruct<DBR,isarray>::dbrtype (ie. struct dbr_time_double)
+ *  typename dbrstruct<DBR,isarray>::pbtype (ie. class EPICS::ScalarDouble)
+ *  dbrstruct<DBR,isarray>::pbcode (an enum PayloadType value cast to int, ie. EPICS::SCALAR_DOUBLE)
+ */
+template<int dbr, int isarray> struct dbrstruct{};
+#define ENTRY(ARR, DBR, dbr, PBC, PT) \
+template<> struct dbrstruct<DBR, ARR> {typedef dbr dbrtype; typedef EPICS::PBC pbtype; enum {pbcode=EPICS::PT};}
+ENTRY(0, DBR_TIME_STRING, dbr_time_string, ScalarString, SCALAR_STRING);
+ENTRY(0, DBR_TIME_CHAR, dbr_time_char, ScalarByte, SCALAR_BYTE);
+ENTRY(0, DBR_TIME_SHORT, dbr_time_short, ScalarShort, SCALAR_SHORT);
+ENTRY(0, DBR_TIME_ENUM, dbr_time_enum, ScalarEnum, SCALAR_ENUM);
+ENTRY(0, DBR_TIME_LONG, dbr_time_long, ScalarInt, SCALAR_INT);
+ENTRY(0, DBR_TIME_FLOAT, dbr_time_float, ScalarFloat, SCALAR_FLOAT);
+ENTRY(0, DBR_TIME_DOUBLE, dbr_time_double, ScalarDouble, SCALAR_DOUBLE);
+ENTRY(1, DBR_TIME_STRING, dbr_time_string, VectorString, WAVEFORM_STRING);
+ENTRY(1, DBR_TIME_CHAR, dbr_time_char, VectorChar, WAVEFORM_BYTE);
+ENTRY(1, DBR_TIME_SHORT, dbr_time_short, VectorShort, WAVEFORM_SHORT);
+ENTRY(1, DBR_TIME_ENUM, dbr_time_enum, VectorEnum, WAVEFORM_ENUM);
+ENTRY(1, DBR_TIME_LONG, dbr_time_long, VectorInt, WAVEFORM_INT);
+ENTRY(1, DBR_TIME_FLOAT, dbr_time_float, VectorFloat, WAVEFORM_FLOAT);
+ENTRY(1, DBR_TIME_DOUBLE, dbr_time_double, VectorDouble, WAVEFORM_DOUBLE);
+#undef ENTRY
+
+/* Assign a sample value through the generated PB classes.
+ *  valueop<DBR,isarray>::set(PBClass, dbr_* pointer, # of elements)
+ *   Assign a scalar or array to the .val of a PB class instance (ie. EPICS::ScalarDouble)
+ * This is the reference for sampleencoder<>, which transcode_samples<>() uses.
+ */
+template<int dbr, int isarray> struct valueop {
+    static void set(typename dbrstruct<dbr,isarray>::pbtype& pbc,
+                    const typename dbrstruct<dbr,isarray>::dbrtype* pdbr,
+                    DbrCount)
+    {
+        pbc.set_val(pdbr->value);
+    }
+};
+
+// Partial specialization for arrays (works for numerics and scalar string)
+// does this work for array of string? Verified by jbobnar: YES, it works for array of strings
+template<int dbr> struct valueop<dbr,1> {
+    static void set(typename dbrstruct<dbr,1>::pbtype& pbc,
+                    const typename dbrstruct<dbr,1>::dbrtype* pdbr,
+                    DbrCount count)
+    {
+        pbc.mutable_val()->Reserve(count);
+        for(DbrCount i=0; i<count; i++)
+            pbc.add_val((&pdbr->value)[i]);
+    }
+};
+
+// specialization for scalar char
+template<> struct valueop<DBR_TIME_CHAR,0> {
+    static void set(EPICS::ScalarByte& pbc,
+                    const dbr_time_char* pdbr,
+                    DbrCount)
+    {
+        char buf[2];
+        buf[0] = pdbr->value;
+        buf[1] = '\0';
+        pbc.set_val(buf);
+    }
+};
+
+// specialization for vector char
+template<> struct valueop<DBR_TIME_CHAR,1> {
+    static void set(EPICS::VectorChar& pbc,
+                    const dbr_time_char* pdbr,
+                    DbrCount count)
+    {
+        const epicsUInt8 *pbuf = &pdbr->value;
+        pbc.set_val((const char*)pbuf, count);
+    }
+};
+
+/* Direct encoding of the PB wire format.
+ * Every sample message type has the same fields
+ *  1 secondsintoyear, 2 nano, 3 val, 4 severity, 5 status, 7 fieldvalues
+ * and only differs in the encoding of 'val'.
+ */
+namespace pbwire {
+typedef google::protobuf::int32 int32;
+typedef google::protobuf::int64 int64;
+typedef google::protobuf::uint32 uint32;
+typedef google::protobuf::uint64 uint64;
+
+enum wiretype {
+    Varint = 0,
+    Fixed64 = 1,
+    LengthDelimited = 2,
+    Fixed32 = 5
+};
+
+// All field numbers used are <16, so every tag is one byte
+inline char tag(unsigned field, wiretype wt) { return char((field<<3)|wt); }
+
+inline size_t varintSize(uint64 v)
+{
+    size_t n = 1;
+    for(; v>=0x80; v>>=7)
+        n++;
+    return n;
+}
+
+inline char* putVarint(char *p, uint64 v)
+{
+    for(; v>=0x80; v>>=7)
+        *p++ = char(v|0x80);
+    *p++ = char(v);
+    return p;
+}
+
+// int32 fields are sign extended to 64 bits
+inline uint64 int32Varint(int32 v) { return uint64(int64(v)); }
+
+// sint32 fields
+inline uint32 zigzag(int32 v) { return (uint32(v)<<1) ^ uint32(v>>31); }
+
+// Fixed width values are always little endian
+inline char* putFixed32(char *p, uint32 v)
+{
+    p[0] = char(v);
+    p[1] = char(v>>8);
+    p[2] = char(v>>16);
+    p[3] = char(v>>24);
+    return p+4;
+}
+
+inline char* putFixed64(char *p, uint64 v)
+{
+    p = putFixed32(p, uint32(v));
+    return putFixed32(p, uint32(v>>32));
+}
+
+inline char* putBytes(char *p, unsigned field, const char *s, size_t len)
+{
+    *p++ = tag(field, LengthDelimited);
+    p = putVarint(p, len);
+    memcpy(p, s, len);
+    return p+len;
+}
+
+inline size_t bytesSize(size_t len) { return 1+varintSize(len)+len; }
+
+/* Numeric value encoding, selected by the type of dbr_time_*::value
+ *  wire(v) - wire type of a scalar
+ *  size(v) - encoded size, w/o tag
+ *  put(p, v) - encode w/o tag
+ */
+inline wiretype wire(dbr_short_t) { return Varint; }
+inline size_t size(dbr_short_t v) { return varintSize(zigzag(v)); }
+inline char* put(char *p, dbr_short_t v) { return putVarint(p, zigzag(v)); }
+
+inline wiretype wire(dbr_enum_t) { return Varint; }
+inline size_t size(dbr_enum_t v) { return varintSize(zigzag(int32(v))); }
+inline char* put(char *p, dbr_enum_t v) { return putVarint(p, zigzag(int32(v))); }
+
+inline wiretype wire(dbr_long_t) { return Fixed32; }
+inline size_t size(dbr_long_t) { return 4; }
+inline char* put(char *p, dbr_long_t v) { return putFixed32(p, uint32(v)); }
+
+inline wiretype wire(dbr_float_t) { return Fixed32; }
+inline size_t size(dbr_float_t) { return 4; }
+inline char* put(char *p, dbr_float_t v)
+{
+    uint32 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return putFixed32(p, bits);
+}
+
+inline wiretype wire(dbr_double_t) { return Fixed64; }
+inline size_t size(dbr_double_t) { return 8; }
+inline char* put(char *p, dbr_double_t v)
+{
+    uint64 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return putFixed64(p, bits);
+}
+
+/* Packed arrays of numeric values
+ *  packedSize(val, count) - encoded size, w/o tag and length
+ *  putPacked(p, val, count) - encode w/o tag and length
+ * Fixed width values are copied as a block, where the host byte order allows.
+ */
+size_t packedSize(const dbr_short_t *val, size_t count);
+char* putPacked(char *p, const dbr_short_t *val, size_t count);
+size_t packedSize(const dbr_enum_t *val, size_t count);
+char* putPacked(char *p, const dbr_enum_t *val, size_t count);
+
+template<typename T>
+inline size_t packedSize(const T*, size_t count) { return count*sizeof(T); }
+
+template<typename T>
+inline char* putPacked(char *p, const T *val, size_t count)
+{
+#if EPICS_BYTE_ORDER==EPICS_ENDIAN_LITTLE && EPICS_FLOAT_WORD_ORDER==EPICS_ENDIAN_LITTLE
+    memcpy(p, val, count*sizeof(T));
+    return p+count*sizeof(T);
+#else
+    for(size_t i=0; i<count; i++)
+        p = put(p, val[i]);
+    return p;
+#endif
+}
+
+/* Encoding of the 'val' field (#3), including tag.
+ *  valueenc<DBR,isarray>::size(dbr_* pointer, # of elements)
+ *  valueenc<DBR,isarray>::put(buffer, dbr_* pointer, # of elements)
+ */
+// scalar numerics
+template<int dbr, int isarray> struct valueenc {
+    typedef typename dbrstruct<dbr,isarray>::dbrtype dbrtype;
+    static size_t size(const dbrtype* pdbr, DbrCount)
+    {
+        return 1+pbwire::size(pdbr->value);
+    }
+    static char* put(char *p, const dbrtype* pdbr, DbrCount)
+    {
+        *p++ = tag(3, wire(pdbr->value));
+        return pbwire::put(p, pdbr->value);
+    }
+};
+
+// numeric arrays are packed
+template<int dbr> struct valueenc<dbr,1> {
+    typedef typename dbrstruct<dbr,1>::dbrtype dbrtype;
+    static size_t size(const dbrtype* pdbr, DbrCount count)
+    {
+        // an empty packed field is omitted
+        return count ? bytesSize(packedSize(&pdbr->value, count)) : 0;
+    }
+    static char* put(char *p, const dbrtype* pdbr, DbrCount count)
+    {
+        if(!count)
+            return p;
+        *p++ = tag(3, LengthDelimited);
+        p = putVarint(p, packedSize(&pdbr->value, count));
+        return putPacked(p, &pdbr->value, count);
+    }
+};
+
+template<> struct valueenc<DBR_TIME_STRING,0> {
+    static size_t size(const dbr_time_string* pdbr, DbrCount)
+    {
+        return bytesSize(strnlen(pdbr->value, MAX_STRING_SIZE));
+    }
+    static char* put(char *p, const dbr_time_string* pdbr, DbrCount)
+    {
+        return putBytes(p, 3, pdbr->value, strnlen(pdbr->value, MAX_STRING_SIZE));
+    }
+};
+
+// not packed, each element has a tag
+template<> struct valueenc<DBR_TIME_STRING,1> {
+    static size_t size(const dbr_time_string* pdbr, DbrCount count)
+    {
+        const dbr_string_t *val = &pdbr->value;
+        size_t len = 0;
+        for(DbrCount i=0; i<count; i++)
+            len += bytesSize(strnlen(val[i], MAX_STRING_SIZE));
+        return len;
+    }
+    static char* put(char *p, const dbr_time_string* pdbr, DbrCount count)
+    {
+        const dbr_string_t *val = &pdbr->value;
+        for(DbrCount i=0; i<count; i++)
+            p = putBytes(p, 3, val[i], strnlen(val[i], MAX_STRING_SIZE));
+        return p;
+    }
+};
+
+// a one character string, empty for a zero value
+template<> struct valueenc<DBR_TIME_CHAR,0> {
+    static size_t size(const dbr_time_char* pdbr, DbrCount)
+    {
+        return bytesSize(pdbr->value ? 1 : 0);
+    }
+    static char* put(char *p, const dbr_time_char* pdbr, DbrCount)
+    {
+        return putBytes(p, 3, (const char*)&pdbr->value, pdbr->value ? 1 : 0);
+    }
+};
+
+// the whole array, which may contain nils
+template<> struct valueenc<DBR_TIME_CHAR,1> {
+    static size_t size(const dbr_time_char*, DbrCount count)
+    {
+        return bytesSize(count);
+    }
+    static char* put(char *p, const dbr_time_char* pdbr, DbrCount count)
+    {
+        return putBytes(p, 3, (const char*)&pdbr->value, count);
+    }
+};
+
+/* Append one element of the repeated 'fieldvalues' (#7) to a block of
+ * pre-encoded fields, which is later passed to sampleencoder.
+ */
+inline void appendFieldValue(std::string& out, const char *name, size_t namelen,
+                             const char *val, size_t vallen)
+{
+    size_t len = bytesSize(namelen) + bytesSize(vallen);
+    std::string::size_type start = out.size();
+    out.resize(start + bytesSize(len));
+    char *p = &out[start];
+    *p++ = tag(7, LengthDelimited);
+    p = putVarint(p, len);
+    p = putBytes(p, 1, name, namelen);
+    p = putBytes(p, 2, val, vallen);
+}
+
+inline void appendFieldValue(std::string& out, const char *name, const char *val, size_t vallen)
+{
+    appendFieldValue(out, name, strlen(name), val, vallen);
+}
+
+inline void appendFieldValue(std::string& out, const char *name, const char *val)
+{
+    appendFieldValue(out, name, strlen(name), val, strlen(val));
+}
+
+inline void appendFieldValue(std::string& out, const std::string& name, const std::string& val)
+{
+    appendFieldValue(out, name.c_str(), name.size(), val.c_str(), val.size());
+}
+
+/* Encode one sample as a PB message of type dbrstruct<DBR,isarray>::pbtype
+ * The result is byte identical to setting the same values, in the same way,
+ * through the generated class.  Severity and status are omitted when zero.
+ *
+ *   sampleencoder<DBR_TIME_DOUBLE,0> enc(sample, 1, secintoyear, fields);
+ *   buf.resize(enc.size());
+ *   enc.encode(&buf[0]);
+ */
+template<int dbr, int isarray>
+class sampleencoder
+{
+public:
+    typedef typename dbrstruct<dbr,isarray>::dbrtype dbrtype;
+
+    // 'fields' is a block built by appendFieldValue(), and must out live this encoder
+    sampleencoder(const dbrtype *sample, DbrCount count, uint32 secondsintoyear,
+                  const std::string& fields)
+        :sample(sample)
+        ,count(count)
+        ,secondsintoyear(secondsintoyear)
+        ,fields(fields)
+    {
+        nbytes = 1 + varintSize(secondsintoyear)
+               + 1 + varintSize(sample->stamp.nsec)
+               + valueenc<dbr,isarray>::size(sample, count)
+               + fields.size();
+        if(sample->severity!=0)
+            nbytes += 1 + varintSize(int32Varint(sample->severity));
+        if(sample->status!=0)
+            nbytes += 1 + varintSize(int32Varint(sample->status));
+    }
+
+    // exact size of the encoded message
+    size_t size() const { return nbytes; }
+    // Offsets in the message of the value, after the time, and of the fieldvalues
+    size_t valueOffset() const { return 2 + varintSize(secondsintoyear) + varintSize(sample->stamp.nsec); }
+    size_t fieldsOffset() const { return nbytes - fields.size(); }
+
+    // Write size() bytes to 'p'.  Returns the end of the message.
+    char* encode(char *p) const
+    {
+        *p++ = tag(1, Varint);
+        p = putVarint(p, secondsintoyear);
+        *p++ = tag(2, Varint);
+        p = putVarint(p, sample->stamp.nsec);
+        p = valueenc<dbr,isarray>::put(p, sample, count);
+        if(sample->severity!=0) {
+            *p++ = tag(4, Varint);
+            p = putVarint(p, int32Varint(sample->severity));
+        }
+        if(sample->status!=0) {
+            *p++ = tag(5, Varint);
+            p = putVarint(p, int32Varint(sample->status));
+        }
+        if(!fields.empty()) {
+            memcpy(p, fields.data(), fields.size());
+            p += fields.size();
+        }
+        return p;
+    }
+
+private:
+    const dbrtype *sample;
+    DbrCount count;
+    uint32 secondsintoyear;
+    const std::string& fields;
+    size_t nbytes;
+};
+
+// Encode directly into the stream's buffer.  Not escaped until strm.finalize()
+template<class Encoder>
+void encode(escapingarraystream& strm, const Encoder& enc)
+{
+    void *chunk;
+    int avail;
+    strm.reserve(enc.size());
+    strm.Next(&chunk, &avail);
+    char *start = (char*)chunk;
+    strm.BackUp(avail - int(enc.encode(start) - start));
+}
+
+/* Encode and escape.
+ * After which strm.outbuf holds the complete escaped line.
+ */
+template<class Encoder>
+void serialize(escapingarraystream& strm, const Encoder& enc)
+{
+    encode(strm, enc);
+    strm.finalize();
+}
+
+/* Run-length collapse of identical samples, with the 'repeatcount' field (#6).
+ *
+ * A sample with the same value, severity and status as the one before, and
+ * no fieldvalues, is folded into the first sample of the run.  That is
+ * written with its own time when a sample differs, with repeatcount set to
+ * the number of samples folded into it.  At the end of a file, the last
+ * sample of a run is written by itself, so that the last line has the time
+ * of the last sample read, from which a resume continues.
+ *
+ *   run.add(enc);
+ *   out.write(&run.lines()[0], run.lines().size()); // if not empty
+ *   run.lines().clear();
+ *   ...
+ *   run.finish(); // and write what remains
+ */
+class samplerun
+{
+public:
+    samplerun() :nlines(0), held(false), repeats(0) {}
+
+    // Returns true if folded into the current run
+    template<class Encoder>
+    bool add(const Encoder& enc)
+    {
+        next.buf.resize(enc.size());
+        enc.encode(&next.buf[0]);
+        next.value = enc.valueOffset();
+        next.fields = enc.fieldsOffset();
+        return push();
+    }
+
+    // Write out the current run, before a new file
+    void finish();
+
+    // Escaped lines, w/ EOL, to be written.  Cleared by the caller.
+    std::vector<char>& lines() { return esc.outbuf; }
+    // # of lines ever added to lines()
+    size_t nlines;
+
+private:
+    struct message {
+        std::vector<char> buf;
+        size_t value, fields;
+        void swap(message& o)
+        {
+            buf.swap(o.buf);
+            std::swap(value, o.value);
+            std::swap(fields, o.fields);
+        }
+    };
+    // first and last samples of the run, and the one being added
+    message first, last, next;
+    bool held;
+    uint32 repeats;
+    escapingarraystream esc;
+
+    bool push();
+    void put(const message& msg, uint32 repeatcount);
+};
+
+} // namespace pbwire
+
+#endif // PBENCODE_H
@@ -5,16 +5,21 @@
 #include <errno.h>
 #include <stdlib.h>
 
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <iostream>
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <stdexcept>
 
 #include <epicsTime.h>
 #include <osiFileName.h>
 
+#include "pbeutil.h"
+
 static const char pvseps_def[] = ":-{}";
 const char *pvseps = pvseps_def;
 
@@ -36,24 +41,66 @@ std::string pvpathname(const char* pvname)
     return fname;
 }
 
-// Recurisvely create (if needed) the directory components of the path
-void createDirs(const std::string& path)
+// Search backwards from 'end' for the last EOL before it.
+// Returns its offset, or -1 if there is none.
+static off_t findEOLBefore(int fd, off_t end)
 {
-    size_t p=0;
-    while((p=path.find_first_of(pathsep[0], p))!=std::string::npos)
-    {
-        std::string part(path.substr(0, p));
-        p++;
-        if(mkdir(part.c_str(), 0755)!=0)
-            switch(errno) {
-            case EEXIST:
-                break;
-            default:
-                perror("mkdir");
-            }
-        else
-            std::cerr<<"Create directory "<<part<<"\n";
+    char buf[4096];
+    while(end>0) {
+        size_t n = std::min(off_t(sizeof(buf)), end);
+        ssize_t ret = pread(fd, buf, n, end-n);
+        if(ret!=ssize_t(n))
+            throw std::runtime_error("pread failed");
+        end -= n;
+        for(size_t i=n; i; i--) {
+            if(buf[i-1]=='\n')
+                return end+i-1;
+        }
+    }
+    return -1;
+}
+
+/* Read the last complete line of a file, without reading the rest.
+ * A partial line at the end, left by an interrupted write, is truncated away.
+ * On success 'line' is the line w/o EOL (still escaped), and *first is set
+ * if it is also the first line of the file (ie. the header).
+ * Returns false if the file has no complete line.
+ */
+bool readLastLine(int fd, std::vector<char>& line, bool *first)
+{
+    struct stat info;
+    if(fstat(fd, &info)!=0)
+        throw std::runtime_error("fstat failed");
+
+    off_t eol = findEOLBefore(fd, info.st_size);
+    if(eol+1!=info.st_size) {
+        std::cerr<<"WARN: truncating partial line of "<<(info.st_size-eol-1)<<" bytes\n";
+        if(ftruncate(fd, eol+1)!=0)
+            throw std::runtime_error("ftruncate failed");
     }
+    if(eol<0)
+        return false;
+
+    off_t start = findEOLBefore(fd, eol)+1;
+    *first = start==0;
+
+    line.resize(eol-start);
+    if(line.size() && pread(fd, &line[0], line.size(), start)!=ssize_t(line.size()))
+        throw std::runtime_error("pread failed");
+    return true;
+}
+
+size_t formatDecimal(char *buf, unsigned long val)
+{
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + val%10;
+        val /= 10;
+    } while(val);
+    for(size_t i=0; i<n; i++)
+        buf[i] = digits[n-1-i];
+    return n;
 }
 
 // Get the year in which the given timestamp falls
@@ -80,6 +127,123 @@ void getStartOfYear(int year, epicsTimeStamp* t)
     t->nsec = 0;
 }
 
+bool parsePartition(const char *name, Partition *part)
+{
+    static const struct {
+        const char *name;
+        Partition part;
+    } names[] = {
+        {"year", PartitionYear},
+        {"month", PartitionMonth},
+        {"day", PartitionDay},
+        {"hour", PartitionHour},
+    };
+    for(size_t i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+        if(strcmp(name, names[i].name)==0) {
+            *part = names[i].part;
+            return true;
+        }
+    }
+    return false;
+}
+
+void getPartition(const epicsTimeStamp& t, Partition part, epicsTimeStamp *start,
+                  epicsTimeStamp *end, std::string *name)
+{
+    time_t sec = t.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH;
+    tm op;
+    if(!gmtime_r(&sec, &op))
+        throw std::runtime_error("gmtime_r failed");
+
+    // the start of the partition, and of the next
+    tm next;
+    op.tm_sec = 0;
+    op.tm_isdst = 0;
+    if(part!=PartitionHour)
+        op.tm_hour = 0;
+    if(part==PartitionMonth || part==PartitionYear)
+        op.tm_mday = 1;
+    if(part==PartitionYear)
+        op.tm_mon = 0;
+    op.tm_min = 0;
+    next = op;
+    switch(part) {
+    case PartitionYear: next.tm_year++; break;
+    case PartitionMonth: next.tm_mon++; break;
+    case PartitionDay: next.tm_mday++; break;
+    case PartitionHour: next.tm_hour++; break;
+    }
+    // timegm() normalizes the month, day, and hour which were incremented
+    start->secPastEpoch = timegm(&op) - POSIX_TIME_AT_EPICS_EPOCH;
+    start->nsec = 0;
+    end->secPastEpoch = timegm(&next) - POSIX_TIME_AT_EPICS_EPOCH;
+    end->nsec = 0;
+
+    char buf[64];
+    switch(part) {
+    case PartitionYear:
+        sprintf(buf, "%04d", 1900+op.tm_year); break;
+    case PartitionMonth:
+        sprintf(buf, "%04d_%02d", 1900+op.tm_year, 1+op.tm_mon); break;
+    case PartitionDay:
+        sprintf(buf, "%04d_%02d_%02d", 1900+op.tm_year, 1+op.tm_mon, op.tm_mday); break;
+    case PartitionHour:
+        sprintf(buf, "%04d_%02d_%02d_%02d", 1900+op.tm_year, 1+op.tm_mon, op.tm_mday, op.tm_hour); break;
+    }
+    *name = buf;
+}
+
+// Parse a UTC time "YYYY-MM-DD[(T| )HH:MM[:SS[.fraction]]][Z]"
+bool parseTime(const char *txt, epicsTimeStamp *t)
+{
+    tm op;
+    memset(&op, 0, sizeof(op));
+    int n = 0;
+    if(sscanf(txt, "%4d-%2d-%2d%n", &op.tm_year, &op.tm_mon, &op.tm_mday, &n)!=3)
+        return false;
+    txt += n;
+
+    unsigned long nsec = 0;
+    if(*txt=='T' || *txt==' ') {
+        txt++;
+        n = 0;
+        if(sscanf(txt, "%2d:%2d%n", &op.tm_hour, &op.tm_min, &n)!=2 || n!=5)
+            return false;
+        txt += n;
+        if(*txt==':') {
+            txt++;
+            n = 0;
+            if(sscanf(txt, "%2d%n", &op.tm_sec, &n)!=1 || n!=2)
+                return false;
+            txt += n;
+            if(*txt=='.') {
+                txt++;
+                unsigned long scale = 100000000ul;
+                if(*txt<'0' || *txt>'9')
+                    return false;
+                for(; *txt>='0' && *txt<='9'; txt++, scale /= 10)
+                    nsec += (*txt-'0')*scale;
+            }
+        }
+    }
+    if(*txt=='Z')
+        txt++;
+    if(*txt!='\0')
+        return false;
+
+    if(op.tm_mon<1 || op.tm_mon>12 || op.tm_mday<1 || op.tm_mday>31
+            || op.tm_hour>23 || op.tm_min>59 || op.tm_sec>60)
+        return false;
+    op.tm_year -= 1900;
+    op.tm_mon -= 1;
+    time_t sec = timegm(&op);
+    if(sec<POSIX_TIME_AT_EPICS_EPOCH)
+        return false;
+    t->secPastEpoch = sec - POSIX_TIME_AT_EPICS_EPOCH;
+    t->nsec = nsec;
+    return true;
+}
+
 int unescape(const char *in, size_t inlen, char *out, size_t outlen)
 {
     char *initout = out;
@@ -128,6 +292,18 @@ size_t unescape_plan(const char *in, size_t inlen)
     return outlen;
 }
 
+void printTime(std::ostream& strm, const epicsTimeStamp& t)
+{
+    time_t sec = t.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH;
+    tm result;
+    char buf[40];
+    if(!gmtime_r(&sec, &result) || !strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &result))
+        throw std::runtime_error("Can't format time");
+    char frac[12];
+    sprintf(frac, ".%09u", (unsigned)t.nsec);
+    strm<<buf<<frac<<"Z";
+}
+
 std::ostream& operator<<(std::ostream& strm, const epicsTime& t)
 {
     time_t_wrapper sec(t);
@@ -2,6 +2,7 @@
 #define PVEUTIL_H
 
 #include <string>
+#include <vector>
 
 #include <epicsTime.h>
 
@@ -11,10 +12,60 @@ std::string pvpathname(const char* pvname);
 size_t unescape_plan(const char *in, size_t inlen);
 int unescape(const char *in, size_t inlen, char *out, size_t outlen);
 
-void createDirs(const std::string& path);
+// Write 'val' in decimal to 'buf', which must hold 20 chars.  Returns the length, w/o nil.
+size_t formatDecimal(char *buf, unsigned long val);
+
+bool readLastLine(int fd, std::vector<char>& line, bool *first);
+
+// true if a is earlier than, or the same time as, b
+inline bool notAfter(const epicsTimeStamp& a, const epicsTimeStamp& b)
+{
+    return a.secPastEpoch<b.secPastEpoch || (a.secPastEpoch==b.secPastEpoch && a.nsec<=b.nsec);
+}
+
+/* Samples from 'start' and before 'end'.  A time of 0 (the EPICS epoch)
+ * leaves that side open.
+ */
+struct TimeWindow
+{
+    epicsTimeStamp start, end;
+    TimeWindow() { start.secPastEpoch = start.nsec = end.secPastEpoch = end.nsec = 0; }
+    bool hasStart() const { return start.secPastEpoch || start.nsec; }
+    bool hasEnd() const { return end.secPastEpoch || end.nsec; }
+    bool bounded() const { return hasStart() || hasEnd(); }
+    // t is at or after the end
+    bool pastEnd(const epicsTimeStamp& t) const { return hasEnd() && notAfter(end, t); }
+};
+
+// The disconnected severities, which are not written
+inline bool isDisconnected(int sevr)
+{
+    return sevr==3904 || sevr==3872 || sevr==3848;
+}
 
 void getYear(const epicsTimeStamp& t, int *year);
 void getStartOfYear(int year, epicsTimeStamp* t);
+/* The span of time covered by one output file, as for the Archiver Appliance
+ * PlainPB partitions.  secondsintoyear is always counted from the start of the
+ * year, whatever the partition.
+ */
+enum Partition {
+    PartitionYear,  // pv:2015.pb
+    PartitionMonth, // pv:2015_03.pb
+    PartitionDay,   // pv:2015_03_04.pb
+    PartitionHour   // pv:2015_03_04_18.pb
+};
+
+// Parse "year", "month", "day", or "hour"
+bool parsePartition(const char *name, Partition *part);
+// The partition containing t, as [start, end), and the name of its files without ".pb"
+void getPartition(const epicsTimeStamp& t, Partition part, epicsTimeStamp *start,
+                  epicsTimeStamp *end, std::string *name);
+
+// Parse an ISO 8601 UTC time, "YYYY-MM-DD[(T| )HH:MM[:SS[.fraction]]][Z]"
+bool parseTime(const char *txt, epicsTimeStamp *t);
+// Print as ISO 8601 UTC, with nanoseconds
+void printTime(std::ostream& strm, const epicsTimeStamp& t);
 
 std::ostream& operator<<(std::ostream& strm, const epicsTime& t);
 
@@ -1,8 +1,11 @@
 
 #include <time.h>
+#include <signal.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <algorithm>
 
 
@@ -11,10 +14,17 @@
 #include <sstream>
 #include <fstream>
 #include <stdexcept>
+#include <deque>
+#include <set>
+#include <vector>
 
 // Base
 #include <epicsVersion.h>
 #include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
 // Tools
 #include <AutoPtr.h>
 #include <BinaryTree.h>
@@ -24,478 +34,912 @@
 // Storage
 #include <SpreadsheetReader.h>
 #include <AutoIndex.h>
+#include <DataFile.h>
 
 #include "pbstreams.h"
+#include "pbwriter.h"
+#include "pbbinwriter.h"
 #include "pbeutil.h"
+#include "pbmanifest.h"
+#include "pbstats.h"
+#include "pbreadahead.h"
+#include "pblocked.h"
+#include "pbdircache.h"
+#include "pbmerge.h"
+#include "pbthrottle.h"
 #include "EPICSEvent.pb.h"
 
 #include <google/protobuf/stubs/common.h>
 #include <google/protobuf/io/coded_stream.h>
 
-struct PBWriter
-{
-    DataReader& reader;
-    // Last returned sample, or NULL if all consumed
-    const RawValue::Data *samp;
-    const CtrlInfo& info;
-
-    // The year currently being exported
-    int year;
-    DbrType dtype;
-    bool isarray;
-    epicsTimeStamp startofyear;
-    epicsTimeStamp endofyear;
-
-    std::ofstream outpb;
-    int typeChangeError;
-    const stdString name;
-
-    PBWriter(DataReader& reader, stdString pv);
-    void write(); // all work is done through this method
+// Outcome of exporting a single PV
+enum ExportResult {
+    ExportOk,
+    ExportUnchanged,
+    ExportNoData,
+    ExportFailed,
+    ExportSplit   // continued as one job per year
+};
 
-    void prepFile();
+static const char *resultName(ExportResult result)
+{
+    switch(result) {
+    case ExportOk: return "ok";
+    case ExportUnchanged: return "unchanged";
+    case ExportNoData: return "nodata";
+    case ExportFailed: return "failed";
+    case ExportSplit: return "split";
+    }
+    return "?";
+}
 
-    void (*skipForward)(PBWriter&,const char *file);
+// Totals over some number of PVs
+struct ExportCounts
+{
+    unsigned long nwrote;      // samples
+    unsigned long nbytes;      // bytes written to .pb files
+    unsigned long nsyscalls;   // calls to write()/writev()
+    StageStats stages;
 
-    void (*transcode)(PBWriter&); // Points to a transcode_samples<>() specialization
-};
+    ExportCounts() :nwrote(0), nbytes(0), nsyscalls(0) {}
 
-/* Type information lookup, indexed by DBR_* type, and whether the PV is an array.
- * Looks up:
- *  typename dbrstruct<DBR,isarray>::dbrtype (ie. struct dbr_time_double)
- *  typename dbrstruct<DBR,isarray>::pbtype (ie. class EPICS::ScalarDouble)
- *  dbrstruct<DBR,isarray>::pbcode (an enum PayloadType value cast to int, ie. EPICS::SCALAR_DOUBLE)
- */
-template<int dbr, int isarray> struct dbrstruct{};
-#define ENTRY(ARR, DBR, dbr, PBC, PT) \
-template<> struct dbrstruct<DBR, ARR> {typedef dbr dbrtype; typedef EPICS::PBC pbtype; enum {pbcode=EPICS::PT};}
-ENTRY(0, DBR_TIME_STRING, dbr_time_string, ScalarString, SCALAR_STRING);
-ENTRY(0, DBR_TIME_CHAR, dbr_time_char, ScalarByte, SCALAR_BYTE);
-ENTRY(0, DBR_TIME_SHORT, dbr_time_short, ScalarShort, SCALAR_SHORT);
-ENTRY(0, DBR_TIME_ENUM, dbr_time_enum, ScalarEnum, SCALAR_ENUM);
-ENTRY(0, DBR_TIME_LONG, dbr_time_long, ScalarInt, SCALAR_INT);
-ENTRY(0, DBR_TIME_FLOAT, dbr_time_float, ScalarFloat, SCALAR_FLOAT);
-ENTRY(0, DBR_TIME_DOUBLE, dbr_time_double, ScalarDouble, SCALAR_DOUBLE);
-ENTRY(1, DBR_TIME_STRING, dbr_time_string, VectorString, WAVEFORM_STRING);
-ENTRY(1, DBR_TIME_CHAR, dbr_time_char, VectorChar, WAVEFORM_BYTE);
-ENTRY(1, DBR_TIME_SHORT, dbr_time_short, VectorShort, WAVEFORM_SHORT);
-ENTRY(1, DBR_TIME_ENUM, dbr_time_enum, VectorEnum, WAVEFORM_ENUM);
-ENTRY(1, DBR_TIME_LONG, dbr_time_long, VectorInt, WAVEFORM_INT);
-ENTRY(1, DBR_TIME_FLOAT, dbr_time_float, VectorFloat, WAVEFORM_FLOAT);
-ENTRY(1, DBR_TIME_DOUBLE, dbr_time_double, VectorDouble, WAVEFORM_DOUBLE);
-#undef ENTRY
-
-/* Type specific operations helper for transcode_samples<>().
- *  valueop<DBR,isarray>::set(PBClass, dbr_* pointer, # of elements)
- *   Assign a scalar or array to the .val of a PB class instance (ie. EPICS::ScalarDouble)
- */
-template<int dbr, int isarray> struct valueop {
-    static void set(typename dbrstruct<dbr,isarray>::pbtype& pbc,
-                    const typename dbrstruct<dbr,isarray>::dbrtype* pdbr,
-                    DbrCount)
+    void add(const PBWriter& writer)
     {
-        pbc.set_val(pdbr->value);
+        nwrote += writer.nwrote;
+        nbytes += writer.outpb.nbytes;
+        nsyscalls += writer.outpb.nsyscalls;
+        stages += writer.stats;
+        // every write is timed
+        stages.seconds[StageStats::Write] += writer.outpb.seconds;
+        stages.calls[StageStats::Write] += writer.outpb.nsyscalls;
+        stages.timed[StageStats::Write] += writer.outpb.nsyscalls;
     }
-};
-
-// Partial specialization for arrays (works for numerics and scalar string)
-// does this work for array of string? Verified by jbobnar: YES, it works for array of strings
-template<int dbr> struct valueop<dbr,1> {
-    static void set(typename dbrstruct<dbr,1>::pbtype& pbc,
-                    const typename dbrstruct<dbr,1>::dbrtype* pdbr,
-                    DbrCount count)
+    void add(const BinWriter& writer)
     {
-        pbc.mutable_val()->Reserve(count);
-        for(DbrCount i=0; i<count; i++)
-            pbc.add_val((&pdbr->value)[i]);
+        nwrote += writer.nwrote;
+        nbytes += writer.nbytes();
+        nsyscalls += writer.nsyscalls();
+        stages += writer.stats;
+        stages.seconds[StageStats::Write] += writer.seconds();
+        stages.calls[StageStats::Write] += writer.nsyscalls();
+        stages.timed[StageStats::Write] += writer.nsyscalls();
     }
-};
-
-// specialization for scalar char
-template<> struct valueop<DBR_TIME_CHAR,0> {
-    static void set(EPICS::ScalarByte& pbc,
-                    const dbr_time_char* pdbr,
-                    DbrCount)
+    ExportCounts& operator+=(const ExportCounts& o)
     {
-        char buf[2];
-        buf[0] = pdbr->value;
-        buf[1] = '\0';
-        pbc.set_val(buf);
+        nwrote += o.nwrote;
+        nbytes += o.nbytes;
+        nsyscalls += o.nsyscalls;
+        stages += o.stages;
+        return *this;
     }
 };
 
-// specialization for vector char
-template<> struct valueop<DBR_TIME_CHAR,1> {
-    static void set(EPICS::VectorChar& pbc,
-                    const dbr_time_char* pdbr,
-                    DbrCount count)
+static void reportPV(const ExportOptions& opts, const stdString& pvname,
+                     ExportResult result, const ExportCounts& counts)
+{
+    if(opts.stats)
+        opts.stats->pvDone(pvname.c_str(), resultName(result), counts.nwrote,
+                           counts.nbytes, counts.nsyscalls, counts.stages);
+}
+
+// The latest time before t
+static epicsTimeStamp justBefore(epicsTimeStamp t)
+{
+    if(t.nsec) {
+        t.nsec--;
+    } else {
+        t.secPastEpoch--;
+        t.nsec = 999999999;
+    }
+    return t;
+}
+
+// How a PBWriter starts, when not with a whole PV
+struct WriteFrom
+{
+    int onlyyear;
+    epicsUInt32 disconnected_epoch;
+    int prev_severity;
+    // If not 0, the end of the window
+    epicsTimeStamp until;
+    WriteFrom() :onlyyear(0), disconnected_epoch(0), prev_severity(0)
     {
-        const epicsUInt8 *pbuf = &pdbr->value;
-        pbc.set_val((const char*)pbuf);
+        until.secPastEpoch = until.nsec = 0;
     }
 };
 
-template<int dbr, int isarray>
-void transcode_samples(PBWriter& self)
+/* Position 'reader' at the first sample at or after 'at', and note in 'from'
+ * a disconnection still in effect then.  It is noted by the first sample
+ * written, so step back to the last connected sample to find when it started.
+ * find() returns the sample at or before a time, or else the first.
+ */
+static const RawValue::Data *seekTo(DataReader& reader, const stdString& pvname,
+                                    const epicsTimeStamp& at, WriteFrom& from)
 {
-    typedef const typename dbrstruct<dbr,isarray>::dbrtype sample_t;
-    typedef typename dbrstruct<dbr,isarray>::pbtype encoder_t;
-    typedef std::vector<std::pair<std::string, std::string> > fieldvalues_t;
-
-
-    encoder_t encoder;
-    escapingarraystream encbuf;
-    fieldvalues_t fieldvalues;
-
-    epicsUInt32 disconnected_epoch = 0;
-    int prev_severity = 0;
-    unsigned long nwrote=0;
-    int last_day_fields_written = 0;
-
-    //prepare the field values and write them every day
-    //numeric values have all except PREC, which is only for DOUBLE and FLOAT
-    //enum has only labels, string has nothing
-    std::stringstream ss;
-    if (dbr == DBR_TIME_SHORT || dbr == DBR_TIME_INT || dbr == DBR_TIME_LONG || dbr == DBR_TIME_FLOAT
-            || dbr == DBR_TIME_DOUBLE) {
-        ss << self.info.getDisplayHigh();
-        fieldvalues.push_back(std::make_pair("HOPR",ss.str()));
-        ss.str(""); ss.clear(); ss << self.info.getDisplayLow();
-        fieldvalues.push_back(std::make_pair("LOPR",ss.str()));
-        ss.str(""); ss.clear(); ss << self.info.getUnits();
-        fieldvalues.push_back(std::make_pair("EGU",ss.str()));
-        if (!isarray) {
-            ss.str(""); ss.clear(); ss << self.info.getHighAlarm();
-            fieldvalues.push_back(std::make_pair("HIHI",ss.str()));
-            ss.str(""); ss.clear(); ss << self.info.getHighWarning();
-            fieldvalues.push_back(std::make_pair("HIGH",ss.str()));
-            ss.str(""); ss.clear(); ss << self.info.getLowWarning();
-            fieldvalues.push_back(std::make_pair("LOW",ss.str()));
-            ss.str(""); ss.clear(); ss << self.info.getLowAlarm();
-            fieldvalues.push_back(std::make_pair("LOLO",ss.str()));
+    const RawValue::Data *samp;
+    epicsTimeStamp before(at);
+    while(before.secPastEpoch || before.nsec) {
+        before = justBefore(before);
+        epicsTime t(before);
+        samp = reader.find(pvname, &t);
+        if(!samp || !notAfter(samp->stamp, before) || samp->severity<=3)
+            break;
+        if(isDisconnected(samp->severity)) {
+            from.disconnected_epoch = samp->stamp.secPastEpoch;
+            if(samp->severity==3872 || samp->severity==3848)
+                from.prev_severity = samp->severity;
         }
+        before = samp->stamp;
     }
-    if (dbr == DBR_TIME_FLOAT || dbr == DBR_TIME_DOUBLE) {
-        ss.str(""); ss.clear(); ss << self.info.getPrecision();
-        fieldvalues.push_back(std::make_pair("PREC",ss.str()));
-    }
-    if (dbr == DBR_TIME_ENUM) {
-        stdString state;
-        if (self.info.getType() == CtrlInfo::Enumerated) {
-            size_t i, num = self.info.getNumStates();
-            if (num > 0) {
-                self.info.getState(0,state);
-                ss <<state.c_str();
-                for (i = 1; i < num; i++) {
-                    self.info.getState(i,state);
-                    ss << ";" << state.c_str();
-                }
-                fieldvalues.push_back(std::make_pair("states",ss.str()));
-            }
-        }
+
+    epicsTime start(at);
+    samp = reader.find(pvname, &start);
+    while(samp && !notAfter(at, samp->stamp))
+        samp = reader.next();
+    return samp;
+}
+
+// Add what a PBWriter or BinWriter wrote to 'entry'
+template<class Writer>
+static void addWritten(const Writer& writer, Manifest::Entry& entry)
+{
+    if(writer.nwrote && (!entry.count || notAfter(entry.last, writer.last)))
+        entry.last = writer.last;
+    entry.count += writer.nwrote;
+    for(size_t i=0; i<writer.files.size(); i++) {
+        if(std::find(entry.files.begin(), entry.files.end(), writer.files[i])==entry.files.end())
+            entry.files.push_back(writer.files[i]);
     }
+}
 
-    DbrType previousType = self.reader.getType();
-    do{
-        if (self.reader.getType() != previousType) {
-            std::cerr<<"ERROR: The type of PV "<<self.name.c_str()<<" changed from " << previousType << " to " << self.reader.getType() << "\n";
-            std::cerr<<"wrote: "<<nwrote<<"\n";
-            self.typeChangeError += 1;
-            return;
+/* Write the samples from the current one of 'reader' on, and add them to 'entry'.
+ * Returns false if a file could not be written.
+ */
+static bool writeSamples(DataReader& reader, const stdString& pvname, const ExportOptions& opts,
+                         const WriteFrom& from, ExportCounts *counts, Manifest::Entry& entry)
+{
+    AutoPtr<DataReader> throttled;
+    if(opts.throttle)
+        throttled = new ThrottledReader(reader, *opts.throttle);
+    DataReader& source = throttled ? *throttled : reader;
+
+    // reads from here on may overlap with encoding and writing
+    AutoPtr<DataReader> ahead;
+    if(opts.readahead)
+        ahead = new ReadAheadReader(source, opts.readahead);
+    if(opts.binsize) {
+        if(BinWriter::binnable(reader.getType(), reader.getCount())) {
+            BinWriter writer(ahead ? *ahead : source,pvname,opts);
+            writer.onlyyear = from.onlyyear;
+            writer.until = from.until;
+            writer.disconnected_epoch = from.disconnected_epoch;
+            writer.prev_severity = from.prev_severity;
+            try {
+                writer.write();
+            } catch(...) {
+                counts->add(writer);
+                throw;
+            }
+            counts->add(writer);
+            std::cerr<<"Wrote "<<writer.nwrote<<" bins, "<<writer.nbytes()<<" bytes with "
+                     <<writer.nsyscalls()<<" writes\n";
+            if(!writer.good())
+                return false;
+            addWritten(writer, entry);
+            return true;
         }
-        previousType = self.reader.getType();
-        sample_t *sample = (sample_t*)self.samp;
+        std::cerr<<"Not binned, type "<<reader.getType()<<" count "<<reader.getCount()<<"\n";
+    }
 
-        if(sample->stamp.secPastEpoch>=self.endofyear.secPastEpoch) {
-            std::cerr<<"Year boundary "<<sample->stamp.secPastEpoch<<" "<<self.endofyear.secPastEpoch <<"\n";
-            std::cerr<<"wrote: "<<nwrote<<"\n";
-            self.typeChangeError = 0;
-            return;
-        }
-        unsigned int secintoyear = sample->stamp.secPastEpoch - self.startofyear.secPastEpoch;
+    PBWriter writer(ahead ? *ahead : source,pvname,opts);
+    writer.onlyyear = from.onlyyear;
+    writer.until = from.until;
+    writer.disconnected_epoch = from.disconnected_epoch;
+    writer.prev_severity = from.prev_severity;
+    try {
+        writer.write();
+    } catch(...) {
+        counts->add(writer);
+        throw;
+    }
+    counts->add(writer);
+    std::cerr<<"Wrote "<<writer.nwrote<<" samples, "<<writer.outpb.nbytes<<" bytes with "
+             <<writer.outpb.nsyscalls<<" writes\n";
+    if(opts.census)
+        opts.census->add(pvname.c_str(), writer.census);
+    if(!writer.outpb.good() || writer.windowclash)
+        return false;
+    addWritten(writer, entry);
+    return true;
+}
 
-        encoder.Clear();
 
-        int write_fields = 0;
-        int day = sample->stamp.secPastEpoch / 86400;
-        if (day != last_day_fields_written) {
-            //if we switched to a new day, write the fields
-            write_fields = 1;
-        }
+// Receives the PVs which exportPV() splits into one job per year
+struct YearSplitter
+{
+    virtual ~YearSplitter() {}
+    // 'entry' is what the manifest should record once all years are exported
+    virtual void split(const stdString& pvname, int first, int last,
+                       const Manifest::Entry& entry) = 0;
+};
 
-        dbr_short_t sevr = sample->severity;
+// The window of a PV, its own or else that of every PV
+static const TimeWindow& windowOf(const ExportOptions& opts, const stdString& pvname)
+{
+    if(opts.pvwindows) {
+        std::map<std::string, TimeWindow>::const_iterator it = opts.pvwindows->find(pvname.c_str());
+        if(it!=opts.pvwindows->end())
+            return it->second;
+    }
+    return opts.window;
+}
 
-        if ((sevr == 3904) || (sevr == 3872) || (sevr == 3848)) {
-            if (disconnected_epoch == 0) {
-                disconnected_epoch = sample->stamp.secPastEpoch;
-            }
-            if ((sevr == 3872 || sevr == 3848) && prev_severity < 4) {
-                prev_severity = sevr;
-            }
-            write_fields = 0; //don't write fields if disconnected
-            continue;
-        } else if (sevr > 3) {
-            //sevr == 3856 || sevr == 3968
-            std::cerr<<"WARN: "<<self.name.c_str()<<": Severity "<< sevr<<" encountered\n";
-            write_fields = 0; //don't write fields if special severity
-        } else if (disconnected_epoch != 0) {
-            //this is the first sample with value after a disconnected one
-            EPICS::FieldValue* FV(encoder.add_fieldvalues());
-            std::stringstream str; str << (disconnected_epoch + POSIX_TIME_AT_EPICS_EPOCH);
-            FV->set_name("cnxlostepsecs");
-            FV->set_val(str.str());
-
-            EPICS::FieldValue* FV2(encoder.add_fieldvalues());
-            str.str(""); str.clear(); str << (sample->stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH);
-            FV2->set_name("cnxregainedepsecs");
-            FV2->set_val(str.str());
-
-            if (prev_severity == 3872) {
-                EPICS::FieldValue* FV3(encoder.add_fieldvalues());
-                FV3->set_name("startup");
-                FV3->set_val("true");
-            } else if (prev_severity == 3848) {
-                EPICS::FieldValue* FV3(encoder.add_fieldvalues());
-                FV3->set_name("resume");
-                FV3->set_val("true");
+/* Export a PV, or the samples of it in its window.  A window neither resumes
+ * from nor updates the manifest, and is not split.  As for any export, the
+ * samples are appended to the files, after those already there.  So a window
+ * can fill files which are missing or end before it, but if a file already
+ * has samples after the end of the window, the PV fails.
+ */
+static ExportResult exportPV(IndexSet& idx, const stdString& pvname,
+                             const ExportOptions& opts, ExportCounts *counts,
+                             YearSplitter *splitter=0)
+{
+    try {
+        std::cerr<<"Visit PV "<<pvname.c_str()<<"\n";
+        epicsTime start,end;
+        {
+            StageTimer T(counts->stages, StageStats::Lookup);
+            epicsGuard<epicsMutex> G(storageLock);
+            if(!idx.getInterval(pvname, start, end)) {
+                std::cerr<<"WARN: No Data or no times\n";
+                return ExportNoData;
             }
-            prev_severity = sevr;
-            disconnected_epoch = 0;
         }
 
-        if (sevr!=0)
-            encoder.set_severity(sample->severity);
-        if(sample->status!=0)
-            encoder.set_status(sample->status);
+        std::cerr<<" start "<<start<<" end   "<<end<<"\n";
 
-        encoder.set_secondsintoyear(secintoyear);
-        encoder.set_nano(sample->stamp.nsec);
+        const TimeWindow& window = windowOf(opts, pvname);
+        if((window.hasStart() && end<epicsTime(window.start))
+                || (window.hasEnd() && !(start<epicsTime(window.end)))) {
+            std::cerr<<"No samples in the window\n";
+            return ExportNoData;
+        }
 
-        valueop<dbr, isarray>::set(encoder, sample, self.reader.getCount());
+        Manifest::Entry prev;
+        bool known = !window.bounded() && opts.manifest && opts.manifest->lookup(pvname.c_str(), prev);
+        if(known) {
+            if(epicsTime(prev.end)==end) {
+                std::cerr<<"Unchanged since last export\n";
+                return ExportUnchanged;
+            }
+            // resume after the last sample exported
+            if(prev.count)
+                start = prev.last;
+        }
 
-        if(fieldvalues.size() && write_fields)
-        {
-            // encoder accumulated fieldvalues for this sample
-            for(fieldvalues_t::const_iterator it=fieldvalues.begin(), end=fieldvalues.end();
-                it!=end; ++it)
-            {
-                EPICS::FieldValue* FV(encoder.add_fieldvalues());
-                FV->set_name(it->first);
-                FV->set_val(it->second);
+        Manifest::Entry entry(prev);
+        entry.end = end;
+
+        // a resumed export only continues the last file, so is not split
+        if(splitter && opts.splityears && !window.bounded() && !(known && prev.count)) {
+            int first, last;
+            getYear(start, &first);
+            getYear(end, &last);
+            if(last-first+1 >= int(opts.splityears)) {
+                std::cerr<<" Split into "<<(last-first+1)<<" years\n";
+                splitter->split(pvname, first, last, entry);
+                return ExportSplit;
             }
-            //fieldvalues.clear(); // don't clear the fields, we will use them again later
-            last_day_fields_written = day;
         }
 
-        try{
+        AutoPtr<DataReader> reader;
+        const RawValue::Data *samp;
+        WriteFrom from;
+        from.until = window.end;
+        {
+            StageTimer T(counts->stages, StageStats::Lookup);
             {
-                google::protobuf::io::CodedOutputStream encstrm(&encbuf);
-                encoder.SerializeToCodedStream(&encstrm);
+                epicsGuard<epicsMutex> G(storageLock);
+                reader = new LockedReader(idx.createReader());
             }
-            encbuf.finalize();
-            self.outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
-            nwrote++;
-        }catch(std::exception& e) {
-            std::cerr<<"ERROR encoding sample! : "<<e.what()<<"\n";
-            encbuf.reset();
-            // skip
+
+            std::cerr<<" Type "<<reader->getType()<<" count "<<reader->getCount()<<"\n";
+
+            // straight to the start of the window, through the index
+            if(window.hasStart())
+                samp = seekTo(*reader, pvname, window.start, from);
+            else
+                samp = reader->find(pvname, &start);
+        }
+        if(!samp) {
+            std::cerr<<"WARN: No data after all\n";
+            return ExportNoData;
+        }
+        if(known && prev.count) {
+            StageTimer T(counts->stages, StageStats::Skip);
+            while(samp && notAfter(samp->stamp, prev.last))
+                samp = reader->next();
         }
 
-    }while(self.outpb.good() && (self.samp=self.reader.next()));
+        if(samp && window.pastEnd(samp->stamp))
+            samp = 0;
 
+        if(samp) {
+            if(!writeSamples(*reader, pvname, opts, from, counts, entry))
+                return ExportFailed; // not recorded, so retried next time
+        } else {
+            std::cerr<<"No new samples\n";
+        }
 
-    std::cerr<<"End file "<<self.samp<<" "<<self.outpb.good()<<"\n";
-    std::cerr<<"Wrote "<<nwrote<<"\n";
+        if(opts.manifest && !window.bounded())
+            opts.manifest->update(pvname.c_str(), entry);
+        return ExportOk;
+    } catch (std::exception& e) {
+        //print exception and continue with the next pv
+        std::cerr<<"Exception: "<<pvname.c_str()<<": "<<e.what()<<"\n";
+        return ExportFailed;
+    }
 }
 
-template<int dbr, int array>
-void skip(PBWriter& self, const char* file)
+/* Export one year of a PV, with the same result as when the PV is exported
+ * whole.  The samples written are added to 'entry'.
+ */
+static ExportResult exportYear(IndexSet& idx, const stdString& pvname, int year,
+                               const ExportOptions& opts, ExportCounts *counts,
+                               Manifest::Entry& entry)
 {
-	typedef typename dbrstruct<dbr,array>::pbtype decoder;
-
-    //find the last sample that was written into the given file and skip forward the reader to the first
-    //sample that has a timestamp later than the last sample in the file
-    std::ifstream inpstr(file);
-    std::string temp;
-    decoder sample;
-
-    if (!std::getline(inpstr, temp).good()) return; //payload info; don't care what it is, just make sure it was read
-
-    int logged = 0;
-    while(std::getline(inpstr, temp).good()) {
-        int l = unescape_plan(temp.c_str(), temp.length());
-        std::vector<char> buf(l);
-        unescape(temp.c_str(), temp.length(), &buf[0], buf.size());
-        bool ok = sample.ParseFromString(&buf[0]);
-        if (!ok && logged == 0){
-            std::cerr<<"WARN: "<<self.name.c_str()<<": Can't parse the data. Probably value is missing.\n";
-            logged++;
-        }
-    }
-    inpstr.close();
-    unsigned int sec = sample.secondsintoyear() + self.startofyear.secPastEpoch;
-    unsigned int nano = sample.nano();
-
-    //now skip forward to the first sample that is later than the last event read from the file
-    unsigned int sampseconds = self.samp->stamp.secPastEpoch;
-    while((sampseconds < sec) && self.samp) {
-        self.samp = self.reader.next();
-        if (self.samp)
-            sampseconds = self.samp->stamp.secPastEpoch;
-    }
-
-    if (self.samp && (sampseconds == sec)) {
-        unsigned int sampnano = self.samp->stamp.nsec; //in some cases I got overflow!?
-        while (self.samp && (sampseconds == sec && sampnano <= nano)) {
-            self.samp = self.reader.next();
-            if (self.samp) {
-                sampseconds = self.samp->stamp.secPastEpoch;
-                sampnano = self.samp->stamp.nsec;
+    try {
+        std::cerr<<"Visit PV "<<pvname.c_str()<<" year "<<year<<"\n";
+        epicsTimeStamp yearstart;
+        getStartOfYear(year, &yearstart);
+
+        AutoPtr<DataReader> reader;
+        const RawValue::Data *samp;
+        WriteFrom from;
+        from.onlyyear = year;
+        {
+            StageTimer T(counts->stages, StageStats::Lookup);
+            {
+                epicsGuard<epicsMutex> G(storageLock);
+                reader = new LockedReader(idx.createReader());
             }
+
+            // a disconnection at the end of the previous year is noted by
+            // the first sample of this one
+            samp = seekTo(*reader, pvname, yearstart, from);
         }
+
+        if(samp && !writeSamples(*reader, pvname, opts, from, counts, entry))
+            return ExportFailed;
+        return ExportOk;
+    } catch (std::exception& e) {
+        std::cerr<<"Exception: "<<pvname.c_str()<<": "<<year<<": "<<e.what()<<"\n";
+        return ExportFailed;
     }
 }
 
-void PBWriter::prepFile()
+/* A PV exported as one job per year.  The last job to finish records the
+ * PV in the manifest, and reports it.
+ */
+struct YearSplit
 {
-    const RawValue::Data *samp(reader.get());
-    getYear(samp->stamp, &year);
-    getStartOfYear(year, &startofyear);
-    getStartOfYear(year+1, &endofyear);
+    const stdString name;
+    epicsMutex lock;
+    Manifest::Entry entry;
+    size_t remaining;
+    bool failed;
+    ExportCounts counts;
+
+    YearSplit(const stdString& name, const Manifest::Entry& entry, size_t remaining)
+        :name(name), entry(entry), remaining(remaining), failed(false)
+    {}
+};
 
-    dtype = reader.getType();
-    isarray = reader.getCount()!=1;
+// A whole PV, or one year of a split PV
+struct ExportJob
+{
+    stdString name;
+    YearSplit *split; // NULL for the whole PV
+    int year;
 
-    EPICS::PayloadInfo header;
+    ExportJob() :split(0), year(0) {}
+    ExportJob(const stdString& name, YearSplit *split=0, int year=0)
+        :name(name), split(split), year(year)
+    {}
+};
 
-    std::cerr<<"is a "<<(isarray?"array\n":"scalar\n");
-    if(!isarray) {
-        // Scalars
-        switch(dtype)
+/* Queue of jobs shared by the export workers.
+ * PVs are dealt round-robin into one lane per worker.  A worker takes from
+ * the front of its own lane, and once that is empty steals from the back of
+ * the others.  The years of a split PV are put at the front of the lane of
+ * the worker which split it.
+ * A worker with nothing to take waits while any others are busy, as they
+ * may split another PV.
+ */
+class PVQueue
+{
+    struct Lane {
+        epicsMutex lock;
+        std::deque<ExportJob> jobs;
+    };
+    std::vector<Lane*> lanes;
+    size_t nextlane;
+    epicsMutex busyLock;
+    size_t busy; // workers between pop() and done()
+    epicsEvent wakeup;
+
+    PVQueue(const PVQueue&);
+    PVQueue& operator=(const PVQueue&);
+
+    bool take(size_t self, ExportJob& job)
+    {
         {
-#define CASE(DBR) case DBR: transcode = &transcode_samples<DBR, 0>; \
-		skipForward = &skip<DBR, 0>; \
-    header.set_type((EPICS::PayloadType)dbrstruct<DBR, 0>::pbcode); break
-        CASE(DBR_TIME_STRING);
-        CASE(DBR_TIME_CHAR);
-        CASE(DBR_TIME_SHORT);
-        CASE(DBR_TIME_ENUM);
-        CASE(DBR_TIME_LONG);
-        CASE(DBR_TIME_FLOAT);
-        CASE(DBR_TIME_DOUBLE);
-#undef CASE
-        default: {
-            std::ostringstream msg;
-            msg<<"Unsupported type "<<dtype;
-            throw std::runtime_error(msg.str());
+            Lane& mine = *lanes[self];
+            epicsGuard<epicsMutex> G(mine.lock);
+            if(!mine.jobs.empty()) {
+                job = mine.jobs.front();
+                mine.jobs.pop_front();
+                return true;
+            }
         }
+        for(size_t i=1; i<lanes.size(); i++) {
+            Lane& other = *lanes[(self+i)%lanes.size()];
+            epicsGuard<epicsMutex> G(other.lock);
+            if(!other.jobs.empty()) {
+                job = other.jobs.back();
+                other.jobs.pop_back();
+                return true;
+            }
         }
-    } else {
-        // Vectors
-        switch(dtype)
+        return false;
+    }
+public:
+    explicit PVQueue(size_t nlanes)
+        :lanes(nlanes)
+        ,nextlane(0)
+        ,busy(0)
+    {
+        for(size_t i=0; i<lanes.size(); i++)
+            lanes[i] = new Lane;
+    }
+    ~PVQueue()
+    {
+        for(size_t i=0; i<lanes.size(); i++)
+            delete lanes[i];
+    }
+
+    // Only called before the workers are started
+    void push(const stdString& name)
+    {
+        lanes[nextlane]->jobs.push_back(ExportJob(name));
+        nextlane = (nextlane+1)%lanes.size();
+    }
+
+    // Called by a busy worker
+    void pushFront(size_t self, const ExportJob& job)
+    {
         {
-#define CASE(DBR) case DBR: transcode = &transcode_samples<DBR, 1>; \
-        skipForward = &skip<DBR, 1>; \
-    header.set_type((EPICS::PayloadType)dbrstruct<DBR, 1>::pbcode); break
-        CASE(DBR_TIME_STRING);
-        CASE(DBR_TIME_CHAR);
-        CASE(DBR_TIME_SHORT);
-        CASE(DBR_TIME_ENUM);
-        CASE(DBR_TIME_LONG);
-        CASE(DBR_TIME_FLOAT);
-        CASE(DBR_TIME_DOUBLE);
-#undef CASE
-        default: {
-            std::ostringstream msg;
-            msg<<"Unsupported type "<<dtype;
-            throw std::runtime_error(msg.str());
+            Lane& mine = *lanes[self];
+            epicsGuard<epicsMutex> G(mine.lock);
+            mine.jobs.push_front(job);
         }
+        wakeup.signal();
+    }
+
+    // Returns false once there is no more work
+    bool pop(size_t self, ExportJob& job)
+    {
+        while(true) {
+            bool got, finished;
+            {
+                epicsGuard<epicsMutex> G(busyLock);
+                got = take(self, job);
+                if(got)
+                    busy++;
+                finished = !got && busy==0;
+            }
+            if(got || finished) {
+                // pass the wakeup on to any other waiting worker
+                wakeup.signal();
+                return got;
+            }
+            wakeup.wait();
         }
     }
 
-    header.set_elementcount(reader.getCount());
-    header.set_year(year);
-    header.set_pvname(reader.channel_name.c_str());
+    // Called when done with a job from pop()
+    void done()
+    {
+        {
+            epicsGuard<epicsMutex> G(busyLock);
+            busy--;
+        }
+        wakeup.signal();
+    }
 
-    std::ostringstream fname;
-    if (typeChangeError > 0) {
-        fname << pvpathname(reader.channel_name.c_str())<<":"<<year<<".pb."<<typeChangeError;
-    } else {
-        fname << pvpathname(reader.channel_name.c_str())<<":"<<year<<".pb";
+    // The PVs not taken, once the workers have stopped early.  Years are not split.
+    void remaining(std::vector<stdString>& names)
+    {
+        for(size_t i=0; i<lanes.size(); i++)
+            for(size_t j=0; j<lanes[i]->jobs.size(); j++)
+                names.push_back(lanes[i]->jobs[j].name);
     }
+};
 
-    int fileexists = 0;
+// Set by a signal to stop -follow after the PVs being exported
+static volatile sig_atomic_t stopRequested;
+
+static void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+// Totals over all PVs exported by this process
+struct ExportSummary
+{
+    epicsMutex lock;
+    unsigned long nok, nunchanged, nnodata, nfailed;
+    ExportCounts counts;
+
+    ExportSummary() :nok(0), nunchanged(0), nnodata(0), nfailed(0) {}
+
+    void add(ExportResult result, const ExportCounts& pvcounts)
     {
-        FILE *fp = fopen(fname.str().c_str(), "r");
-        if(fp) {
-            fclose(fp);
-            fileexists = 1;
-            (*skipForward)(*this,fname.str().c_str());
-            //std::cerr<<"ERROR: File already exists! "<<fname.str()<<"\n";
-            //samp=NULL;
-            //return;
+        epicsGuard<epicsMutex> G(lock);
+        switch(result) {
+        case ExportOk: nok++; break;
+        case ExportUnchanged: nunchanged++; break;
+        case ExportNoData: nnodata++; break;
+        case ExportFailed: nfailed++; break;
+        case ExportSplit: return;
         }
+        counts += pvcounts;
     }
 
-    std::cerr<<"Starting to write "<<fname.str()<<"\n";
-    createDirs(fname.str());
+    // Samples written so far
+    unsigned long written()
+    {
+        epicsGuard<epicsMutex> G(lock);
+        return counts.nwrote;
+    }
+};
 
-    escapingarraystream encbuf;
+struct ExportWorker : public epicsThreadRunable, public YearSplitter
+{
+    IndexSet& idx;
+    const ExportOptions& opts;
+    PVQueue& queue;
+    ExportSummary& summary;
+    const size_t lane;
+    // Stop taking PVs once this many samples are written, 0 for no limit
+    const unsigned long budget;
+    epicsThread worker;
+
+    ExportWorker(IndexSet& idx, const ExportOptions& opts, PVQueue& queue,
+                 ExportSummary& summary, size_t lane, unsigned long budget)
+        :idx(idx)
+        ,opts(opts)
+        ,queue(queue)
+        ,summary(summary)
+        ,lane(lane)
+        ,budget(budget)
+        ,worker(*this, "pbexport",
+                epicsThreadGetStackSize(epicsThreadStackBig),
+                epicsThreadPriorityMedium)
+    {}
+    virtual ~ExportWorker() {}
+
+    virtual void run()
     {
-        if (!fileexists) {
-            google::protobuf::io::CodedOutputStream encstrm(&encbuf);
-            header.SerializeToCodedStream(&encstrm);
+        ExportJob job;
+        while(!stopRequested && !(budget && summary.written()>=budget) && queue.pop(lane, job)) {
+            if(job.split) {
+                exportSplit(job);
+            } else {
+                ExportCounts counts;
+                ExportResult result = exportPV(idx, job.name, opts, &counts, this);
+                if(result!=ExportSplit) {
+                    summary.add(result, counts);
+                    reportPV(opts, job.name, result, counts);
+                }
+            }
+            queue.done();
+        }
+    }
+
+    virtual void split(const stdString& pvname, int first, int last,
+                       const Manifest::Entry& entry)
+    {
+        YearSplit *S = new YearSplit(pvname, entry, last-first+1);
+        // this worker continues with the first year
+        for(int year=last; year>=first; year--)
+            queue.pushFront(lane, ExportJob(pvname, S, year));
+    }
+
+    void exportSplit(const ExportJob& job)
+    {
+        YearSplit& S = *job.split;
+        ExportCounts counts;
+        Manifest::Entry entry;
+        ExportResult result = exportYear(idx, S.name, job.year, opts, &counts, entry);
+
+        bool last;
+        {
+            epicsGuard<epicsMutex> G(S.lock);
+            S.counts += counts;
+            S.failed |= result==ExportFailed;
+            if(entry.count && (!S.entry.count || notAfter(S.entry.last, entry.last)))
+                S.entry.last = entry.last;
+            S.entry.count += entry.count;
+            for(size_t i=0; i<entry.files.size(); i++) {
+                if(std::find(S.entry.files.begin(), S.entry.files.end(), entry.files[i])==S.entry.files.end())
+                    S.entry.files.push_back(entry.files[i]);
+            }
+            last = --S.remaining==0;
+        }
+        if(!last)
+            return;
+
+        // not recorded if any year failed, so retried next time
+        result = S.failed ? ExportFailed : ExportOk;
+        if(!S.failed && opts.manifest) {
+            std::sort(S.entry.files.begin(), S.entry.files.end());
+            opts.manifest->update(S.name.c_str(), S.entry);
+        }
+        summary.add(result, S.counts);
+        reportPV(opts, S.name, result, S.counts);
+        delete job.split;
+    }
+};
+
+// A line of input
+struct PVLine
+{
+    stdString name;
+    // From 'listpvs -cost', if given
+    bool hascost;
+    double cost;
+    // If given, in place of ExportOptions::window
+    bool haswindow;
+    TimeWindow window;
+    PVLine() :hascost(false), cost(0.0), haswindow(false) {}
+};
+
+/* A line of input is a PV name, optionally followed by tab separated columns.
+ * The first number is the cost from 'listpvs -cost', and "start=<time>" and
+ * "end=<time>" change 'window' for this PV.  Other columns are ignored.
+ * Returns false, after printing why, if a time can't be parsed.
+ */
+static bool parsePVLine(const std::string& line, const TimeWindow& window, PVLine& pv)
+{
+    size_t tab = line.find('\t');
+    pv.name = line.substr(0, tab).c_str();
+    pv.window = window;
+    while(tab!=std::string::npos) {
+        size_t begin = tab+1;
+        tab = line.find('\t', begin);
+        std::string col(line.substr(begin, tab==std::string::npos ? tab : tab-begin));
+
+        epicsTimeStamp *t = 0;
+        if(col.compare(0, 6, "start=")==0)
+            t = &pv.window.start;
+        else if(col.compare(0, 4, "end=")==0)
+            t = &pv.window.end;
+        if(t) {
+            if(!parseTime(col.c_str()+col.find('=')+1, t)) {
+                std::cerr<<"ERROR: "<<pv.name.c_str()<<": Invalid time '"<<col<<"'\n";
+                return false;
+            }
+            pv.haswindow = true;
+        } else if(!pv.hascost) {
+            char *end;
+            pv.cost = strtod(col.c_str(), &end);
+            pv.hascost = end!=col.c_str();
         }
     }
-    encbuf.finalize();
+    return true;
+}
+
+// For sorting by cost, largest first
+struct CostlyPV
+{
+    double cost;
+    stdString name;
+    CostlyPV(double cost, const stdString& name) :cost(cost), name(name) {}
+    bool operator<(const CostlyPV& o) const { return cost>o.cost; }
+};
 
-    outpb.open(fname.str().c_str(), std::fstream::app);
-    if (!fileexists) { //if file exists do not write header
-        outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+// Export the jobs in 'queue' with 'njobs' worker threads, until it is empty
+// or 'budget' samples have been written (0 for no limit)
+static void runWorkers(IndexSet& idx, const ExportOptions& opts, PVQueue& queue, size_t njobs,
+                       ExportSummary& summary, unsigned long budget)
+{
+    std::vector<ExportWorker*> workers(njobs);
+    for(size_t i=0; i<njobs; i++)
+        workers[i] = new ExportWorker(idx, opts, queue, summary, i, budget);
+    for(size_t i=0; i<njobs; i++)
+        workers[i]->worker.start();
+    for(size_t i=0; i<njobs; i++) {
+        workers[i]->worker.exitWait();
+        delete workers[i];
     }
 }
 
-PBWriter::PBWriter(DataReader& reader, stdString pv)
-    :reader(reader)
-    ,info(reader.getInfo())
-    ,year(0)
-    ,name(pv)
+static void printSummary(size_t npvs, ExportSummary& summary, double elapsed)
 {
-    samp = reader.get();
+    std::cout<<"PVs: "<<npvs
+             <<" exported: "<<summary.nok
+             <<" unchanged: "<<summary.nunchanged
+             <<" no data: "<<summary.nnodata
+             <<" failed: "<<summary.nfailed<<"\n"
+             <<"Samples: "<<summary.counts.nwrote
+             <<" in "<<elapsed<<" sec";
+    if(elapsed>0)
+        std::cout<<" ("<<(summary.counts.nwrote/elapsed)<<" samples/sec)";
+    std::cout<<"\n"
+             <<"Bytes: "<<summary.counts.nbytes
+             <<" with "<<summary.counts.nsyscalls<<" writes\n";
 }
 
-void PBWriter::write()
+// Process PV names as they are read from stdin, one at a time
+static void exportSerial(IndexSet& idx, const ExportOptions& opts)
 {
-    typeChangeError = 0;
-    while(samp) {
-        try {
-            prepFile();
-            if (!samp) break;
-            (*transcode)(*this);
-        } catch (GenericException& up) {
-            if (std::strstr(up.what(),"Error in data header")) {
-                // From RawDataReader::getHeader()
-                //Error in the data header means a corrupted sample data.
-                //It can happen in the prepFile or in the transcode. Either way the resolution is the same.
-                //We try to move ahead. If it doesn't work, abort.
-                std::cerr<<"ERROR: "<<name.c_str()<<": Corrupted header, continuing with the next sample.\n"<<up.what()<<"\n";
-                samp = reader.next();
-            } else {
-                //tough luck
-                outpb.close();
-                throw;
+    std::string stdpvname;
+    while(std::getline(std::cin, stdpvname).good()) {
+        if(stdpvname=="<>exit")
+            break;
+        PVLine pv;
+        bool valid = parsePVLine(stdpvname, opts.window, pv);
+
+        std::cerr<<"Got "<<pv.name.c_str()<<"\n";
+
+        ExportOptions pvopts(opts);
+        pvopts.window = pv.window;
+        ExportCounts counts;
+        ExportResult result = valid ? exportPV(idx, pv.name, pvopts, &counts) : ExportFailed;
+        reportPV(opts, pv.name, result, counts);
+
+        std::cerr<<"Done\n";
+        std::cout<<"Done\n"; // exportall.py uses this
+    }
+}
+
+// Every PV in the indexes
+static void listAllPVs(IndexSet& idx, std::vector<stdString>& names)
+{
+    idx.channels(names);
+}
+
+/* The PVs named on stdin.  When costs are given, the most costly are put
+ * first so that they are not the last to finish.
+ * The PVs given their own window are added to 'windows', or if it is NULL
+ * are refused.
+ */
+static void readPVList(std::vector<stdString>& names, const TimeWindow& window,
+                       std::map<std::string, TimeWindow> *windows)
+{
+    std::vector<CostlyPV> pvs;
+    bool costs = false;
+    std::string stdpvname;
+    while(std::getline(std::cin, stdpvname).good()) {
+        if(stdpvname=="<>exit")
+            break;
+        if(stdpvname.empty())
+            continue;
+        PVLine pv;
+        if(!parsePVLine(stdpvname, window, pv))
+            continue;
+        if(pv.haswindow) {
+            if(!windows) {
+                std::cerr<<"ERROR: "<<pv.name.c_str()<<": A time window can't be given with -follow\n";
+                continue;
             }
-        } catch(...) {
-            outpb.close();
-            throw;
+            (*windows)[pv.name.c_str()] = pv.window;
         }
+        costs |= pv.hascost;
+        pvs.push_back(CostlyPV(pv.cost, pv.name));
+    }
+    if(costs) {
+        std::stable_sort(pvs.begin(), pvs.end());
+        std::cerr<<"Largest first\n";
+    }
+    for(size_t i=0; i<pvs.size(); i++)
+        names.push_back(pvs[i].name);
+}
 
-        bool ok = outpb.good();
-        outpb.close();
-        if(!ok) {
-            std::cerr<<"Error writing file\n";
-            break;
+// Export a list of PVs with a pool of worker threads
+static void exportParallel(IndexSet& idx, const ExportOptions& options, size_t njobs, bool allpvs)
+{
+    std::vector<stdString> names;
+    std::map<std::string, TimeWindow> windows;
+    if(allpvs)
+        listAllPVs(idx, names);
+    else
+        readPVList(names, options.window, &windows);
+    ExportOptions opts(options);
+    if(!windows.empty())
+        opts.pvwindows = &windows;
+
+    // Dealt round-robin, each lane keeps the order by cost, and stealing
+    // from the back takes the cheapest.
+    PVQueue queue(njobs);
+    for(size_t i=0; i<names.size(); i++)
+        queue.push(names[i]);
+    size_t npvs = names.size();
+
+    std::cerr<<"Exporting "<<npvs<<" PVs with "<<njobs<<" workers\n";
+    if(opts.stats)
+        opts.stats->setTotal(npvs);
+
+    ExportSummary summary;
+    epicsTime started(epicsTime::getCurrent());
+    runWorkers(idx, opts, queue, njobs, summary, 0);
+    double elapsed = epicsTime::getCurrent() - started;
+
+    printSummary(npvs, summary, elapsed);
+}
+
+/* Keep exporting the new samples of a live archive.
+ * Every 'interval' seconds the indexes are opened again, and each PV with a
+ * grown RTree interval continues from the last sample in the manifest.
+ * A cycle stops taking PVs once 'budget' samples are written.  The next
+ * starts with the PVs it did not reach.
+ */
+static void exportFollow(const std::vector<std::string>& indexnames, const ExportOptions& opts, size_t njobs, bool allpvs,
+                         double interval, unsigned long budget, unsigned long cycles)
+{
+    std::vector<stdString> listed;
+    if(!allpvs)
+        readPVList(listed, opts.window, 0);
+    std::vector<stdString> carried;
+
+    signal(SIGINT, &requestStop);
+    signal(SIGTERM, &requestStop);
+
+    for(unsigned long cycle=1; !stopRequested && (!cycles || cycle<=cycles); cycle++) {
+        double started = monotonicSeconds();
+        ExportSummary summary;
+        size_t npvs = 0;
+        std::vector<stdString> left;
+        {
+            // see what the engine has written since the last cycle
+            IndexSet idx;
+            {
+                epicsGuard<epicsMutex> G(storageLock);
+                DataFile::close_all();
+                idx.open(indexnames);
+            }
+
+            std::vector<stdString> all;
+            if(allpvs)
+                listAllPVs(idx, all);
+            const std::vector<stdString>& names = allpvs ? all : listed;
+
+            PVQueue queue(njobs);
+            std::set<stdString> first(carried.begin(), carried.end());
+            for(size_t i=0; i<carried.size(); i++)
+                queue.push(carried[i]);
+            for(size_t i=0; i<names.size(); i++)
+                if(!first.count(names[i]))
+                    queue.push(names[i]);
+            npvs = carried.size()+names.size()-first.size();
+
+            runWorkers(idx, opts, queue, njobs, summary, budget);
+            queue.remaining(left);
         }
+        carried.swap(left);
+        double elapsed = monotonicSeconds()-started;
+
+        std::cout<<"Cycle "<<cycle<<"\n";
+        printSummary(npvs-carried.size(), summary, elapsed);
+        if(!carried.empty())
+            std::cout<<"Deferred: "<<carried.size()<<" PVs\n";
+        std::cout.flush();
+
+        if(cycles && cycle==cycles)
+            break;
+        for(double wait = interval-elapsed; wait>0 && !stopRequested; wait -= 1.0)
+            epicsThreadSleep(wait<1.0 ? wait : 1.0);
     }
 }
 
@@ -504,56 +948,166 @@ int main(int argc, char *argv[])
     //comment this if you want to see the protobuf logs
     google::protobuf::LogSilencer *silencer = new google::protobuf::LogSilencer();
 
-    if(argc<2)
+    CmdArgParser parser(argc, argv);
+    parser.setArgumentsInfo(" <index file> [<index file>...]");
+    parser.setFooter("\nPV names are read from stdin, one per line.\n"
+                     "Without -jobs, \"Done\" is printed to stdout as each is completed.\n"
+                     "With -jobs, lines from 'listpvs -cost' are exported most costly first.\n"
+                     "With -follow, the list is read once, and a summary is printed each cycle.\n"
+                     "With -census, nothing is written.  The files which would be are listed, with\n"
+                     "columns  pv year file type elements samples disconnects bytes\n"
+                     "With several indexes, the samples of each PV in all of them are merged in time\n"
+                     "order.  Where they overlap, those of the first index given are kept.\n"
+                     "A line of stdin may follow the PV name with tab separated start=<time> and/or\n"
+                     "end=<time> columns, in place of -start and -end for that PV.  A PV exported\n"
+                     "with a time window is not recorded in the -manifest.\n"
+                     "The -throttle file has lines  readkB <kB/s>, writekB <kB/s>, writeops <N/s>\n"
+                     "and is read again when it changes, replacing -maxread, -maxwrite and -maxops.\n");
+    CmdArgInt jobs(parser, "jobs", "<N>", "Export with N worker threads");
+    CmdArgFlag allpvs(parser, "all", "With -jobs or -follow, export every PV in the index instead of reading stdin");
+    CmdArgInt bufsize(parser, "bufsize", "<kB>", "Size of the output buffer of each worker (default 1024)");
+    CmdArgString manifest(parser, "manifest", "<file>", "Skip PVs with no new data since the export recorded in this file");
+    CmdArgInt heartbeat(parser, "heartbeat", "<sec>", "Repeat unchanged metadata every <sec> seconds, 0 for only on change (default 86400)");
+    heartbeat.set(86400);
+    CmdArgInt splityears(parser, "splityears", "<N>", "With -jobs, export each year of PVs spanning N or more years as a separate job");
+    CmdArgInt readahead(parser, "readahead", "<N>", "Read up to N samples ahead of encoding in a second thread");
+    CmdArgString partition(parser, "partition", "<span>", "Write a file per year, month, day, or hour (default year)");
+    CmdArgInt binsize(parser, "bin", "<sec>", "Write the min, max, mean, last and count of numeric scalars in bins of <sec> seconds, instead of each sample");
+    CmdArgFlag collapse(parser, "collapse", "Write each run of samples with the same value, severity and status once, at the time of the first, with repeatcount");
+    CmdArgInt follow(parser, "follow", "<sec>", "With -manifest, export new samples again every <sec> seconds, until interrupted");
+    CmdArgInt budget(parser, "budget", "<N>", "With -follow, stop each cycle after writing N samples");
+    CmdArgInt cycles(parser, "cycles", "<N>", "With -follow, stop after N cycles");
+    CmdArgString statsfile(parser, "stats", "<file>", "Append timing and counts of each PV to this file as JSON");
+    CmdArgString promfile(parser, "prom", "<file>", "Keep process totals and ETA in this Prometheus textfile");
+    CmdArgInt uring(parser, "uring", "<N>", "Write through an io_uring with N buffers of -bufsize, if built with USE_IO_URING");
+    CmdArgInt prealloc(parser, "preallocate", "<kB>", "Reserve disk space for files <kB> at a time, released on close if unused");
+    CmdArgString censusfile(parser, "census", "<file>", "Dry run.  Write the samples and bytes of each file which would be written to this file, as CSV or .json");
+    CmdArgString start(parser, "start", "<time>", "Only samples at or after this time, found through the index");
+    CmdArgString end(parser, "end", "<time>", "Only samples before this time");
+    CmdArgInt maxread(parser, "maxread", "<kB/s>", "Read samples at no more than this rate");
+    CmdArgInt maxwrite(parser, "maxwrite", "<kB/s>", "Write at no more than this rate");
+    CmdArgInt maxops(parser, "maxops", "<N>", "Make no more than N writes per second");
+    CmdArgString throttlefile(parser, "throttle", "<file>", "Take the rate limits from this file, while running");
+    CmdArgString sharefile(parser, "throttleshare", "<file>", "Share the rate limits with other exports given this file");
+
+    if(!parser.parse())
+        return 2;
+    if(parser.getArguments().size()<1) {
+        parser.usage();
+        return 2;
+    }
+    ExportOptions opts;
+    if(bufsize>0)
+        opts.bufsize = size_t(bufsize)*1024u;
+    if(heartbeat>=0)
+        opts.heartbeat = heartbeat;
+    if(readahead>0)
+        opts.readahead = readahead;
+    if(splityears>0)
+        opts.splityears = splityears;
+    opts.collapse = collapse;
+    if(binsize>0)
+        opts.binsize = binsize;
+    if(uring>0) {
+        if(!bufferedfile::haveRing()) {
+            std::cerr<<"ERROR: -uring needs pbexport built with USE_IO_URING=YES\n";
+            return 2;
+        }
+        opts.uring = uring;
+    }
+    if(prealloc>0)
+        opts.prealloc = size_t(prealloc)*1024u;
+    if(!censusfile.get().empty() && (binsize>0 || !manifest.get().empty() || follow>0)) {
+        std::cerr<<"ERROR: -census can't be used with -bin, -manifest or -follow\n";
         return 2;
+    }
+    if(!start.get().empty() && !parseTime(start.get().c_str(), &opts.window.start)) {
+        std::cerr<<"ERROR: Invalid -start time '"<<start.get().c_str()<<"'\n";
+        return 2;
+    }
+    if(!end.get().empty() && !parseTime(end.get().c_str(), &opts.window.end)) {
+        std::cerr<<"ERROR: Invalid -end time '"<<end.get().c_str()<<"'\n";
+        return 2;
+    }
+    if(opts.window.bounded() && follow>0) {
+        std::cerr<<"ERROR: -start and -end can't be used with -follow\n";
+        return 2;
+    }
+    if(!partition.get().empty() && !parsePartition(partition.get().c_str(), &opts.partition)) {
+        std::cerr<<"ERROR: Invalid -partition '"<<partition.get().c_str()<<"'\n";
+        return 2;
+    }
+
     try{
     {
         char *seps = getenv("NAMESEPS");
         if(seps)
             pvseps = seps;
     }
-    AutoIndex idx;
-    idx.open(argv[1]);
-
-    std::string stdpvname;
-    while(std::getline(std::cin, stdpvname).good()) {
-        try {
-            if(stdpvname=="<>exit")
-                break;
-            stdString pvname(stdpvname.c_str());
-
-            std::cerr<<"Got "<<stdpvname<<"\n";
-
-            std::cerr<<"Visit PV "<<pvname.c_str()<<"\n";
-            stdString dirname;
-            AutoPtr<RTree> tree(idx.getTree(pvname, dirname));
-
-            epicsTime start,end;
-            if(!tree || !tree->getInterval(start, end)) {
-                std::cerr<<"WARN: No Data or no times\n";
-                continue;
-            }
+    std::vector<std::string> indexnames;
+    for(size_t i=0; i<parser.getArguments().size(); i++)
+        indexnames.push_back(parser.getArgument(i).c_str());
+    IndexSet idx;
+    idx.open(indexnames);
+
+    AutoPtr<Manifest> record;
+    if(!manifest.get().empty()) {
+        record = new Manifest(manifest.get().c_str());
+        opts.manifest = record;
+        std::cerr<<"Manifest "<<manifest.get().c_str()<<" with "<<record->size()<<" PVs\n";
+    }
 
-            std::cerr<<" start "<<start<<" end   "<<end<<"\n";
+    // PVs of a device share directories, so all workers share one cache
+    DirCache dirs;
+    opts.dirs = &dirs;
 
-            AutoPtr<DataReader> reader(ReaderFactory::create(idx, ReaderFactory::Raw, 0.0));
+    AutoPtr<CensusReporter> census;
+    if(!censusfile.get().empty()) {
+        census = new CensusReporter(censusfile.get().c_str());
+        opts.census = census;
+    }
 
-            std::cerr<<" Type "<<reader->getType()<<" count "<<reader->getCount()<<"\n";
+    ThrottleLimits limits;
+    if(maxread>0)
+        limits.readbytes = maxread*1024.0;
+    if(maxwrite>0)
+        limits.writebytes = maxwrite*1024.0;
+    if(maxops>0)
+        limits.writeops = maxops;
+    AutoPtr<Throttle> throttle;
+    if(limits.any() || !throttlefile.get().empty() || !sharefile.get().empty()) {
+        throttle = new Throttle(limits);
+        if(!sharefile.get().empty())
+            throttle->share(sharefile.get().c_str());
+        if(!throttlefile.get().empty())
+            throttle->control(throttlefile.get().c_str());
+        opts.throttle = throttle;
+    }
 
-            if(!reader->find(pvname, &start)) {
-                std::cerr<<"WARN: No data after all\n";
-                continue;
-            }
+    AutoPtr<StatsReporter> stats;
+    if(!statsfile.get().empty() || !promfile.get().empty()) {
+        stats = new StatsReporter(statsfile.get().c_str(), promfile.get().c_str());
+        opts.stats = stats;
+    }
 
-            PBWriter writer(*reader,pvname);
-            writer.write();
-        } catch (std::exception& e) {
-            //print exception and continue with the next pv
-            std::cerr<<"Exception: "<<stdpvname.c_str()<<": "<<e.what()<<"\n";
+    if(follow>0) {
+        if(!opts.manifest) {
+            std::cerr<<"ERROR: -follow needs a -manifest to continue from\n";
+            return 2;
         }
-        std::cerr<<"Done\n";
-        std::cout<<"Done\n"; // exportall.py uses this
-    }
+        // a cycle only appends to the files of the last one
+        opts.splityears = 0;
+        exportFollow(indexnames, opts, jobs>0 ? size_t(jobs) : 1u, allpvs,
+                     follow, budget>0 ? (unsigned long)budget : 0ul, cycles>0 ? (unsigned long)cycles : 0ul);
+    } else if(jobs>0)
+        exportParallel(idx, opts, jobs, allpvs);
+    else
+        exportSerial(idx, opts);
+
+    if(stats)
+        stats->finish();
+    if(throttle)
+        std::cerr<<"Waited "<<throttle->waited()<<" sec for the rate limits\n";
 
     std::cerr<<"Done\n";
     delete silencer;
@@ -0,0 +1,166 @@
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdexcept>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "pbfile.h"
+#include "pbeutil.h"
+
+using google::protobuf::internal::WireFormatLite;
+
+// Escaped bytes enough to hold secondsintoyear and nano, each a tag and a varint32
+static const size_t timePrefix = 2*2*(1+5);
+
+PBFile::PBFile(const std::string& fname)
+    :fname(fname)
+    ,base(0)
+    ,size(0)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    if(fd==-1)
+        throw std::runtime_error("Can't open "+fname+" : "+strerror(errno));
+    struct stat st;
+    if(fstat(fd, &st)!=0) {
+        close(fd);
+        throw std::runtime_error("Can't stat "+fname);
+    }
+    size = st.st_size;
+    void *map = size ? mmap(0, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(map==MAP_FAILED)
+        throw std::runtime_error("Can't map "+fname+(size ? "" : " : empty"));
+    base = (const char*)map;
+
+    last = base+size;
+    while(last>base && last[-1]!='\n')
+        last--;
+    if(last==base) {
+        munmap((void*)base, size);
+        throw std::runtime_error("No header in "+fname);
+    }
+    first = next(base);
+
+    std::vector<char> buf;
+    if(!unescapeLine(base, buf) || !info.ParseFromArray(buf.empty() ? 0 : &buf[0], buf.size())) {
+        munmap((void*)base, size);
+        throw std::runtime_error("Can't decode the header of "+fname);
+    }
+    getStartOfYear(info.year(), &yearstart);
+}
+
+PBFile::~PBFile()
+{
+    munmap((void*)base, size);
+}
+
+void PBFile::sequential() const
+{
+    posix_madvise((void*)base, size, POSIX_MADV_SEQUENTIAL);
+}
+
+const char *PBFile::eol(const char *line) const
+{
+    return (const char*)memchr(line, '\n', last-line);
+}
+
+const char *PBFile::lineOf(const char *p) const
+{
+    while(p>first && p[-1]!='\n')
+        p--;
+    return p;
+}
+
+// Find fields 1 and 2 in the first 'len' bytes of a sample
+static bool scanTime(const char *buf, size_t len, epicsUInt32 *sec, epicsUInt32 *nano)
+{
+    google::protobuf::io::CodedInputStream strm((const google::protobuf::uint8*)buf, len);
+    bool havesec = false, havenano = false;
+    while(!havesec || !havenano) {
+        google::protobuf::uint32 tag = strm.ReadTag();
+        if(!tag)
+            return false;
+        if(tag==WireFormatLite::MakeTag(1, WireFormatLite::WIRETYPE_VARINT)) {
+            havesec = strm.ReadVarint32(sec);
+        } else if(tag==WireFormatLite::MakeTag(2, WireFormatLite::WIRETYPE_VARINT)) {
+            havenano = strm.ReadVarint32(nano);
+        } else if(!WireFormatLite::SkipField(&strm, tag)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PBFile::time(const char *line, epicsTimeStamp *t) const
+{
+    const char *end = eol(line);
+    epicsUInt32 sec = 0, nano = 0;
+
+    // These are the first fields written, so try only the start of the line
+    char prefix[timePrefix] = {0};
+    size_t n = 0;
+    const char *p = line;
+    for(; p<end && n<sizeof(prefix); p++) {
+        if(*p!=0x1b) {
+            prefix[n++] = *p;
+        } else if(++p<end) {
+            switch(*p) {
+            case 1: prefix[n++] = 0x1b; break;
+            case 2: prefix[n++] = '\n'; break;
+            case 3: prefix[n++] = '\r'; break;
+            default: return false;
+            }
+        }
+    }
+    bool found = scanTime(prefix, n, &sec, &nano);
+    if(!found && p<end) {
+        std::vector<char> buf;
+        found = unescapeLine(line, buf) && scanTime(buf.empty() ? 0 : &buf[0], buf.size(), &sec, &nano);
+    }
+    if(found) {
+        t->secPastEpoch = yearstart.secPastEpoch + sec;
+        t->nsec = nano;
+    }
+    return found;
+}
+
+const char *PBFile::lowerBound(const epicsTimeStamp& t) const
+{
+    // Lines before 'lo' are earlier than t, the line at 'hi' is not
+    const char *lo = first, *hi = last;
+    while(lo<hi) {
+        const char *mid = lo + (hi-lo)/2;
+        if(mid!=lo)
+            mid = next(mid-1);
+        if(mid>=hi)
+            mid = lo; // no line starts in the upper half
+
+        epicsTimeStamp mt;
+        if(!time(mid, &mt)) {
+            char pos[24];
+            pos[formatDecimal(pos, offset(mid))] = '\0';
+            throw std::runtime_error("Can't decode the sample at offset "+std::string(pos)+" of "+fname);
+        }
+        if(notAfter(t, mt))
+            hi = mid;
+        else
+            lo = next(mid);
+    }
+    return lo;
+}
+
+bool PBFile::unescapeLine(const char *line, std::vector<char>& buf) const
+{
+    const char *end = eol(line);
+    if(end>line && end[-1]==0x1b)
+        return false; // unescape_plan() would run past the end
+    buf.resize(unescape_plan(line, end-line));
+    return unescape(line, end-line, buf.empty() ? 0 : &buf[0], buf.size())==0;
+}
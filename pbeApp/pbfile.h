@@ -0,0 +1,70 @@
+#ifndef PBFILE_H
+#define PBFILE_H
+
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include "EPICSEvent.pb.h"
+
+/* Read only access to an exported PlainPB file, mapped into memory.
+ *
+ * Escaping keeps '\n' out of the samples, so the start of a line can be
+ * found from any offset.  As samples are written in time order, this allows
+ * a binary search on time without reading the lines in between.
+ * A sample is only unescaped and decoded when asked for.
+ *
+ * A line is identified by a pointer to its first byte.
+ */
+class PBFile
+{
+public:
+    // Throws std::runtime_error if the file can't be mapped, or has no header
+    explicit PBFile(const std::string& fname);
+    ~PBFile();
+
+    const std::string& name() const { return fname; }
+    const EPICS::PayloadInfo& header() const { return info; }
+    const epicsTimeStamp& startOfYear() const { return yearstart; }
+
+    // Hint that the whole file will be read in order
+    void sequential() const;
+
+    // The first sample line
+    const char *begin() const { return first; }
+    // After the '\n' of the last complete line
+    const char *end() const { return last; }
+    // Bytes after the last '\n', not part of any line
+    size_t partial() const { return (base+size)-last; }
+    // Position of a line in the file
+    size_t offset(const char *line) const { return line-base; }
+
+    // The '\n' which ends a line
+    const char *eol(const char *line) const;
+    const char *next(const char *line) const { return eol(line)+1; }
+    // The line containing 'p', which is in [begin(), end())
+    const char *lineOf(const char *p) const;
+
+    // Time of a sample, from a partial decode.  Returns false if malformed
+    bool time(const char *line, epicsTimeStamp *t) const;
+    // The first sample line with a time not before 't', or end()
+    // Throws std::runtime_error if a sample along the way can't be decoded
+    const char *lowerBound(const epicsTimeStamp& t) const;
+
+    // Unescape a whole line.  Returns false if it is badly escaped
+    bool unescapeLine(const char *line, std::vector<char>& buf) const;
+
+private:
+    PBFile(const PBFile&);
+    PBFile& operator=(const PBFile&);
+
+    const std::string fname;
+    const char *base;
+    size_t size;
+    const char *first, *last;
+    EPICS::PayloadInfo info;
+    epicsTimeStamp yearstart;
+};
+
+#endif // PBFILE_H
@@ -0,0 +1,4 @@
+
+#include "pblocked.h"
+
+epicsMutex storageLock;
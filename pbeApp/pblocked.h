@@ -0,0 +1,54 @@
+#ifndef PBLOCKED_H
+#define PBLOCKED_H
+
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+// Tools
+#include <AutoPtr.h>
+// Storage
+#include <DataReader.h>
+
+/* The ChannelArchiver Storage library keeps process wide caches of open
+ * index and data files which are not thread safe.  When several threads
+ * read, every call which may reach them (find()/next(), RTree lookups,
+ * reader creation and destruction) is made with this lock held.
+ */
+extern epicsMutex storageLock;
+
+/* Wraps the DataReader of one thread to serialize access to the Storage library.
+ * get()/getType()/getCount()/getInfo() only look at the state of this reader,
+ * so they are passed through unlocked.
+ */
+class LockedReader : public DataReader
+{
+    AutoPtr<DataReader> reader;
+public:
+    explicit LockedReader(DataReader *reader) :reader(reader) {}
+    virtual ~LockedReader()
+    {
+        epicsGuard<epicsMutex> G(storageLock);
+        reader.assign(0);
+    }
+
+    virtual const RawValue::Data *find(const stdString &channel_name,
+                                       const epicsTime *start)
+    {
+        epicsGuard<epicsMutex> G(storageLock);
+        const RawValue::Data *ret = reader->find(channel_name, start);
+        this->channel_name = reader->channel_name;
+        return ret;
+    }
+    virtual const RawValue::Data *next()
+    {
+        epicsGuard<epicsMutex> G(storageLock);
+        return reader->next();
+    }
+    virtual const RawValue::Data *get() const { return reader->get(); }
+    virtual DbrType getType() const { return reader->getType(); }
+    virtual DbrCount getCount() const { return reader->getCount(); }
+    virtual const CtrlInfo &getInfo() const { return reader->getInfo(); }
+    virtual bool changedType() { return reader->changedType(); }
+    virtual bool changedInfo() { return reader->changedInfo(); }
+};
+
+#endif // PBLOCKED_H
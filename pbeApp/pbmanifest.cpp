@@ -0,0 +1,208 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <epicsGuard.h>
+
+#include "pbmanifest.h"
+
+typedef epicsGuard<epicsMutex> Guard;
+
+Manifest::Entry::Entry()
+    :count(0)
+{
+    end.secPastEpoch = end.nsec = 0;
+    last.secPastEpoch = last.nsec = 0;
+}
+
+// times are written as POSIX seconds with fraction
+static void putTime(std::ostream& strm, const epicsTimeStamp& t)
+{
+    char buf[32];
+    sprintf(buf, "%lu.%09u",
+            (unsigned long)t.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH,
+            (unsigned)t.nsec);
+    strm<<buf;
+}
+
+static bool getTime(const std::string& s, epicsTimeStamp& t)
+{
+    unsigned long sec;
+    unsigned nsec;
+    char junk;
+    if(sscanf(s.c_str(), "%lu.%u%c", &sec, &nsec, &junk)!=2
+            || sec<POSIX_TIME_AT_EPICS_EPOCH || nsec>=1000000000u)
+        return false;
+    t.secPastEpoch = sec - POSIX_TIME_AT_EPICS_EPOCH;
+    t.nsec = nsec;
+    return true;
+}
+
+// <pv> \t <interval end> \t <last sample> \t <count> {\t <file>}
+std::string Manifest::format(const std::string& pv, const Entry& entry)
+{
+    std::ostringstream strm;
+    strm<<pv<<'\t';
+    putTime(strm, entry.end);
+    strm<<'\t';
+    putTime(strm, entry.last);
+    strm<<'\t'<<entry.count;
+    for(size_t i=0; i<entry.files.size(); i++)
+        strm<<'\t'<<entry.files[i];
+    strm<<'\n';
+    return strm.str();
+}
+
+bool Manifest::parse(const std::string& line, std::string& pv, Entry& entry)
+{
+    std::vector<std::string> parts;
+    size_t p=0;
+    while(true) {
+        size_t sep = line.find('\t', p);
+        parts.push_back(line.substr(p, sep==std::string::npos ? sep : sep-p));
+        if(sep==std::string::npos)
+            break;
+        p = sep+1;
+    }
+    if(parts.size()<4 || parts[0].empty())
+        return false;
+
+    Entry temp;
+    char *end;
+    temp.count = strtoul(parts[3].c_str(), &end, 10);
+    if(!getTime(parts[1], temp.end) || !getTime(parts[2], temp.last)
+            || parts[3].empty() || *end)
+        return false;
+    temp.files.assign(parts.begin()+4, parts.end());
+
+    pv = parts[0];
+    entry = temp;
+    return true;
+}
+
+Manifest::Manifest(const std::string& fname)
+    :fname(fname)
+    ,fd(-1)
+    ,nlines(0)
+{
+    bool torn = false;
+    {
+        std::ifstream inp(fname.c_str());
+        std::string line;
+        while(std::getline(inp, line)) {
+            if(inp.eof()) {
+                torn = true; // no EOL
+                break;
+            }
+            nlines++;
+            std::string pv;
+            Entry entry;
+            if(parse(line, pv, entry))
+                entries[pv] = entry;
+            else
+                std::cerr<<"WARN: "<<fname<<": ignoring bad line "<<nlines<<"\n";
+        }
+    }
+
+    if(torn || nlines!=entries.size()) {
+        // rewrite w/o superseded or damaged lines
+        compact();
+    } else {
+        fd = open(fname.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
+        if(fd==-1)
+            throw std::runtime_error("Failed to open "+fname+" : "+strerror(errno));
+    }
+}
+
+void Manifest::compact()
+{
+    std::string content;
+    for(entries_t::const_iterator it=entries.begin(), end=entries.end(); it!=end; ++it)
+        content += format(it->first, it->second);
+
+    // synced before the rename, so a crash can't leave an empty manifest
+    std::string temp(fname+".tmp");
+    int tempfd = open(temp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(tempfd==-1)
+        throw std::runtime_error("Failed to open "+temp+" : "+strerror(errno));
+    const char *pos = content.c_str();
+    size_t left = content.size();
+    while(left) {
+        ssize_t ret = write(tempfd, pos, left);
+        if(ret<0 && errno==EINTR)
+            continue;
+        if(ret<=0)
+            break;
+        pos += ret;
+        left -= ret;
+    }
+    if(left || fsync(tempfd)!=0) {
+        int err = errno;
+        close(tempfd);
+        throw std::runtime_error("Failed to write "+temp+" : "+strerror(err));
+    }
+    close(tempfd);
+    if(rename(temp.c_str(), fname.c_str())!=0)
+        throw std::runtime_error("Failed to replace "+fname+" : "+strerror(errno));
+    std::cerr<<"Compacted "<<fname<<" from "<<nlines<<" to "<<entries.size()<<" lines\n";
+    nlines = entries.size();
+
+    // the old file is gone
+    if(fd!=-1)
+        close(fd);
+    fd = open(fname.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
+    if(fd==-1)
+        throw std::runtime_error("Failed to open "+fname+" : "+strerror(errno));
+}
+
+Manifest::~Manifest()
+{
+    close(fd);
+}
+
+bool Manifest::lookup(const std::string& pv, Entry& entry)
+{
+    Guard G(lock);
+    entries_t::const_iterator it = entries.find(pv);
+    if(it==entries.end())
+        return false;
+    entry = it->second;
+    return true;
+}
+
+void Manifest::update(const std::string& pv, const Entry& entry)
+{
+    std::string line(format(pv, entry));
+    Guard G(lock);
+    entries[pv] = entry;
+    // A single O_APPEND write, so lines from concurrent workers don't mix.
+    ssize_t ret = write(fd, line.c_str(), line.size());
+    if(ret!=ssize_t(line.size()))
+        std::cerr<<"ERROR: "<<fname<<": write failed : "<<strerror(errno)<<"\n";
+    nlines++;
+
+    // a long -follow appends for every cycle
+    if(nlines>2*entries.size()) {
+        try {
+            compact();
+        } catch(std::exception& e) {
+            std::cerr<<"ERROR: "<<e.what()<<"\n";
+        }
+    }
+}
+
+size_t Manifest::size()
+{
+    Guard G(lock);
+    return entries.size();
+}
@@ -0,0 +1,62 @@
+#ifndef PBMANIFEST_H
+#define PBMANIFEST_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+#include <epicsMutex.h>
+
+/* Record of previous exports, kept in the output tree so that reruns only
+ * need to visit PVs which have new data.
+ *
+ * The file is a journal with one line per PV export, appended as each PV
+ * is completed.  The last line for a PV wins.  A line torn by a crash is
+ * ignored when loading.  Superseded lines are dropped by rewriting the file
+ * and renaming it into place when it is opened, and when the lines appended
+ * since outnumber the PVs (eg. after many -follow cycles).
+ *
+ * A PV is only updated once its .pb files are closed, which with a Manifest
+ * in use waits for them to be on disk (see bufferedfile::syncOnClose()).
+ * So an entry never claims samples lost in a crash.
+ */
+class Manifest
+{
+public:
+    struct Entry {
+        epicsTimeStamp end;     // end of the RTree interval when exported
+        epicsTimeStamp last;    // time of the last sample written
+        unsigned long count;    // # of samples written, over all runs
+        std::vector<std::string> files;
+        Entry();
+    };
+
+    explicit Manifest(const std::string& fname);
+    ~Manifest();
+
+    bool lookup(const std::string& pv, Entry& entry);
+    void update(const std::string& pv, const Entry& entry);
+    size_t size();
+
+    static std::string format(const std::string& pv, const Entry& entry);
+    static bool parse(const std::string& line, std::string& pv, Entry& entry);
+
+private:
+    Manifest(const Manifest&);
+    Manifest& operator=(const Manifest&);
+
+    // Replace the file with one line per entry, then append to that.
+    // Throws std::runtime_error
+    void compact();
+
+    const std::string fname;
+    int fd;
+    // in the file
+    size_t nlines;
+    epicsMutex lock;
+    typedef std::map<std::string, Entry> entries_t;
+    entries_t entries;
+};
+
+#endif // PBMANIFEST_H
@@ -0,0 +1,215 @@
+
+#include <algorithm>
+#include <set>
+
+// Tools
+#include <AutoPtr.h>
+
+#include "pbeutil.h"
+#include "pbmerge.h"
+
+MergeReader::MergeReader(const std::vector<DataReader*>& readers)
+    :ndropped(0)
+    ,readers(readers)
+    ,cur(readers.size())
+    ,returned(false)
+    ,haveprev(false)
+    ,prevType(0)
+    ,prevCount(0)
+    ,switched(false)
+{
+    heap.reserve(readers.size());
+}
+
+MergeReader::~MergeReader()
+{
+    for(size_t i=0; i<readers.size(); i++)
+        delete readers[i];
+}
+
+bool MergeReader::Later::operator()(size_t a, size_t b) const
+{
+    const epicsTimeStamp& A = readers[a]->get()->stamp;
+    const epicsTimeStamp& B = readers[b]->get()->stamp;
+    if(A.secPastEpoch!=B.secPastEpoch)
+        return A.secPastEpoch>B.secPastEpoch;
+    if(A.nsec!=B.nsec)
+        return A.nsec>B.nsec;
+    return a>b;
+}
+
+const RawValue::Data *MergeReader::find(const stdString &channel_name,
+                                        const epicsTime *start)
+{
+    this->channel_name = channel_name;
+    heap.clear();
+    cur = readers.size();
+    returned = haveprev = switched = false;
+
+    // the latest sample of any reader at or before 'start'
+    bool before = false;
+    epicsTimeStamp latest = {0, 0};
+    for(size_t i=0; i<readers.size(); i++) {
+        const RawValue::Data *samp = readers[i]->find(channel_name, start);
+        if(samp && start && notAfter(samp->stamp, *start)
+                && (!before || notAfter(latest, samp->stamp))) {
+            latest = samp->stamp;
+            before = true;
+        }
+    }
+
+    for(size_t i=0; i<readers.size(); i++) {
+        const RawValue::Data *samp = readers[i]->get();
+        while(samp && before && !notAfter(latest, samp->stamp))
+            samp = readers[i]->next();
+        if(samp)
+            heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), Later(readers));
+
+    return select();
+}
+
+const RawValue::Data *MergeReader::next()
+{
+    if(cur==readers.size())
+        return 0;
+    haveprev = true;
+    prevType = getType();
+    prevCount = getCount();
+    if(readers[cur]->next()) {
+        heap.push_back(cur);
+        std::push_heap(heap.begin(), heap.end(), Later(readers));
+    }
+    return select();
+}
+
+const RawValue::Data *MergeReader::select()
+{
+    Later later(readers);
+    while(!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        size_t i = heap.back();
+        heap.pop_back();
+
+        const RawValue::Data *samp = readers[i]->get();
+        if(returned && i!=cur && notAfter(samp->stamp, last)) {
+            ndropped++;
+            if(readers[i]->next()) {
+                heap.push_back(i);
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+            continue;
+        }
+
+        switched = returned && i!=cur;
+        cur = i;
+        returned = true;
+        last = samp->stamp;
+        return samp;
+    }
+    cur = readers.size();
+    return 0;
+}
+
+const RawValue::Data *MergeReader::get() const
+{
+    return cur<readers.size() ? readers[cur]->get() : 0;
+}
+
+DbrType MergeReader::getType() const
+{
+    return cur<readers.size() ? readers[cur]->getType() : 0;
+}
+
+DbrCount MergeReader::getCount() const
+{
+    return cur<readers.size() ? readers[cur]->getCount() : 0;
+}
+
+const CtrlInfo &MergeReader::getInfo() const
+{
+    return cur<readers.size() ? readers[cur]->getInfo() : noinfo;
+}
+
+bool MergeReader::changedType()
+{
+    if(cur==readers.size())
+        return false;
+    if(!haveprev)
+        return readers[cur]->changedType();
+    return getType()!=prevType || getCount()!=prevCount;
+}
+
+bool MergeReader::changedInfo()
+{
+    if(cur==readers.size())
+        return false;
+    // the info of the previous reader may differ, so may have to be written again
+    return switched || readers[cur]->changedInfo();
+}
+
+
+IndexSet::~IndexSet()
+{
+    for(size_t i=0; i<indexes.size(); i++)
+        delete indexes[i];
+}
+
+void IndexSet::open(const std::vector<std::string>& names)
+{
+    for(size_t i=0; i<names.size(); i++) {
+        AutoPtr<AutoIndex> idx(new AutoIndex);
+        idx->open(names[i].c_str());
+        indexes.push_back(idx.release());
+    }
+}
+
+bool IndexSet::getInterval(const stdString& channel, epicsTime& start, epicsTime& end)
+{
+    bool found = false;
+    for(size_t i=0; i<indexes.size(); i++) {
+        stdString dirname;
+        AutoPtr<RTree> tree(indexes[i]->getTree(channel, dirname));
+        epicsTime S, E;
+        if(!tree || !tree->getInterval(S, E))
+            continue;
+        if(!found || S<start)
+            start = S;
+        if(!found || E>end)
+            end = E;
+        found = true;
+    }
+    return found;
+}
+
+DataReader *IndexSet::createReader()
+{
+    if(indexes.size()==1)
+        return ReaderFactory::create(*indexes[0], ReaderFactory::Raw, 0.0);
+
+    std::vector<DataReader*> readers;
+    try {
+        for(size_t i=0; i<indexes.size(); i++)
+            readers.push_back(ReaderFactory::create(*indexes[i], ReaderFactory::Raw, 0.0));
+        return new MergeReader(readers);
+    } catch(...) {
+        for(size_t i=0; i<readers.size(); i++)
+            delete readers[i];
+        throw;
+    }
+}
+
+void IndexSet::channels(std::vector<stdString>& names)
+{
+    std::set<stdString> seen;
+    for(size_t i=0; i<indexes.size(); i++) {
+        Index::NameIterator iter;
+        if(!indexes[i]->getFirstChannel(iter))
+            continue;
+        do {
+            if(seen.insert(iter.getName()).second)
+                names.push_back(iter.getName());
+        } while(indexes[i]->getNextChannel(iter));
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef PBMERGE_H
+#define PBMERGE_H
+
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+// Storage
+#include <DataReader.h>
+#include <AutoIndex.h>
+
+/* Merges the samples of one PV from several DataReaders into time order.
+ *
+ * Readers are given in order of preference.  The reader of the next sample
+ * is kept at the top of a heap ordered by time, then preference.
+ * A sample from a different reader than the sample before it, which is not
+ * after it, is a duplicate (the archives overlap) and is dropped.
+ * So where archives overlap, the preferred reader wins, and the samples
+ * of any one reader are passed through as they are.
+ *
+ * find() positions every reader, then skips the samples of each which
+ * are before the latest one at or before 'start'.  As for one reader,
+ * the first sample is at or before 'start' if any reader has such a sample.
+ */
+class MergeReader : public DataReader
+{
+public:
+    // Takes ownership of the readers
+    explicit MergeReader(const std::vector<DataReader*>& readers);
+    virtual ~MergeReader();
+
+    virtual const RawValue::Data *find(const stdString &channel_name,
+                                       const epicsTime *start);
+    virtual const RawValue::Data *next();
+    virtual const RawValue::Data *get() const;
+    virtual DbrType getType() const;
+    virtual DbrCount getCount() const;
+    virtual const CtrlInfo &getInfo() const;
+    virtual bool changedType();
+    virtual bool changedInfo();
+
+    // Samples dropped as duplicates since construction
+    unsigned long ndropped;
+
+private:
+    MergeReader(const MergeReader&);
+    MergeReader& operator=(const MergeReader&);
+
+    // Orders the heap so that the earliest sample is on top
+    struct Later {
+        const std::vector<DataReader*>& readers;
+        explicit Later(const std::vector<DataReader*>& readers) :readers(readers) {}
+        bool operator()(size_t a, size_t b) const;
+    };
+
+    // Make current the next sample which isn't a duplicate
+    const RawValue::Data *select();
+
+    std::vector<DataReader*> readers;
+    // Readers with a sample, other than the current one
+    std::vector<size_t> heap;
+    // The reader of the current sample, or readers.size() if none
+    size_t cur;
+    // Whether a sample has been returned since find(), and its time
+    bool returned;
+    epicsTimeStamp last;
+    // Of the sample before the current one, if there was one since find()
+    bool haveprev;
+    DbrType prevType;
+    DbrCount prevCount;
+    // The current sample is from a different reader than the one before
+    bool switched;
+    CtrlInfo noinfo;
+};
+
+/* The index files of one or more archives, used as one.
+ * As for an Index, calls must be made with storageLock held.
+ */
+class IndexSet
+{
+public:
+    IndexSet() {}
+    ~IndexSet();
+
+    // Open every index.  Throws GenericException if any can't be
+    void open(const std::vector<std::string>& names);
+    size_t size() const { return indexes.size(); }
+
+    // The union of the intervals of a channel in all indexes.
+    // Returns false if no index has data for it.
+    bool getInterval(const stdString& channel, epicsTime& start, epicsTime& end);
+
+    // A raw reader of one index, or else a MergeReader over all of them,
+    // in the order given to open().
+    DataReader *createReader();
+
+    // The names of all channels, in order of first appearance
+    void channels(std::vector<stdString>& names);
+
+private:
+    IndexSet(const IndexSet&);
+    IndexSet& operator=(const IndexSet&);
+
+    std::vector<AutoIndex*> indexes;
+};
+
+#endif // PBMERGE_H
@@ -0,0 +1,191 @@
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <vector>
+
+// Base
+#include <epicsTime.h>
+// Tools
+#include <ArgParser.h>
+
+#include "pbfile.h"
+#include "pbeutil.h"
+
+/* Print the samples of an exported .pb file within a time range.
+ *
+ * The range is found by binary search over the mapped file, so only the
+ * samples printed are unescaped and decoded.
+ */
+
+namespace {
+
+using google::protobuf::RepeatedField;
+using google::protobuf::RepeatedPtrField;
+
+template<typename T>
+void printVal(std::ostream& strm, const T& val)
+{
+    strm<<val;
+}
+
+template<typename T>
+void printVal(std::ostream& strm, const RepeatedField<T>& val)
+{
+    for(int i=0; i<val.size(); i++) {
+        if(i)
+            strm<<",";
+        strm<<val.Get(i);
+    }
+}
+
+void printVal(std::ostream& strm, const RepeatedPtrField<std::string>& val)
+{
+    for(int i=0; i<val.size(); i++) {
+        if(i)
+            strm<<",";
+        strm<<val.Get(i);
+    }
+}
+
+// DBR_CHAR is stored as bytes, print each as a number
+void printBytes(std::ostream& strm, const std::string& val)
+{
+    for(size_t i=0; i<val.size(); i++) {
+        if(i)
+            strm<<",";
+        strm<<int(epicsInt8(val[i]));
+    }
+}
+
+template<class PB>
+void printValue(std::ostream& strm, const PB& samp)
+{
+    printVal(strm, samp.val());
+}
+
+template<>
+void printValue(std::ostream& strm, const EPICS::ScalarByte& samp)
+{
+    printBytes(strm, samp.val());
+}
+
+template<>
+void printValue(std::ostream& strm, const EPICS::VectorChar& samp)
+{
+    printBytes(strm, samp.val());
+}
+
+template<class PB>
+void printSamples(const PBFile& F, const char *line, const char *end)
+{
+    PB samp;
+    std::vector<char> buf;
+    for(; line<end; line=F.next(line)) {
+        if(!F.unescapeLine(line, buf) || !samp.ParseFromArray(buf.empty() ? 0 : &buf[0], buf.size())) {
+            std::cerr<<"ERROR: "<<F.name()<<": Can't decode the sample at offset "<<F.offset(line)<<"\n";
+            continue;
+        }
+        epicsTimeStamp t;
+        t.secPastEpoch = F.startOfYear().secPastEpoch + samp.secondsintoyear();
+        t.nsec = samp.nano();
+
+        printTime(std::cout, t);
+        std::cout<<"\t";
+        printValue(std::cout, samp);
+        std::cout<<"\t"<<samp.severity()<<"\t"<<samp.status();
+        for(int i=0; i<samp.fieldvalues_size(); i++)
+            std::cout<<"\t"<<samp.fieldvalues(i).name()<<"="<<samp.fieldvalues(i).val();
+        std::cout<<"\n";
+    }
+}
+
+void printSamples(const PBFile& F, const char *line, const char *end)
+{
+    switch(F.header().type()) {
+#define CASE(TYPE, PB) case EPICS::TYPE: printSamples<EPICS::PB>(F, line, end); break
+    CASE(SCALAR_STRING, ScalarString);
+    CASE(SCALAR_SHORT, ScalarShort);
+    CASE(SCALAR_FLOAT, ScalarFloat);
+    CASE(SCALAR_ENUM, ScalarEnum);
+    CASE(SCALAR_BYTE, ScalarByte);
+    CASE(SCALAR_INT, ScalarInt);
+    CASE(SCALAR_DOUBLE, ScalarDouble);
+    CASE(WAVEFORM_STRING, VectorString);
+    CASE(WAVEFORM_SHORT, VectorShort);
+    CASE(WAVEFORM_FLOAT, VectorFloat);
+    CASE(WAVEFORM_ENUM, VectorEnum);
+    CASE(WAVEFORM_BYTE, VectorChar);
+    CASE(WAVEFORM_INT, VectorInt);
+    CASE(WAVEFORM_DOUBLE, VectorDouble);
+#undef CASE
+    default:
+        throw std::runtime_error("Unsupported payload type "+EPICS::PayloadType_Name(F.header().type()));
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    CmdArgParser parser(argc, argv);
+    parser.setArgumentsInfo(" <file.pb>");
+    parser.setFooter("\nTimes are UTC, as YYYY-MM-DD[THH:MM[:SS[.fraction]]][Z]\n"
+                     "Each sample is printed as\n"
+                     "  time value severity status [field=value ...]\n");
+    CmdArgString start(parser, "start", "<time>", "Only samples at or after this time");
+    CmdArgString end(parser, "end", "<time>", "Only samples before this time");
+    CmdArgFlag count(parser, "count", "Print only the number of samples in the range");
+    CmdArgFlag header(parser, "header", "Print the PayloadInfo header first");
+
+    if(!parser.parse())
+        return 2;
+    if(parser.getArguments().size()!=1) {
+        parser.usage();
+        return 2;
+    }
+try{
+    epicsTimeStamp startt, endt;
+    if(!start.get().empty() && !parseTime(start.get().c_str(), &startt)) {
+        std::cerr<<"ERROR: Invalid -start time '"<<start.get().c_str()<<"'\n";
+        return 2;
+    }
+    if(!end.get().empty() && !parseTime(end.get().c_str(), &endt)) {
+        std::cerr<<"ERROR: Invalid -end time '"<<end.get().c_str()<<"'\n";
+        return 2;
+    }
+
+    PBFile F(parser.getArgument(0).c_str());
+    if(F.partial())
+        std::cerr<<"WARN: "<<F.name()<<": Ignoring "<<F.partial()<<" bytes after the last complete line\n";
+
+    const char *first = start.get().empty() ? F.begin() : F.lowerBound(startt),
+               *last = end.get().empty() ? F.end() : F.lowerBound(endt);
+
+    std::cout<<std::setprecision(15);
+
+    if(header) {
+        const EPICS::PayloadInfo& info = F.header();
+        std::cout<<"# pvname\t"<<info.pvname()<<"\n"
+                 <<"# year\t"<<info.year()<<"\n"
+                 <<"# type\t"<<EPICS::PayloadType_Name(info.type())<<"\n";
+        if(info.has_elementcount())
+            std::cout<<"# elementCount\t"<<info.elementcount()<<"\n";
+        for(int i=0; i<info.headers_size(); i++)
+            std::cout<<"# "<<info.headers(i).name()<<"\t"<<info.headers(i).val()<<"\n";
+    }
+
+    if(count) {
+        size_t n = 0;
+        for(const char *line = first; line<last; line = F.next(line))
+            n++;
+        std::cout<<n<<"\n";
+    } else {
+        printSamples(F, first, last);
+    }
+    return 0;
+}catch(std::exception& e){
+    std::cerr<<"ERROR: "<<e.what()<<"\n";
+    return 1;
+}
+}
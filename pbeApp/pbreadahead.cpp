@@ -0,0 +1,207 @@
+
+#include <string.h>
+
+#include <stdexcept>
+
+#include <epicsAtomic.h>
+// Tools
+#include <GenericException.h>
+
+#include "pbreadahead.h"
+
+ReadAheadReader::ReadAheadReader(DataReader& reader, size_t depth)
+    :reader(reader)
+    ,depth(depth ? depth : 1)
+    ,batch(this->depth/4 ? this->depth/4 : 1)
+    ,ring(this->depth)
+    ,head(0)
+    ,tail(0)
+    ,dataWaiting(0)
+    ,spaceWaiting(0)
+    ,stopping(0)
+    ,cur(0)
+    ,holding(false)
+    ,ended(false)
+    ,type(0)
+    ,count(0)
+{
+    channel_name = reader.channel_name;
+    fill(seed, reader.get(), true);
+    adopt(seed);
+    ended = !get();
+    if(!ended)
+        start();
+}
+
+ReadAheadReader::~ReadAheadReader()
+{
+    stop();
+    for(size_t i=0; i<ring.size(); i++)
+        if(ring[i].data)
+            RawValue::free(ring[i].data);
+    if(seed.data)
+        RawValue::free(seed.data);
+}
+
+const RawValue::Data *ReadAheadReader::find(const stdString &channel_name,
+                                            const epicsTime *start)
+{
+    stop();
+    const RawValue::Data *samp = reader.find(channel_name, start);
+    this->channel_name = reader.channel_name;
+    fill(seed, samp, true);
+    adopt(seed);
+    ended = !samp;
+    if(!ended)
+        this->start();
+    return get();
+}
+
+const RawValue::Data *ReadAheadReader::next()
+{
+    if(holding)
+        release();
+    if(ended)
+        return 0;
+
+    while(epicsAtomicGetSizeT(&head)==tail) {
+        epicsAtomicIncrIntT(&dataWaiting);
+        if(epicsAtomicGetSizeT(&head)==tail)
+            dataEvent.wait();
+        epicsAtomicDecrIntT(&dataWaiting);
+    }
+    epicsAtomicReadMemoryBarrier();
+
+    Slot& slot = ring[tail%depth];
+    holding = true;
+
+    switch(slot.kind) {
+    case Slot::Sample:
+        adopt(slot);
+        return cur->data;
+    case Slot::End:
+        release();
+        cur = 0;
+        ended = true;
+        return 0;
+    case Slot::Error:
+    default: {
+        bool generic = slot.generic;
+        std::string message(slot.message);
+        release();
+        cur = 0;
+        if(generic)
+            throw GenericException(__FILE__, __LINE__, "%s", message.c_str());
+        throw std::runtime_error(message);
+    }
+    }
+}
+
+void ReadAheadReader::run()
+{
+    bool more = true;
+    while(more) {
+        // wait for a free slot
+        while(head-epicsAtomicGetSizeT(&tail)==depth && !epicsAtomicGetIntT(&stopping)) {
+            epicsAtomicIncrIntT(&spaceWaiting);
+            if(head-epicsAtomicGetSizeT(&tail)==depth && !epicsAtomicGetIntT(&stopping))
+                spaceEvent.wait();
+            epicsAtomicDecrIntT(&spaceWaiting);
+        }
+        if(epicsAtomicGetIntT(&stopping))
+            return;
+        epicsAtomicReadMemoryBarrier();
+
+        Slot& slot = ring[head%depth];
+        try {
+            fill(slot, reader.next(), false);
+        } catch(GenericException& e) {
+            slot.kind = Slot::Error;
+            slot.generic = true;
+            slot.message = e.what();
+        } catch(std::exception& e) {
+            slot.kind = Slot::Error;
+            slot.generic = false;
+            slot.message = e.what();
+        }
+        // the user may call next() again after an Error, as with any reader
+        more = slot.kind!=Slot::End;
+
+        size_t filled = epicsAtomicIncrSizeT(&head);
+        if(epicsAtomicGetIntT(&dataWaiting) &&
+                (slot.kind!=Slot::Sample || filled-epicsAtomicGetSizeT(&tail)>=batch))
+            dataEvent.signal();
+    }
+}
+
+void ReadAheadReader::fill(Slot& slot, const RawValue::Data *samp, bool first)
+{
+    slot.changedType = slot.changedInfo = slot.newInfo = false;
+    if(!samp) {
+        slot.kind = Slot::End;
+        return;
+    }
+    slot.kind = Slot::Sample;
+    slot.type = reader.getType();
+    slot.count = reader.getCount();
+
+    size_t size = RawValue::getSize(slot.type, slot.count);
+    if(size>slot.capacity) {
+        if(slot.data)
+            RawValue::free(slot.data);
+        slot.data = RawValue::allocate(slot.type, slot.count, 1);
+        slot.capacity = size;
+    }
+    memcpy(slot.data, samp, size);
+
+    slot.changedType = reader.changedType();
+    slot.changedInfo = reader.changedInfo();
+    slot.newInfo = first || slot.changedInfo;
+    if(slot.newInfo)
+        slot.info = reader.getInfo();
+}
+
+void ReadAheadReader::adopt(const Slot& slot)
+{
+    if(slot.kind!=Slot::Sample) {
+        cur = 0;
+        return;
+    }
+    cur = &slot;
+    type = slot.type;
+    count = slot.count;
+    if(slot.newInfo)
+        info = slot.info;
+}
+
+void ReadAheadReader::release()
+{
+    holding = false;
+    size_t released = epicsAtomicIncrSizeT(&tail);
+    if(epicsAtomicGetIntT(&spaceWaiting) &&
+            depth-(epicsAtomicGetSizeT(&head)-released)>=batch)
+        spaceEvent.signal();
+}
+
+void ReadAheadReader::start()
+{
+    head = tail = 0;
+    holding = false;
+    epicsAtomicSetIntT(&stopping, 0);
+    dataEvent.tryWait();
+    spaceEvent.tryWait();
+    worker = new epicsThread(*this, "readahead",
+                             epicsThreadGetStackSize(epicsThreadStackSmall),
+                             epicsThreadPriorityMedium);
+    worker->start();
+}
+
+void ReadAheadReader::stop()
+{
+    if(!worker)
+        return;
+    epicsAtomicSetIntT(&stopping, 1);
+    spaceEvent.signal();
+    worker->exitWait();
+    worker = 0;
+}
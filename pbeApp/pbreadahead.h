@@ -0,0 +1,100 @@
+#ifndef PBREADAHEAD_H
+#define PBREADAHEAD_H
+
+#include <string>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsThread.h>
+// Tools
+#include <AutoPtr.h>
+// Storage
+#include <DataReader.h>
+
+/* A DataReader which reads ahead of its user.
+ * A worker thread advances the wrapped reader and copies each sample,
+ * with its type, count, and CtrlInfo, into a ring of 'depth' slots.
+ * The ring is single producer, single consumer.  Neither side takes a lock
+ * to pass a sample, and either only sleeps when the ring is empty (or full),
+ * to be woken when a quarter of it has been filled (or emptied).
+ *
+ * Exceptions thrown by the wrapped reader are re-thrown from the next()
+ * which would have returned that sample.
+ * find() stops the worker, repositions the wrapped reader, and restarts it.
+ * The wrapped reader must not be used directly while this wraps it.
+ */
+class ReadAheadReader : public DataReader, private epicsThreadRunable
+{
+public:
+    // Starts reading after reader.get(), the current sample
+    ReadAheadReader(DataReader& reader, size_t depth);
+    virtual ~ReadAheadReader();
+
+    virtual const RawValue::Data *find(const stdString &channel_name,
+                                       const epicsTime *start);
+    virtual const RawValue::Data *next();
+    virtual const RawValue::Data *get() const { return cur ? cur->data : 0; }
+    virtual DbrType getType() const { return type; }
+    virtual DbrCount getCount() const { return count; }
+    virtual const CtrlInfo &getInfo() const { return info; }
+    virtual bool changedType() { return cur && cur->changedType; }
+    virtual bool changedInfo() { return cur && cur->changedInfo; }
+
+private:
+    ReadAheadReader(const ReadAheadReader&);
+    ReadAheadReader& operator=(const ReadAheadReader&);
+
+    struct Slot {
+        enum Kind {
+            Sample,
+            End,   // the wrapped reader returned NULL
+            Error, // the wrapped reader threw
+        } kind;
+        RawValue::Data *data; // valid if kind==Sample
+        size_t capacity;      // of data, in bytes
+        DbrType type;
+        DbrCount count;
+        bool changedType, changedInfo;
+        bool newInfo;         // info is set
+        CtrlInfo info;
+        bool generic;         // Error from a GenericException
+        std::string message;  // of the Error
+
+        Slot() :kind(End), data(0), capacity(0), type(0), count(0),
+            changedType(false), changedInfo(false), newInfo(false), generic(false) {}
+    };
+
+    virtual void run();
+    // Copy the current sample of the wrapped reader (or NULL) into a slot
+    void fill(Slot& slot, const RawValue::Data *samp, bool first);
+    // Make a slot the current sample
+    void adopt(const Slot& slot);
+    // Return the current slot to the worker
+    void release();
+    void start();
+    void stop();
+
+    DataReader& reader;
+    const size_t depth, batch;
+    std::vector<Slot> ring;
+    // The sample current after construction or find()
+    Slot seed;
+    // Counts of slots ever filled and released. head is only written by the
+    // worker, tail only by the user.
+    size_t head, tail;
+    // Set while a side sleeps on its event
+    int dataWaiting, spaceWaiting;
+    int stopping;
+    epicsEvent dataEvent, spaceEvent;
+    AutoPtr<epicsThread> worker;
+
+    // The slot of the sample last returned, or NULL after the end
+    const Slot *cur;
+    bool holding; // cur is in the ring, and not yet released
+    bool ended;   // no more samples, so no worker
+    DbrType type;
+    DbrCount count;
+    CtrlInfo info;
+};
+
+#endif // PBREADAHEAD_H
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <iostream>
+
+#include <epicsGuard.h>
+
+#include "pbstats.h"
+#include "EPICSEvent.pb.h"
+
+typedef epicsGuard<epicsMutex> Guard;
+
+// ETA from the rate of this many recent PVs
+static const size_t etaWindow = 256;
+// Minimum interval between updates of the Prometheus file
+static const double promInterval = 10.0;
+
+const char * const StageStats::names[StageStats::NStages] = {
+    "lookup",
+    "read",
+    "encode",
+    "escape",
+    "write",
+    "skip",
+};
+
+void StageStats::clear()
+{
+    for(unsigned i=0; i<NStages; i++) {
+        seconds[i] = 0.0;
+        calls[i] = timed[i] = 0;
+    }
+}
+
+StageStats& StageStats::operator+=(const StageStats& o)
+{
+    for(unsigned i=0; i<NStages; i++) {
+        seconds[i] += o.seconds[i];
+        calls[i] += o.calls[i];
+        timed[i] += o.timed[i];
+    }
+    return *this;
+}
+
+static void putJSONString(std::ostream& strm, const char *s)
+{
+    strm<<'"';
+    for(; *s; s++) {
+        switch(*s) {
+        case '"': strm<<"\\\""; break;
+        case '\\': strm<<"\\\\"; break;
+        default:
+            if((unsigned char)*s<0x20) {
+                char esc[8];
+                sprintf(esc, "\\u%04x", (unsigned)(unsigned char)*s);
+                strm<<esc;
+            } else {
+                strm<<*s;
+            }
+        }
+    }
+    strm<<'"';
+}
+
+StatsReporter::StatsReporter(const std::string& jsonname, const std::string& promname)
+    :json(0)
+    ,promname(promname)
+    ,total(0)
+    ,done(0)
+    ,started(monotonicSeconds())
+    ,lastprom(0.0)
+    ,samples(0)
+    ,bytes(0)
+    ,syscalls(0)
+{
+    if(!jsonname.empty()) {
+        json = fopen(jsonname.c_str(), "a");
+        if(!json)
+            throw std::runtime_error("Can't open "+jsonname+" : "+strerror(errno));
+    }
+}
+
+StatsReporter::~StatsReporter()
+{
+    if(json)
+        fclose(json);
+}
+
+void StatsReporter::setTotal(size_t total)
+{
+    Guard G(lock);
+    this->total = total;
+}
+
+double StatsReporter::eta(double now) const
+{
+    if(!total || !done)
+        return -1.0;
+    if(done>=total)
+        return 0.0;
+    double rate;
+    if(recent.size()>=2 && recent.back()>recent.front())
+        rate = (recent.size()-1)/(recent.back()-recent.front());
+    else if(now>started)
+        rate = done/(now-started);
+    else
+        return -1.0;
+    // the time since the last completion is already spent
+    double left = (total-done)/rate - (now-recent.back());
+    return left>0.0 ? left : 0.0;
+}
+
+void StatsReporter::pvDone(const char *pv, const char *result, unsigned long pvsamples,
+                           unsigned long pvbytes, unsigned long pvsyscalls, const StageStats& pvstages)
+{
+    double now = monotonicSeconds();
+    Guard G(lock);
+
+    done++;
+    results[result]++;
+    samples += pvsamples;
+    bytes += pvbytes;
+    syscalls += pvsyscalls;
+    stages += pvstages;
+    recent.push_back(now);
+    if(recent.size()>etaWindow)
+        recent.pop_front();
+
+    if(json) {
+        std::ostringstream strm;
+        strm<<"{\"pv\":";
+        putJSONString(strm, pv);
+        strm<<",\"result\":\""<<result<<"\""
+            <<",\"samples\":"<<pvsamples
+            <<",\"bytes\":"<<pvbytes
+            <<",\"syscalls\":"<<pvsyscalls;
+        for(unsigned i=0; i<StageStats::NStages; i++)
+            strm<<",\""<<StageStats::names[i]<<"_sec\":"<<pvstages.total(StageStats::Stage(i));
+        strm<<",\"done\":"<<done;
+        if(total)
+            strm<<",\"total\":"<<total;
+        double left = eta(now);
+        if(left>=0.0)
+            strm<<",\"eta_sec\":"<<left;
+        strm<<"}\n";
+        std::string line(strm.str());
+        if(fwrite(line.c_str(), 1, line.size(), json)!=line.size() || fflush(json))
+            std::cerr<<"WARN: Error writing statistics : "<<strerror(errno)<<"\n";
+    }
+
+    if(!promname.empty() && now-lastprom>=promInterval)
+        writeProm(now);
+}
+
+void StatsReporter::finish()
+{
+    Guard G(lock);
+    if(!promname.empty())
+        writeProm(monotonicSeconds());
+}
+
+void StatsReporter::writeProm(double now)
+{
+    lastprom = now;
+
+    std::ostringstream strm;
+    strm<<"# HELP pbexport_stage_seconds_total Time spent in each stage of the export.\n"
+          "# TYPE pbexport_stage_seconds_total counter\n";
+    for(unsigned i=0; i<StageStats::NStages; i++)
+        strm<<"pbexport_stage_seconds_total{stage=\""<<StageStats::names[i]<<"\"} "
+            <<stages.total(StageStats::Stage(i))<<"\n";
+    strm<<"# HELP pbexport_stage_calls_total Number of calls of each stage of the export.\n"
+          "# TYPE pbexport_stage_calls_total counter\n";
+    for(unsigned i=0; i<StageStats::NStages; i++)
+        strm<<"pbexport_stage_calls_total{stage=\""<<StageStats::names[i]<<"\"} "
+            <<stages.calls[i]<<"\n";
+    strm<<"# HELP pbexport_pvs_total PVs completed, by result.\n"
+          "# TYPE pbexport_pvs_total counter\n";
+    for(std::map<std::string, unsigned long>::const_iterator it=results.begin(), end=results.end();
+        it!=end; ++it)
+        strm<<"pbexport_pvs_total{result=\""<<it->first<<"\"} "<<it->second<<"\n";
+    strm<<"# HELP pbexport_samples_total Samples written.\n"
+          "# TYPE pbexport_samples_total counter\n"
+          "pbexport_samples_total "<<samples<<"\n"
+          "# HELP pbexport_bytes_total Bytes written to .pb files.\n"
+          "# TYPE pbexport_bytes_total counter\n"
+          "pbexport_bytes_total "<<bytes<<"\n"
+          "# HELP pbexport_write_syscalls_total Calls to write()/writev().\n"
+          "# TYPE pbexport_write_syscalls_total counter\n"
+          "pbexport_write_syscalls_total "<<syscalls<<"\n"
+          "# HELP pbexport_elapsed_seconds Time since the export started.\n"
+          "# TYPE pbexport_elapsed_seconds gauge\n"
+          "pbexport_elapsed_seconds "<<(now-started)<<"\n";
+    if(total) {
+        strm<<"# HELP pbexport_pvs_remaining PVs not yet completed.\n"
+              "# TYPE pbexport_pvs_remaining gauge\n"
+              "pbexport_pvs_remaining "<<(total-done)<<"\n";
+        double left = eta(now);
+        if(left>=0.0)
+            strm<<"# HELP pbexport_eta_seconds Estimated time remaining.\n"
+                  "# TYPE pbexport_eta_seconds gauge\n"
+                  "pbexport_eta_seconds "<<left<<"\n";
+    }
+
+    // replace, so a reader never sees a partial file
+    std::string content(strm.str()), temp(promname+".tmp");
+    FILE *fp = fopen(temp.c_str(), "w");
+    if(!fp) {
+        std::cerr<<"WARN: Can't open "<<temp<<" : "<<strerror(errno)<<"\n";
+        return;
+    }
+    bool ok = fwrite(content.c_str(), 1, content.size(), fp)==content.size();
+    ok &= fclose(fp)==0;
+    if(!ok || rename(temp.c_str(), promname.c_str()))
+        std::cerr<<"WARN: Can't write "<<promname<<" : "<<strerror(errno)<<"\n";
+}
+
+// Quoted if it contains a separator or a quote
+static void putCSVString(std::ostream& strm, const std::string& s)
+{
+    if(s.find_first_of(",\"\r\n")==std::string::npos) {
+        strm<<s;
+        return;
+    }
+    strm<<'"';
+    for(size_t i=0; i<s.size(); i++) {
+        if(s[i]=='"')
+            strm<<'"';
+        strm<<s[i];
+    }
+    strm<<'"';
+}
+
+CensusReporter::CensusReporter(const std::string& fname)
+    :fp(fopen(fname.c_str(), "w"))
+    ,json(fname.size()>=5 && fname.compare(fname.size()-5, 5, ".json")==0)
+    ,fname(fname)
+{
+    if(!fp)
+        throw std::runtime_error("Can't open "+fname+" : "+strerror(errno));
+    if(!json)
+        fputs("pv,year,file,type,elements,samples,disconnects,bytes\n", fp);
+}
+
+CensusReporter::~CensusReporter()
+{
+    if(fclose(fp))
+        std::cerr<<"WARN: Error writing "<<fname<<" : "<<strerror(errno)<<"\n";
+}
+
+void CensusReporter::add(const char *pv, const std::vector<FileCensus>& files)
+{
+    std::ostringstream strm;
+    for(size_t i=0; i<files.size(); i++) {
+        const FileCensus& F = files[i];
+        const std::string& type = EPICS::PayloadType_Name((EPICS::PayloadType)F.pbtype);
+        if(json) {
+            strm<<"{\"pv\":";
+            putJSONString(strm, pv);
+            strm<<",\"year\":"<<F.year<<",\"file\":";
+            putJSONString(strm, F.file.c_str());
+            strm<<",\"type\":\""<<type<<"\""
+                <<",\"elements\":"<<F.elements
+                <<",\"samples\":"<<F.samples
+                <<",\"disconnects\":"<<F.disconnects
+                <<",\"bytes\":"<<F.bytes<<"}\n";
+        } else {
+            putCSVString(strm, pv);
+            strm<<","<<F.year<<",";
+            putCSVString(strm, F.file);
+            strm<<","<<type<<","<<F.elements<<","<<F.samples<<","<<F.disconnects
+                <<","<<F.bytes<<"\n";
+        }
+    }
+    std::string lines(strm.str());
+    Guard G(lock);
+    if(fwrite(lines.c_str(), 1, lines.size(), fp)!=lines.size() || fflush(fp))
+        std::cerr<<"WARN: Error writing census : "<<strerror(errno)<<"\n";
+}
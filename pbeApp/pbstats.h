@@ -0,0 +1,155 @@
+#ifndef PBSTATS_H
+#define PBSTATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <epicsMutex.h>
+
+// Seconds since an arbitrary start, for measuring intervals
+inline double monotonicSeconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+/* Time spent, and the number of calls, in each stage of an export.
+ * Stages run for every sample are only timed for one call in 'sampling',
+ * so the total is estimated from those which are.
+ */
+struct StageStats
+{
+    enum Stage {
+        Lookup, // RTree lookup, reader creation and find()
+        Read,   // DataReader::next()
+        Encode, // PB encoding
+        Escape, // PlainPB escaping
+        Write,  // write()/writev() of .pb files
+        Skip,   // stepping over samples already exported
+        NStages
+    };
+    enum {sampling=16};
+    static const char * const names[NStages];
+
+    double seconds[NStages]; // of the timed calls
+    unsigned long calls[NStages], timed[NStages];
+
+    StageStats() { clear(); }
+    void clear();
+    StageStats& operator+=(const StageStats& o);
+
+    // estimated total time spent in a stage
+    double total(Stage s) const
+    {
+        return timed[s] ? seconds[s]*calls[s]/timed[s] : 0.0;
+    }
+};
+
+// Counts one call of a stage, and times it if 'sample'
+class StageTimer
+{
+    StageStats& stats;
+    const StageStats::Stage stage;
+    const double start;
+public:
+    StageTimer(StageStats& stats, StageStats::Stage stage, bool sample=true)
+        :stats(stats)
+        ,stage(stage)
+        ,start(sample ? monotonicSeconds() : -1.0)
+    {}
+    ~StageTimer()
+    {
+        stats.calls[stage]++;
+        if(start>=0.0) {
+            stats.seconds[stage] += monotonicSeconds()-start;
+            stats.timed[stage]++;
+        }
+    }
+};
+
+/* Reports statistics as each PV is completed.
+ * A JSON object per PV is appended to one file, and/or the process totals
+ * are kept in a Prometheus textfile, which is replaced every few seconds.
+ * Both include an estimate of the time remaining, from the rate at which
+ * recent PVs were completed, when the total number of PVs is known.
+ */
+class StatsReporter
+{
+public:
+    // Either name may be empty to skip that output
+    StatsReporter(const std::string& jsonname, const std::string& promname);
+    ~StatsReporter();
+
+    // The number of PVs to be exported
+    void setTotal(size_t total);
+
+    void pvDone(const char *pv, const char *result, unsigned long samples,
+                unsigned long bytes, unsigned long syscalls, const StageStats& stages);
+
+    // Write out the final totals
+    void finish();
+
+private:
+    StatsReporter(const StatsReporter&);
+    StatsReporter& operator=(const StatsReporter&);
+
+    // Seconds remaining, or -1 if unknown.  Called with the lock held
+    double eta(double now) const;
+    void writeProm(double now);
+
+    epicsMutex lock;
+    FILE *json;
+    std::string promname;
+    size_t total, done;
+    double started, lastprom;
+    // completion times of the most recent PVs
+    std::deque<double> recent;
+    std::map<std::string, unsigned long> results;
+    unsigned long samples, bytes, syscalls;
+    StageStats stages;
+};
+
+// What a PBWriter wrote, or would write, to one file
+struct FileCensus
+{
+    std::string file;
+    int year;
+    int pbtype;         // EPICS::PayloadType
+    size_t elements;
+    unsigned long samples;
+    unsigned long disconnects; // periods of disconnection which start in this file
+    size_t bytes;       // including the header
+
+    FileCensus() :year(0), pbtype(0), elements(0), samples(0), disconnects(0), bytes(0) {}
+};
+
+/* Reports the files an export would write, from a dry run.
+ * A line per file, as CSV with a header line, or as a JSON object if the
+ * file name ends with ".json".  Files of a PV with a changed type are
+ * reported separately, with the suffix of the file name (ie. ".pb.1").
+ */
+class CensusReporter
+{
+public:
+    explicit CensusReporter(const std::string& fname);
+    ~CensusReporter();
+
+    void add(const char *pv, const std::vector<FileCensus>& files);
+
+private:
+    CensusReporter(const CensusReporter&);
+    CensusReporter& operator=(const CensusReporter&);
+
+    epicsMutex lock;
+    FILE *fp;
+    bool json;
+    std::string fname;
+};
+
+#endif // PBSTATS_H
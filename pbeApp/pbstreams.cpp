@@ -1,21 +1,51 @@
 
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include <epicsAtomic.h>
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#  include <immintrin.h>
+#  define USE_AVX2
+#elif defined(__GNUC__) && defined(__SSE2__)
+#  include <emmintrin.h>
+#  define USE_SSE2
+#endif
+
 #include "pbstreams.h"
+#include "pbstats.h"
+#include "pburing.h"
+#include "pbthrottle.h"
 
 escapingarraystream::escapingarraystream()
     :inbuf()
     ,outbuf()
     ,pos(0)
+    ,hint(0)
+    ,chunk(0)
+    ,flushed(0)
+    ,sealed(false)
 {}
 
 bool escapingarraystream::Next(void **data, int *size)
 {
-    if(pos>=inbuf.size() || inbuf.size()-pos<32)
-        inbuf.resize(inbuf.size()+64);
+    // the serializer is done with the previous chunk
+    flush();
+
+    // grow geometrically, starting from the expected message size
+    chunk = std::max(std::max(chunk*2, hint), (size_t)64);
+    inbuf.resize(chunk);
 
-    size_t more = inbuf.size()-pos;
-    *data = &inbuf[pos];
-    *size = more;
-    pos += more;
+    *data = &inbuf[0];
+    *size = chunk;
+    pos = chunk;
     return true;
 }
 
@@ -27,50 +57,374 @@ void escapingarraystream::BackUp(int count)
 escapingarraystream::int64
 escapingarraystream::ByteCount() const
 {
-    return pos;
+    return flushed+pos;
 }
 
-static size_t plan_size(const char* b, size_t l)
+// Find the first byte which must be escaped.  Returns 'end' if none.
+static const char* find_special(const char *in, const char *end)
 {
-    size_t outlen=l;
-    for(;l;--l, ++b)
-        switch(*b)
+#if defined(USE_AVX2)
+    const __m256i nl = _mm256_set1_epi8('\n'),
+                  cr = _mm256_set1_epi8('\r'),
+                  esc = _mm256_set1_epi8('\x1b');
+    for(; end-in >= 32; in+=32) {
+        __m256i V = _mm256_loadu_si256((const __m256i*)in);
+        __m256i M = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(V, nl),
+                                                     _mm256_cmpeq_epi8(V, cr)),
+                                    _mm256_cmpeq_epi8(V, esc));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(M);
+        if(mask)
+            return in + __builtin_ctz(mask);
+    }
+#endif
+#if defined(USE_AVX2) || defined(USE_SSE2)
+    const __m128i nl16 = _mm_set1_epi8('\n'),
+                  cr16 = _mm_set1_epi8('\r'),
+                  esc16 = _mm_set1_epi8('\x1b');
+    for(; end-in >= 16; in+=16) {
+        __m128i V = _mm_loadu_si128((const __m128i*)in);
+        __m128i M = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(V, nl16),
+                                              _mm_cmpeq_epi8(V, cr16)),
+                                 _mm_cmpeq_epi8(V, esc16));
+        unsigned mask = (unsigned)_mm_movemask_epi8(M);
+        if(mask)
+            return in + __builtin_ctz(mask);
+    }
+#endif
+    for(; in!=end; ++in)
+        switch(*in)
         {
         case '\n':
         case '\r':
         case '\x1b':
-            outlen++;
+            return in;
         }
-    return outlen;
+    return end;
 }
 
-void escapingarraystream::finalize()
+void escapingarraystream::escape(const char *in, size_t len)
 {
-    inbuf.resize(pos);
-    outbuf.clear();
-    outbuf.resize(plan_size(&inbuf[0], inbuf.size()));
-    for(size_t i=0, o=0, s=inbuf.size(); i<s; ++i)
-    {
-        char c=inbuf[i];
-        switch(c)
-        {
-        case '\n':
-        case '\r':
-        case '\x1b':
-            outbuf[o++] = '\x1b';
+    const char *end = in+len;
+
+    while(in!=end) {
+        const char *special = find_special(in, end);
+        outbuf.insert(outbuf.end(), in, special);
+        if(special==end)
             break;
-        default:
-            outbuf[o++] = c;
-            continue;
-        }
-        switch(c)
+
+        char seq[2] = {'\x1b', 0};
+        switch(*special)
         {
-        case '\x1b': outbuf[o++] = 1; break;
-        case '\n': outbuf[o++] = 2; break;
-        case '\r': outbuf[o++] = 3; break;
+        case '\x1b': seq[1] = 1; break;
+        case '\n': seq[1] = 2; break;
+        case '\r': seq[1] = 3; break;
         }
+        outbuf.insert(outbuf.end(), seq, seq+2);
+        in = special+1;
     }
+}
+
+void escapingarraystream::flush()
+{
+    if(sealed) {
+        // start of a new message
+        outbuf.clear();
+        sealed = false;
+    }
+    if(pos)
+        escape(&inbuf[0], pos);
+    flushed += pos;
+    pos = 0;
+}
+
+void escapingarraystream::finalize()
+{
+    flush();
     outbuf.push_back('\n');
+    sealed = true;
     inbuf.clear();
     pos=0;
+    hint=0;
+    chunk=0;
+    flushed=0;
+}
+
+bufferedfile::bufferedfile(size_t bufsize, unsigned ringdepth)
+    :nbytes(0)
+    ,nsyscalls(0)
+    ,seconds(0.0)
+    ,fd(-1)
+    ,ok(true)
+    ,buf(0)
+    ,bufsize(bufsize)
+    ,used(0)
+    ,size(0)
+    ,allocated(0)
+    ,prealloc(0)
+    ,allocating(false)
+    ,ring(0)
+    ,limit(0)
+    ,durable(false)
+{
+#ifdef PB_IO_URING
+    if(ringdepth) {
+        try {
+            ring = new uringwriter(bufsize, ringdepth);
+            buf = ring->buffer();
+        } catch(std::exception& e) {
+            // once, not for every writer
+            static int warned;
+            if(epicsAtomicIncrIntT(&warned)==1)
+                std::cerr<<"WARN: Can't use io_uring, writing synchronously : "<<e.what()<<"\n";
+        }
+    }
+#else
+    (void)ringdepth;
+#endif
+    if(!ring)
+        buf = new char[bufsize];
+}
+
+bufferedfile::~bufferedfile()
+{
+    close();
+#ifdef PB_IO_URING
+    if(ring) {
+        delete ring;
+        return;
+    }
+#endif
+    delete[] buf;
+}
+
+bool bufferedfile::haveRing()
+{
+#ifdef PB_IO_URING
+    return true;
+#else
+    return false;
+#endif
+}
+
+void bufferedfile::open(const char *fname)
+{
+    open(::open(fname, O_WRONLY|O_APPEND|O_CREAT, 0644), fname);
+}
+
+void bufferedfile::open(int newfd, const char *fname)
+{
+    int err = errno;
+    close();
+    name = fname;
+    fd = newfd;
+    ok = fd!=-1;
+    errno = err;
+    if(!ok) {
+        std::cerr<<"ERROR: open "<<name<<": "<<strerror(errno)<<"\n";
+        return;
+    }
+
+    allocating = prealloc!=0;
+    if(allocating || ring) {
+        size = allocated = lseek(fd, 0, SEEK_END);
+        if(size==-1) {
+            ok = false;
+            std::cerr<<"ERROR: seek "<<name<<": "<<strerror(errno)<<"\n";
+            return;
+        }
+    }
+#ifdef PB_IO_URING
+    if(ring) {
+        // the ring writes at explicit offsets, which O_APPEND would ignore
+        int flags = fcntl(fd, F_GETFL);
+        if(flags==-1 || fcntl(fd, F_SETFL, flags&~O_APPEND)==-1) {
+            ok = false;
+            std::cerr<<"ERROR: fcntl "<<name<<": "<<strerror(errno)<<"\n";
+            return;
+        }
+        ring->open(fd, size);
+    }
+#endif
+}
+
+void bufferedfile::reserve(size_t len)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    if(!allocating || size+off_t(len)<=allocated)
+        return;
+    off_t want = size+len-allocated;
+    want += prealloc-1 - (want+prealloc-1)%prealloc;
+    // beyond the end of the file, which keeps its size until written
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, want)==0)
+        allocated += want;
+    else
+        allocating = false; // not supported here, or full, which write() reports
+#else
+    allocating = false;
+#endif
+}
+
+void bufferedfile::submit()
+{
+#ifdef PB_IO_URING
+    if(ok && used) {
+        reserve(used);
+        if(limit)
+            limit->write(used);
+        size_t calls = ring->nsyscalls;
+        double sec = ring->seconds;
+        ring->submit(used);
+        size += used;
+        buf = ring->buffer();
+        nsyscalls += ring->nsyscalls-calls;
+        seconds += ring->seconds-sec;
+        ringerror();
+    }
+#endif
+    used = 0;
+}
+
+void bufferedfile::ringerror()
+{
+#ifdef PB_IO_URING
+    int err = ring->error();
+    if(err && ok) {
+        ok = false;
+        std::cerr<<"ERROR: write "<<name<<": "<<strerror(err)<<"\n";
+    }
+#endif
+}
+
+void bufferedfile::write(const char *data, size_t len)
+{
+    nbytes += len;
+    if(len <= bufsize-used) {
+        memcpy(buf+used, data, len);
+        used += len;
+        return;
+    }
+
+    if(ring) {
+        // Doesn't fit.  Fill and submit buffers until it does.
+        while(len) {
+            size_t n = std::min(len, bufsize-used);
+            memcpy(buf+used, data, n);
+            used += n;
+            data += n;
+            len -= n;
+            if(used==bufsize)
+                submit();
+        }
+        return;
+    }
+
+    // Doesn't fit.  Write out the buffer and the new data together.
+    iovec io[2];
+    io[0].iov_base = buf;
+    io[0].iov_len = used;
+    io[1].iov_base = (void*)data;
+    io[1].iov_len = len;
+    size_t total = used+len;
+    used = 0;
+    if(ok)
+        reserve(total);
+
+    iovec *cur = io;
+    int ncur = 2;
+    // bytes are taken once, and a call for each retry
+    size_t charge = total;
+    while(ok && total) {
+        if(limit) {
+            limit->write(charge);
+            charge = 0;
+        }
+        double start = monotonicSeconds();
+        ssize_t ret = ::writev(fd, cur, ncur);
+        seconds += monotonicSeconds()-start;
+        nsyscalls++;
+        if(ret<0) {
+            if(errno==EINTR)
+                continue;
+            ok = false;
+            std::cerr<<"ERROR: write "<<name<<": "<<strerror(errno)<<"\n";
+            break;
+        }
+        total -= ret;
+        size += ret;
+        // skip over what was written
+        while(ncur && (size_t)ret>=cur->iov_len) {
+            ret -= cur->iov_len;
+            cur++;
+            ncur--;
+        }
+        if(ncur) {
+            cur->iov_base = (char*)cur->iov_base + ret;
+            cur->iov_len -= ret;
+        }
+    }
+}
+
+void bufferedfile::writeout(const char *data, size_t len)
+{
+    if(ok)
+        reserve(len);
+    size_t charge = len;
+    while(ok && len) {
+        if(limit) {
+            limit->write(charge);
+            charge = 0;
+        }
+        double start = monotonicSeconds();
+        ssize_t ret = ::write(fd, data, len);
+        seconds += monotonicSeconds()-start;
+        nsyscalls++;
+        if(ret<0) {
+            if(errno==EINTR)
+                continue;
+            ok = false;
+            std::cerr<<"ERROR: write "<<name<<": "<<strerror(errno)<<"\n";
+            break;
+        }
+        data += ret;
+        len -= ret;
+        size += ret;
+    }
+}
+
+void bufferedfile::flush()
+{
+#ifdef PB_IO_URING
+    if(ring) {
+        submit();
+        size_t calls = ring->nsyscalls;
+        double sec = ring->seconds;
+        ring->drain();
+        nsyscalls += ring->nsyscalls-calls;
+        seconds += ring->seconds-sec;
+        ringerror();
+        return;
+    }
+#endif
+    writeout(buf, used);
+    used = 0;
+}
+
+void bufferedfile::close()
+{
+    if(fd==-1)
+        return;
+    flush();
+    // release what was preallocated beyond the end
+    if(ok && allocated>size && ftruncate(fd, size)!=0)
+        std::cerr<<"WARN: truncate "<<name<<": "<<strerror(errno)<<"\n";
+    allocated = 0;
+    if(durable && ok && fdatasync(fd)!=0) {
+        ok = false;
+        std::cerr<<"ERROR: sync "<<name<<": "<<strerror(errno)<<"\n";
+    }
+    if(::close(fd)!=0 && ok) {
+        ok = false;
+        std::cerr<<"ERROR: close "<<name<<": "<<strerror(errno)<<"\n";
+    }
+    fd = -1;
 }
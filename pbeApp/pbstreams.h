@@ -1,9 +1,22 @@
+#ifndef PBSTREAMS_H
+#define PBSTREAMS_H
 
 #include <ostream>
+#include <string>
 #include <vector>
 
+#include <sys/types.h>
+
 #include <google/protobuf/io/zero_copy_stream.h>
 
+class uringwriter;
+class Throttle;
+
+/* Output stream for CodedOutputStream which applies the PlainPB escaping.
+ * Each chunk handed out by Next() is escaped into outbuf as soon as the
+ * serializer moves on to the next, so inbuf only ever holds one chunk.
+ * After finalize(), outbuf holds the complete escaped line w/ EOL.
+ */
 struct escapingarraystream : public google::protobuf::io::ZeroCopyOutputStream
 {
     typedef google::protobuf::int64 int64;
@@ -17,11 +30,105 @@ struct escapingarraystream : public google::protobuf::io::ZeroCopyOutputStream
     virtual void BackUp(int count);
     virtual int64 ByteCount() const;
 
+    // Size hint for the next message, ie. from Message::ByteSize()
+    void reserve(size_t len) { hint = len; }
+
+    // append the escaped form of the input to outbuf
+    void escape(const char *in, size_t len);
+
     void finalize();
     void reset()
     {
         inbuf.clear();
         outbuf.clear();
         pos = 0;
+        hint = 0;
+        chunk = 0;
+        flushed = 0;
+        sealed = false;
     }
+private:
+    void flush();
+
+    size_t hint, chunk;
+    // # of bytes of the current message already escaped into outbuf
+    size_t flushed;
+    // outbuf holds a finalize()'d message
+    bool sealed;
 };
+
+/* Append-only output file with a large, reusable write buffer.
+ * write() only copies into the buffer.  The file is written with
+ * write()/writev() when the buffer is full, and on flush() or close().
+ *
+ * With a 'ringdepth', and when built with USE_IO_URING, a full buffer is
+ * instead handed to an io_uring (see uringwriter), and the next of that many
+ * buffers is filled while it is written.  Where the ring can't be set up,
+ * as when io_uring is disabled by the kernel, write()/writev() are used.
+ *
+ * With preallocate(), disk space is reserved with fallocate() ahead of the
+ * writes, and what is left over is released on close().
+ *
+ * With syncOnClose(), close() waits until the file is on disk, and reports
+ * an error if it can't be.
+ */
+struct bufferedfile
+{
+    explicit bufferedfile(size_t bufsize, unsigned ringdepth=0);
+    ~bufferedfile();
+
+    // Whether io_uring support is built in
+    static bool haveRing();
+    // Whether this file is written through an io_uring
+    bool ringing() const { return ring!=0; }
+    // Reserve space in steps of 'step' bytes, from the next open(). 0 for none.
+    void preallocate(size_t step) { prealloc = step; }
+    // Wait for 'T' before each write, or NULL to write at once
+    void throttle(Throttle *T) { limit = T; }
+    // fdatasync() on close(), so that what was written is on disk after
+    void syncOnClose(bool s) { durable = s; }
+
+    // Open for append, creating if necessary
+    void open(const char *fname);
+    // Take ownership of 'fd', already open for append.
+    // -1 reports a failed open, from errno.
+    void open(int fd, const char *fname);
+    bool is_open() const { return fd!=-1; }
+    void write(const char *data, size_t len);
+    void flush();
+    void close();
+    // false after any error until the next open()
+    bool good() const { return ok; }
+
+    // bytes passed to write() and the number of syscalls used to write them,
+    // or with a ring, the calls to io_uring_enter()
+    size_t nbytes, nsyscalls;
+    // time spent in those syscalls
+    double seconds;
+
+private:
+    bufferedfile(const bufferedfile&);
+    bufferedfile& operator=(const bufferedfile&);
+
+    void writeout(const char *data, size_t len);
+    // fallocate() so that 'len' more bytes can be written
+    void reserve(size_t len);
+    // Hand the buffer to the ring, and take the next
+    void submit();
+    void ringerror();
+
+    int fd;
+    bool ok;
+    char *buf;
+    size_t bufsize, used;
+    std::string name;
+    // Size of the file, and up to where it is allocated, with preallocation or a ring
+    off_t size, allocated;
+    size_t prealloc;
+    bool allocating; // preallocate for this file, until fallocate() fails
+    uringwriter *ring;
+    Throttle *limit;
+    bool durable;
+};
+
+#endif // PBSTREAMS_H
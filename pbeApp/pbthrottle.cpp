@@ -0,0 +1,223 @@
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <epicsThread.h>
+#include <epicsGuard.h>
+
+#include "pbthrottle.h"
+#include "pbstats.h"
+
+typedef epicsGuard<epicsMutex> Guard;
+
+// Marks an initialized shared file, and its layout
+static const unsigned stateMagic = 0x70627431; // "pbt1"
+
+Throttle::Throttle(const ThrottleLimits& limits)
+    :state(&local)
+    ,sharedfd(-1)
+    ,ctlmtime(0)
+    ,ctlchecked(0.0)
+    ,totalwait(0.0)
+{
+    init(local, limits);
+}
+
+Throttle::~Throttle()
+{
+    if(state!=&local)
+        munmap(state, sizeof(State));
+    if(sharedfd!=-1)
+        close(sharedfd);
+}
+
+void Throttle::init(State& S, const ThrottleLimits& limits)
+{
+    double now = monotonicSeconds();
+    S.magic = stateMagic;
+    S.limits = limits;
+    // start with a full second of tokens
+    S.read.tokens = limits.readbytes;
+    S.write.tokens = limits.writebytes;
+    S.ops.tokens = limits.writeops;
+    S.read.stamp = S.write.stamp = S.ops.stamp = now;
+}
+
+void Throttle::share(const char *fname)
+{
+    Guard G(lock);
+    int fd = open(fname, O_RDWR|O_CREAT, 0644);
+    if(fd==-1)
+        throw std::runtime_error(std::string("open ")+fname+": "+strerror(errno));
+    if(flock(fd, LOCK_EX)!=0 || ftruncate(fd, sizeof(State))!=0) {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error(std::string("lock ")+fname+": "+strerror(err));
+    }
+    // grows a new file with zeros, so no magic
+    void *mem = mmap(0, sizeof(State), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem==MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error(std::string("mmap ")+fname+": "+strerror(err));
+    }
+    State *S = (State*)mem;
+    if(S->magic!=stateMagic)
+        init(*S, local.limits);
+    else
+        S->limits = local.limits; // the buckets carry on
+    flock(fd, LOCK_UN);
+
+    sharedfd = fd;
+    state = S;
+}
+
+void Throttle::control(const char *fname)
+{
+    Guard G(lock);
+    ctlname = fname;
+    ctlmtime = 0;
+    ctlchecked = monotonicSeconds();
+    readControl();
+}
+
+bool Throttle::reload()
+{
+    Guard G(lock);
+    ctlchecked = monotonicSeconds();
+    return readControl();
+}
+
+bool Throttle::readControl()
+{
+    struct stat info;
+    if(ctlname.empty() || stat(ctlname.c_str(), &info)!=0 || info.st_mtime==ctlmtime)
+        return false;
+    ctlmtime = info.st_mtime;
+
+    std::ifstream F(ctlname.c_str());
+    ThrottleLimits limits;
+    std::string line;
+    while(std::getline(F, line)) {
+        std::istringstream strm(line);
+        std::string name;
+        double val;
+        if(!(strm>>name) || name[0]=='#')
+            continue;
+        if(!(strm>>val) || val<0.0) {
+            std::cerr<<"WARN: "<<ctlname<<": Invalid line '"<<line<<"', limits unchanged\n";
+            return false;
+        }
+        if(name=="readkB")
+            limits.readbytes = val*1024.0;
+        else if(name=="writekB")
+            limits.writebytes = val*1024.0;
+        else if(name=="writeops")
+            limits.writeops = val;
+        else
+            std::cerr<<"WARN: "<<ctlname<<": Unknown limit '"<<name<<"'\n";
+    }
+    if(F.bad())
+        return false;
+
+    local.limits = limits;
+    lockShared();
+    state->limits = limits;
+    unlockShared();
+    std::cerr<<"Throttle readkB "<<limits.readbytes/1024.0<<" writekB "<<limits.writebytes/1024.0
+             <<" writeops "<<limits.writeops<<"\n";
+    return true;
+}
+
+void Throttle::lockShared()
+{
+    if(sharedfd!=-1)
+        while(flock(sharedfd, LOCK_EX)!=0 && errno==EINTR) {}
+}
+
+void Throttle::unlockShared()
+{
+    if(sharedfd!=-1)
+        flock(sharedfd, LOCK_UN);
+}
+
+ThrottleLimits Throttle::limits()
+{
+    Guard G(lock);
+    lockShared();
+    ThrottleLimits ret(state->limits);
+    unlockShared();
+    return ret;
+}
+
+double Throttle::take(Bucket& B, double rate, double n, double now)
+{
+    if(rate<=0.0)
+        return 0.0;
+    if(now>B.stamp)
+        B.tokens = std::min(rate, B.tokens + (now-B.stamp)*rate);
+    B.stamp = now;
+    B.tokens -= n;
+    return B.tokens<0.0 ? -B.tokens/rate : 0.0;
+}
+
+void Throttle::read(size_t bytes)
+{
+    double delay;
+    {
+        Guard G(lock);
+        double now = monotonicSeconds();
+        if(now-ctlchecked>=1.0) {
+            ctlchecked = now;
+            readControl();
+        }
+        lockShared();
+        delay = take(state->read, state->limits.readbytes, bytes, now);
+        unlockShared();
+    }
+    sleep(delay);
+}
+
+void Throttle::write(size_t bytes)
+{
+    double delay;
+    {
+        Guard G(lock);
+        double now = monotonicSeconds();
+        if(now-ctlchecked>=1.0) {
+            ctlchecked = now;
+            readControl();
+        }
+        lockShared();
+        delay = std::max(take(state->write, state->limits.writebytes, bytes, now),
+                         take(state->ops, state->limits.writeops, 1.0, now));
+        unlockShared();
+    }
+    sleep(delay);
+}
+
+void Throttle::sleep(double delay)
+{
+    if(delay<=0.0)
+        return;
+    epicsThreadSleep(delay);
+    Guard G(lock);
+    totalwait += delay;
+}
+
+double Throttle::waited()
+{
+    Guard G(lock);
+    return totalwait;
+}
@@ -0,0 +1,141 @@
+#ifndef PBTHROTTLE_H
+#define PBTHROTTLE_H
+
+#include <time.h>
+
+#include <string>
+
+#include <epicsMutex.h>
+// Storage
+#include <DataReader.h>
+
+// Rates per second, 0 for no limit
+struct ThrottleLimits
+{
+    double readbytes;  // of samples read
+    double writebytes; // of output written
+    double writeops;   // write calls
+    ThrottleLimits() :readbytes(0.0), writebytes(0.0), writeops(0.0) {}
+    bool any() const { return readbytes>0.0 || writebytes>0.0 || writeops>0.0; }
+};
+
+/* Token buckets limiting the rate at which samples are read, and at which
+ * output is written, so that an export leaves enough I/O for an ArchiveEngine
+ * running on the same host.  One is shared by every reader and writer of a
+ * process, and through a file, by every process given that file.
+ *
+ * A caller takes what it is about to use, which may leave a bucket in debt,
+ * then sleeps until the debt is repaid.  So callers wait in proportion to
+ * what they use, and a bucket holds at most one second of tokens.
+ *
+ * The limits may be changed while running with a control file, which is
+ * checked for changes every second.  Each line is "<name> <value>", where
+ * name is one of "readkB", "writekB" or "writeops".  Those not given are
+ * not limited.  With a shared file, the limits of the last process to start,
+ * or to read its control file, apply to all.
+ */
+class Throttle
+{
+public:
+    explicit Throttle(const ThrottleLimits& limits);
+    ~Throttle();
+
+    // Keep the buckets and limits in this file, shared by the processes using it.
+    // Throws std::runtime_error
+    void share(const char *fname);
+    // Take the limits from this file, now and when it changes
+    void control(const char *fname);
+    // Read the control file again if it has changed.  Returns true if it was read.
+    bool reload();
+
+    ThrottleLimits limits();
+
+    // Wait until 'bytes' of samples may be read
+    void read(size_t bytes);
+    // Wait until one call writing 'bytes' may be made.
+    // 0 for a retry, after a short write, of bytes already taken.
+    void write(size_t bytes);
+
+    // Seconds spent waiting, by all callers in this process
+    double waited();
+
+private:
+    Throttle(const Throttle&);
+    Throttle& operator=(const Throttle&);
+
+    struct Bucket {
+        double tokens, stamp;
+    };
+    // In the shared file, if any
+    struct State {
+        unsigned magic;
+        ThrottleLimits limits;
+        Bucket read, write, ops;
+    };
+
+    void init(State& S, const ThrottleLimits& limits);
+    // Take 'n' tokens.  Returns the seconds until the bucket is out of debt.
+    static double take(Bucket& B, double rate, double n, double now);
+    // Called with the lock held
+    bool readControl();
+    void lockShared();
+    void unlockShared();
+    void sleep(double delay);
+
+    epicsMutex lock;
+    State local;
+    State *state;      // &local, or mapped from sharedfd
+    int sharedfd;
+    std::string ctlname;
+    time_t ctlmtime;
+    double ctlchecked; // monotonicSeconds() of the last check
+    double totalwait;
+};
+
+/* Passes the samples of a reader through, taking the size of each from a
+ * Throttle.  Sizes are taken 'batch' bytes at a time, so that the Throttle
+ * is not locked for every sample.
+ */
+class ThrottledReader : public DataReader
+{
+    DataReader& reader;
+    Throttle& throttle;
+    size_t pending;
+    enum {batch=64*1024};
+
+    const RawValue::Data *count(const RawValue::Data *samp)
+    {
+        if(samp) {
+            pending += RawValue::getSize(reader.getType(), reader.getCount());
+            if(pending>=batch) {
+                throttle.read(pending);
+                pending = 0;
+            }
+        }
+        return samp;
+    }
+public:
+    ThrottledReader(DataReader& reader, Throttle& throttle)
+        :reader(reader), throttle(throttle), pending(0)
+    {
+        channel_name = reader.channel_name;
+    }
+    virtual ~ThrottledReader() {}
+
+    virtual const RawValue::Data *find(const stdString &channel_name,
+                                       const epicsTime *start)
+    {
+        const RawValue::Data *ret = reader.find(channel_name, start);
+        this->channel_name = reader.channel_name;
+        return count(ret);
+    }
+    virtual const RawValue::Data *next() { return count(reader.next()); }
+    virtual const RawValue::Data *get() const { return reader.get(); }
+    virtual DbrType getType() const { return reader.getType(); }
+    virtual DbrCount getCount() const { return reader.getCount(); }
+    virtual const CtrlInfo &getInfo() const { return reader.getInfo(); }
+    virtual bool changedType() { return reader.changedType(); }
+    virtual bool changedInfo() { return reader.changedInfo(); }
+};
+
+#endif // PBTHROTTLE_H
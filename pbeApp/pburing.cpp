@@ -0,0 +1,234 @@
+
+#ifdef PB_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "pburing.h"
+#include "pbstats.h"
+
+// The ring is shared with the kernel
+#define LOAD_ACQUIRE(P) __atomic_load_n(P, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(P, V) __atomic_store_n(P, V, __ATOMIC_RELEASE)
+
+static void *ringPtr(void *base, unsigned offset)
+{
+    return (char*)base + offset;
+}
+
+uringwriter::uringwriter(size_t bufsize, unsigned depth)
+    :nsyscalls(0)
+    ,seconds(0.0)
+    ,bufsize(bufsize)
+    ,bufs(depth ? depth : 1)
+    ,cur(0)
+    ,fixed(false)
+    ,ringfd(-1)
+    ,fd(-1)
+    ,offset(0)
+    ,inflight(0)
+    ,queued(0)
+    ,err(0)
+    ,sqring(MAP_FAILED)
+    ,cqring(MAP_FAILED)
+    ,sqsize(0)
+    ,cqsize(0)
+    ,sqes((io_uring_sqe*)MAP_FAILED)
+    ,sqesize(0)
+{
+    try {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        // each buffer has at most one write in flight
+        ringfd = syscall(__NR_io_uring_setup, unsigned(bufs.size()), &params);
+        if(ringfd<0)
+            throw std::runtime_error(std::string("io_uring_setup: ")+strerror(errno));
+
+        sqsize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        cqsize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+        if(params.features & IORING_FEAT_SINGLE_MMAP)
+            sqsize = cqsize = std::max(sqsize, cqsize);
+        sqring = mmap(0, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                      ringfd, IORING_OFF_SQ_RING);
+        if(sqring==MAP_FAILED)
+            throw std::runtime_error(std::string("mmap io_uring: ")+strerror(errno));
+        if(params.features & IORING_FEAT_SINGLE_MMAP) {
+            cqring = sqring;
+        } else {
+            cqring = mmap(0, cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                          ringfd, IORING_OFF_CQ_RING);
+            if(cqring==MAP_FAILED)
+                throw std::runtime_error(std::string("mmap io_uring: ")+strerror(errno));
+        }
+        sqesize = params.sq_entries*sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(0, sqesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                                   ringfd, IORING_OFF_SQES);
+        if(sqes==MAP_FAILED)
+            throw std::runtime_error(std::string("mmap io_uring: ")+strerror(errno));
+
+        sq_tail = (unsigned*)ringPtr(sqring, params.sq_off.tail);
+        sq_mask = (unsigned*)ringPtr(sqring, params.sq_off.ring_mask);
+        sq_array = (unsigned*)ringPtr(sqring, params.sq_off.array);
+        cq_head = (unsigned*)ringPtr(cqring, params.cq_off.head);
+        cq_tail = (unsigned*)ringPtr(cqring, params.cq_off.tail);
+        cq_mask = (unsigned*)ringPtr(cqring, params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)ringPtr(cqring, params.cq_off.cqes);
+
+        std::vector<iovec> iov(bufs.size());
+        for(size_t i=0; i<bufs.size(); i++) {
+            void *mem;
+            if(posix_memalign(&mem, 4096, bufsize))
+                throw std::bad_alloc();
+            bufs[i].data = (char*)mem;
+            iov[i].iov_base = mem;
+            iov[i].iov_len = bufsize;
+        }
+        // Registration pins the buffers, and may exceed RLIMIT_MEMLOCK.
+        // Unregistered buffers work as well, with a copy of each.
+        fixed = syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_BUFFERS,
+                        &iov[0], unsigned(iov.size()))==0;
+    } catch(...) {
+        cleanup();
+        throw;
+    }
+}
+
+uringwriter::~uringwriter()
+{
+    if(inflight)
+        drain();
+    cleanup();
+}
+
+void uringwriter::cleanup()
+{
+    if(sqes!=MAP_FAILED)
+        munmap(sqes, sqesize);
+    if(cqring!=MAP_FAILED && cqring!=sqring)
+        munmap(cqring, cqsize);
+    if(sqring!=MAP_FAILED)
+        munmap(sqring, sqsize);
+    if(ringfd>=0)
+        close(ringfd);
+    for(size_t i=0; i<bufs.size(); i++)
+        free(bufs[i].data);
+}
+
+void uringwriter::open(int fd, off_t offset)
+{
+    this->fd = fd;
+    this->offset = offset;
+}
+
+char *uringwriter::buffer()
+{
+    cur = (cur+1)%bufs.size();
+    reap();
+    while(bufs[cur].busy)
+        enter(1);
+    return bufs[cur].data;
+}
+
+void uringwriter::submit(size_t len)
+{
+    Buf& B = bufs[cur];
+    B.len = len;
+    B.done = 0;
+    B.offset = offset;
+    B.busy = true;
+    offset += len;
+    inflight++;
+    queue(cur);
+    enter(0);
+}
+
+void uringwriter::drain()
+{
+    reap();
+    while(inflight)
+        enter(1);
+}
+
+int uringwriter::error()
+{
+    int ret = err;
+    err = 0;
+    return ret;
+}
+
+void uringwriter::queue(unsigned i)
+{
+    Buf& B = bufs[i];
+    unsigned tail = *sq_tail, idx = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->off = B.offset + B.done;
+    sqe->addr = (unsigned long)(B.data + B.done);
+    sqe->len = B.len - B.done;
+    if(fixed)
+        sqe->buf_index = i;
+    sqe->user_data = i;
+    sq_array[idx] = idx;
+    STORE_RELEASE(sq_tail, tail+1);
+    queued++;
+}
+
+void uringwriter::enter(unsigned wait)
+{
+    double start = monotonicSeconds();
+    int ret = syscall(__NR_io_uring_enter, ringfd, queued, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, (void*)0, 0);
+    seconds += monotonicSeconds()-start;
+    nsyscalls++;
+    if(ret>=0) {
+        queued -= ret<int(queued) ? ret : queued;
+    } else if(errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
+        // can't be retried, so abandon everything in flight
+        if(!err)
+            err = errno;
+        for(size_t i=0; i<bufs.size(); i++)
+            bufs[i].busy = false;
+        inflight = queued = 0;
+        return;
+    }
+    reap();
+}
+
+void uringwriter::reap()
+{
+    unsigned head = *cq_head, tail = LOAD_ACQUIRE(cq_tail);
+    for(; head!=tail; head++) {
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        Buf& B = bufs[cqe.user_data];
+        if(cqe.res==-EINTR || cqe.res==-EAGAIN) {
+            queue(cqe.user_data);
+            continue;
+        }
+        if(cqe.res<0 || cqe.res==0) {
+            if(!err)
+                err = cqe.res ? -cqe.res : EIO;
+        } else if(B.done+cqe.res<B.len) {
+            // short write, continue with the rest
+            B.done += cqe.res;
+            queue(cqe.user_data);
+            continue;
+        }
+        B.busy = false;
+        inflight--;
+    }
+    STORE_RELEASE(cq_head, head);
+}
+
+#endif // PB_IO_URING
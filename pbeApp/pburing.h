@@ -0,0 +1,84 @@
+#ifndef PBURING_H
+#define PBURING_H
+
+#ifdef PB_IO_URING
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <vector>
+
+/* Writes the buffers of a bufferedfile through an io_uring (Linux >= 5.1),
+ * so that the encoder only waits for the disk when all buffers are in flight.
+ *
+ * 'depth' buffers of 'bufsize' are registered with the ring, and filled in
+ * turn.  Each filled buffer is submitted as a write at an explicit offset,
+ * so several may be in flight at once without reordering, and a short write
+ * is continued from where it stopped.
+ * Uses the kernel interface directly, so does not need liburing.
+ */
+class uringwriter
+{
+public:
+    // Throws std::runtime_error if the ring can't be set up
+    uringwriter(size_t bufsize, unsigned depth);
+    ~uringwriter();
+
+    // Following writes go to 'fd', from 'offset' on.  Nothing may be in flight.
+    void open(int fd, off_t offset);
+    // The next buffer to fill, of bufsize, after waiting for it to be written
+    char *buffer();
+    // Write the first 'len' bytes of the last buffer()
+    void submit(size_t len);
+    // Wait until everything submitted is written
+    void drain();
+    // The errno of the first write to fail since the last call, or 0
+    int error();
+
+    // calls to io_uring_enter(), and the time spent in them
+    size_t nsyscalls;
+    double seconds;
+
+private:
+    uringwriter(const uringwriter&);
+    uringwriter& operator=(const uringwriter&);
+
+    struct Buf {
+        char *data;
+        size_t len, done;
+        off_t offset;
+        bool busy;
+        Buf() :data(0), len(0), done(0), offset(0), busy(false) {}
+    };
+
+    void cleanup();
+    // Queue the rest of a buffer.  Doesn't enter the kernel.
+    void queue(unsigned i);
+    // io_uring_enter(), to submit what is queued and/or wait for 'wait' completions
+    void enter(unsigned wait);
+    // Handle the completions which are ready
+    void reap();
+
+    const size_t bufsize;
+    std::vector<Buf> bufs;
+    unsigned cur;      // index of the last buffer()
+    bool fixed;        // buffers are registered
+    int ringfd;
+    int fd;
+    off_t offset;
+    unsigned inflight, queued;
+    int err;
+
+    // the mapped rings
+    void *sqring, *cqring;
+    size_t sqsize, cqsize;
+    struct io_uring_sqe *sqes;
+    size_t sqesize;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+#endif // PB_IO_URING
+
+#endif // PBURING_H
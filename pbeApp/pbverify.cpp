@@ -0,0 +1,645 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+// Base
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsThread.h>
+// Tools
+#include <AutoPtr.h>
+#include <ArgParser.h>
+// Storage
+#include <AutoIndex.h>
+
+#include <google/protobuf/stubs/common.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "pbencode.h"
+#include "pbfile.h"
+#include "pbeutil.h"
+#include "pblocked.h"
+#include "pbreadahead.h"
+#include "pbstats.h"
+#include "EPICSEvent.pb.h"
+
+/* Verify exported .pb files against the index they were exported from.
+ *
+ * Each sample read from the index is compared with the next sample line of
+ * the file PBWriter would have written it to.  As in PBWriter, the file
+ * changes with the partition (the year by default) and with the type of the
+ * samples, disconnected samples are not written, and the first sample after
+ * them notes the disconnection in its fieldvalues.
+ *
+ * A sample matches when its line, unescaped, starts with the bytes
+ * sampleencoder<> gives for the source sample, and the rest are fieldvalues.
+ * Of those, only the ones noting a disconnection are compared, as the
+ * metadata written depends on -heartbeat.  A sample with a repeatcount
+ * (from pbexport -collapse) also stands for that many following samples,
+ * which must have the same value, severity and status.
+ *
+ * Files are mapped and read in order.  Comparing is done in parallel, but
+ * as in pbexport, reading the index is serialized by storageLock.
+ */
+
+namespace {
+
+using google::protobuf::internal::WireFormatLite;
+
+// Mismatches printed for each PV, after which they are only counted
+const unsigned long maxShown = 10;
+
+// Fields which note a disconnection
+const char * const cnxnames[] = {"cnxlostepsecs", "cnxregainedepsecs", "startup", "resume"};
+
+const std::string nofields;
+
+/* How the samples of a type are written
+ *  encode() - the sample, without fieldvalues
+ *  differs() - which part of an encoded sample differs from another
+ */
+struct Codec
+{
+    DbrType dbr;
+    bool isarray;
+    int pbcode;
+    // returns the offset of the value, after the time
+    size_t (*encode)(std::string& out, const RawValue::Data *samp, DbrCount count, epicsUInt32 secintoyear);
+    const char *(*differs)(const std::string& expect, const char *actual, size_t len);
+};
+
+template<int dbr, int isarray>
+size_t encodeSample(std::string& out, const RawValue::Data *samp, DbrCount count, epicsUInt32 secintoyear)
+{
+    typedef const typename dbrstruct<dbr,isarray>::dbrtype sample_t;
+    pbwire::sampleencoder<dbr,isarray> enc((sample_t*)samp, count, secintoyear, nofields);
+    out.resize(enc.size());
+    enc.encode(&out[0]);
+    return enc.valueOffset();
+}
+
+template<int dbr, int isarray>
+const char *differs(const std::string& expect, const char *actual, size_t len)
+{
+    typename dbrstruct<dbr,isarray>::pbtype E, A;
+    if(!A.ParseFromArray(actual, len))
+        return "encoding";
+    E.ParseFromString(expect);
+    if(E.secondsintoyear()!=A.secondsintoyear() || E.nano()!=A.nano())
+        return "time";
+    if(E.severity()!=A.severity())
+        return "severity";
+    if(E.status()!=A.status())
+        return "status";
+    return "value";
+}
+
+const Codec *findCodec(DbrType dbr, bool isarray)
+{
+#define CODEC(DBR, ARR) {DBR, ARR, dbrstruct<DBR, ARR>::pbcode, &encodeSample<DBR, ARR>, &differs<DBR, ARR>}
+    static const Codec codecs[] = {
+        CODEC(DBR_TIME_STRING, 0),
+        CODEC(DBR_TIME_CHAR, 0),
+        CODEC(DBR_TIME_SHORT, 0),
+        CODEC(DBR_TIME_ENUM, 0),
+        CODEC(DBR_TIME_LONG, 0),
+        CODEC(DBR_TIME_FLOAT, 0),
+        CODEC(DBR_TIME_DOUBLE, 0),
+        CODEC(DBR_TIME_STRING, 1),
+        CODEC(DBR_TIME_CHAR, 1),
+        CODEC(DBR_TIME_SHORT, 1),
+        CODEC(DBR_TIME_ENUM, 1),
+        CODEC(DBR_TIME_LONG, 1),
+        CODEC(DBR_TIME_FLOAT, 1),
+        CODEC(DBR_TIME_DOUBLE, 1),
+    };
+#undef CODEC
+    for(size_t i=0; i<sizeof(codecs)/sizeof(codecs[0]); i++)
+        if(codecs[i].dbr==dbr && codecs[i].isarray==isarray)
+            return &codecs[i];
+    return 0;
+}
+
+// Parse a block of encoded fieldvalues.  Returns false if there is anything else.
+bool parseFields(const char *buf, size_t len, std::vector<EPICS::FieldValue>& fields)
+{
+    google::protobuf::io::CodedInputStream strm((const google::protobuf::uint8*)buf, len);
+    fields.clear();
+    google::protobuf::uint32 tag;
+    while((tag = strm.ReadTag())!=0) {
+        google::protobuf::uint32 flen;
+        std::string encoded;
+        if(tag!=WireFormatLite::MakeTag(7, WireFormatLite::WIRETYPE_LENGTH_DELIMITED)
+                || !strm.ReadVarint32(&flen) || !strm.ReadString(&encoded, flen))
+            return false;
+        fields.push_back(EPICS::FieldValue());
+        if(!fields.back().ParseFromString(encoded))
+            return false;
+    }
+    return strm.ConsumedEntireMessage();
+}
+
+// FNV-1a, of the sample lines read from the output files
+struct Checksum
+{
+    pbwire::uint64 val;
+    Checksum() :val(14695981039346656037ull) {}
+    void add(const char *p, size_t n)
+    {
+        for(; n; n--, p++) {
+            val ^= epicsUInt8(*p);
+            val *= 1099511628211ull;
+        }
+    }
+};
+
+enum VerifyResult {
+    VerifyOk,
+    VerifyMismatch,
+    VerifyNoData,
+    VerifyFailed
+};
+
+const char *resultName(VerifyResult result)
+{
+    switch(result) {
+    case VerifyOk: return "ok";
+    case VerifyMismatch: return "mismatch";
+    case VerifyNoData: return "nodata";
+    case VerifyFailed: return "failed";
+    }
+    return "?";
+}
+
+// Follows the samples of one PV through the files they were written to
+class PVVerifier
+{
+public:
+    unsigned long nsamples;   // expected in the output
+    unsigned long nmismatch;
+    Checksum checksum;
+
+    PVVerifier(const stdString& name, Partition partition)
+        :nsamples(0)
+        ,nmismatch(0)
+        ,name(name)
+        ,partition(partition)
+        ,codec(0)
+        ,dtype(0)
+        ,typeChange(0)
+        ,line(0)
+        ,folded(0)
+    {
+        startofyear.secPastEpoch = endofpartition.secPastEpoch = 0;
+        startofyear.nsec = endofpartition.nsec = 0;
+    }
+
+    // Compare all samples from the current one of 'reader' on
+    void verify(DataReader& reader)
+    {
+        std::string cnxfields;
+        char num[24];
+        // as kept by transcode_samples<>()
+        epicsUInt32 disconnected_epoch = 0;
+        int prev_severity = 0;
+
+        for(const RawValue::Data *samp = reader.get(); samp; samp = reader.next()) {
+            if(!codec || reader.getType()!=dtype) {
+                if(codec)
+                    typeChange++;
+                startFile(reader, samp);
+            } else if(samp->stamp.secPastEpoch>=endofpartition.secPastEpoch) {
+                typeChange = 0;
+                startFile(reader, samp);
+            }
+
+            int sevr = samp->severity;
+            cnxfields.clear();
+            if(isDisconnected(sevr)) {
+                if(disconnected_epoch==0)
+                    disconnected_epoch = samp->stamp.secPastEpoch;
+                if((sevr==3872 || sevr==3848) && prev_severity<4)
+                    prev_severity = sevr;
+                continue;
+            } else if(sevr<=3 && disconnected_epoch!=0) {
+                pbwire::appendFieldValue(cnxfields, "cnxlostepsecs", num,
+                                         formatDecimal(num, disconnected_epoch + POSIX_TIME_AT_EPICS_EPOCH));
+                pbwire::appendFieldValue(cnxfields, "cnxregainedepsecs", num,
+                                         formatDecimal(num, samp->stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH));
+                if(prev_severity==3872)
+                    pbwire::appendFieldValue(cnxfields, "startup", "true");
+                else if(prev_severity==3848)
+                    pbwire::appendFieldValue(cnxfields, "resume", "true");
+                prev_severity = sevr;
+                disconnected_epoch = 0;
+            }
+            check(samp, reader.getCount(), cnxfields);
+        }
+        closeFile();
+    }
+
+private:
+    const stdString name;
+    const Partition partition;
+    const Codec *codec;
+    DbrType dtype;
+    int typeChange;
+    epicsTimeStamp startofyear, endofpartition;
+    AutoPtr<PBFile> file; // NULL if missing
+    std::string fname;
+    const char *line;     // next line of file to compare
+    std::string expect;
+    // samples still to come of the run of the last line, and their value, severity and status
+    epicsUInt32 folded;
+    std::string runbody;
+    std::vector<char> buf;
+    std::vector<EPICS::FieldValue> fields;
+
+    // Count a mismatch, and describe the first few.  'pos' may be NULL.
+    void mismatch(const char *pos, const std::string& msg, const epicsTimeStamp *t=0)
+    {
+        if(++nmismatch>maxShown)
+            return;
+        std::ostringstream strm;
+        strm<<"ERROR: "<<name.c_str()<<": "<<fname;
+        if(pos)
+            strm<<":"<<file->offset(pos);
+        strm<<": "<<msg;
+        if(t) {
+            strm<<" at ";
+            printTime(strm, *t);
+        }
+        if(nmismatch==maxShown)
+            strm<<" (further mismatches not shown)";
+        strm<<"\n";
+        std::cerr<<strm.str();
+    }
+
+    // Step over the current line
+    void consume()
+    {
+        const char *next = file->next(line);
+        checksum.add(line, next-line);
+        line = next;
+    }
+
+    // The file for the new partition or type which starts with 'samp'
+    void startFile(DataReader& reader, const RawValue::Data *samp)
+    {
+        closeFile();
+        dtype = reader.getType();
+        bool isarray = reader.getCount()!=1;
+        codec = findCodec(dtype, isarray);
+        if(!codec) {
+            std::ostringstream msg;
+            msg<<"Unsupported type "<<dtype;
+            throw std::runtime_error(msg.str());
+        }
+
+        int year;
+        getYear(samp->stamp, &year);
+        getStartOfYear(year, &startofyear);
+        epicsTimeStamp startofpartition;
+        std::string partname;
+        getPartition(samp->stamp, partition, &startofpartition, &endofpartition, &partname);
+
+        std::ostringstream fn;
+        fn<<pvpathname(name.c_str())<<":"<<partname<<".pb";
+        if(typeChange)
+            fn<<"."<<typeChange;
+        fname = fn.str();
+
+        try {
+            file = new PBFile(fname);
+        } catch(std::runtime_error& e) {
+            mismatch(0, e.what());
+            return;
+        }
+        file->sequential();
+        line = file->begin();
+
+        const EPICS::PayloadInfo& info = file->header();
+        if(info.type()!=codec->pbcode || info.year()!=year || info.pvname()!=reader.channel_name.c_str())
+            mismatch(0, "Header is "+EPICS::PayloadType_Name(info.type())+" of "+info.pvname());
+        if(file->partial())
+            mismatch(file->end(), "Incomplete last line");
+    }
+
+    // Samples left in the file were not expected
+    void closeFile()
+    {
+        if(folded) {
+            mismatch(0, "repeatcount is more than the samples which follow");
+            folded = 0;
+        }
+        if(!file)
+            return;
+        while(line<file->end()) {
+            epicsTimeStamp t;
+            if(file->time(line, &t))
+                mismatch(line, "Unexpected sample", &t);
+            else
+                mismatch(line, "Undecodable sample");
+            consume();
+        }
+        file = 0;
+    }
+
+    void check(const RawValue::Data *samp, DbrCount count, const std::string& cnxfields)
+    {
+        nsamples++;
+        if(!file) {
+            nmismatch++; // the missing file was reported
+            return;
+        }
+
+        if(folded) {
+            folded--;
+            size_t value = (*codec->encode)(expect, samp, count, samp->stamp.secPastEpoch - startofyear.secPastEpoch);
+            if(!cnxfields.empty())
+                mismatch(0, "Sample noting a disconnection is in a run", &samp->stamp);
+            else if(expect.compare(value, std::string::npos, runbody)!=0)
+                mismatch(0, "Sample in a run differs", &samp->stamp);
+            return;
+        }
+
+        // step over samples before this one, which were not expected
+        epicsTimeStamp t;
+        bool found = false;
+        while(line<file->end()) {
+            if(!file->time(line, &t)) {
+                mismatch(line, "Undecodable sample");
+            } else if(notAfter(samp->stamp, t)) {
+                found = notAfter(t, samp->stamp);
+                break;
+            } else {
+                mismatch(line, "Unexpected sample", &t);
+            }
+            consume();
+        }
+        if(!found) {
+            mismatch(line<file->end() ? line : 0, "Missing sample", &samp->stamp);
+            return;
+        }
+
+        const char *pos = line;
+        if(!file->unescapeLine(line, buf)) {
+            mismatch(pos, "Badly escaped sample", &samp->stamp);
+            consume();
+            return;
+        }
+        consume();
+
+        size_t value = (*codec->encode)(expect, samp, count, samp->stamp.secPastEpoch - startofyear.secPastEpoch);
+        if(buf.size()<expect.size() || memcmp(&buf[0], expect.data(), expect.size())!=0) {
+            mismatch(pos, std::string("Sample ")+(*codec->differs)(expect, buf.empty() ? 0 : &buf[0], buf.size())
+                          +" differs", &samp->stamp);
+            return;
+        }
+
+        const char *rest = &buf[0]+expect.size();
+        size_t restlen = buf.size()-expect.size();
+        if(restlen && *rest==pbwire::tag(6, pbwire::Varint)) {
+            google::protobuf::io::CodedInputStream strm((const google::protobuf::uint8*)rest+1, restlen-1);
+            if(!strm.ReadVarint32(&folded)) {
+                mismatch(pos, "Sample has a bad repeatcount", &samp->stamp);
+                return;
+            }
+            runbody = expect.substr(value);
+            rest += 1+strm.CurrentPosition();
+            restlen -= 1+strm.CurrentPosition();
+        }
+        if(!parseFields(rest, restlen, fields)) {
+            mismatch(pos, "Sample has unexpected fields", &samp->stamp);
+            return;
+        }
+        if(!cnxfields.empty()) {
+            if(restlen<cnxfields.size() || memcmp(rest, cnxfields.data(), cnxfields.size())!=0)
+                mismatch(pos, "Sample does not note the disconnection", &samp->stamp);
+            return;
+        }
+        for(size_t i=0; i<fields.size(); i++) {
+            for(size_t j=0; j<sizeof(cnxnames)/sizeof(cnxnames[0]); j++) {
+                if(fields[i].name()==cnxnames[j]) {
+                    mismatch(pos, "Sample notes a disconnection", &samp->stamp);
+                    return;
+                }
+            }
+        }
+    }
+};
+
+// Totals over all PVs verified by this process
+struct VerifySummary
+{
+    epicsMutex lock;
+    unsigned long nok, nmismatch, nnodata, nfailed;
+    unsigned long nsamples;
+
+    VerifySummary() :nok(0), nmismatch(0), nnodata(0), nfailed(0), nsamples(0) {}
+
+    void add(const stdString& pvname, VerifyResult result, const PVVerifier& V)
+    {
+        char checksum[24];
+        sprintf(checksum, "%016llx", (unsigned long long)V.checksum.val);
+        std::ostringstream strm;
+        strm<<pvname.c_str()<<"\t"<<resultName(result)<<"\t"<<V.nsamples<<"\t"
+            <<V.nmismatch<<"\t"<<checksum<<"\n";
+
+        epicsGuard<epicsMutex> G(lock);
+        switch(result) {
+        case VerifyOk: nok++; break;
+        case VerifyMismatch: nmismatch++; break;
+        case VerifyNoData: nnodata++; break;
+        case VerifyFailed: nfailed++; break;
+        }
+        nsamples += V.nsamples;
+        std::cout<<strm.str()<<std::flush;
+    }
+};
+
+struct VerifyOptions
+{
+    // Samples read ahead by a second thread, 0 to read between comparisons
+    size_t readahead;
+    // As exported
+    Partition partition;
+
+    VerifyOptions() :readahead(0), partition(PartitionYear) {}
+};
+
+VerifyResult verifyPV(Index& idx, const stdString& pvname, const VerifyOptions& opts, PVVerifier& V)
+{
+    try {
+        AutoPtr<DataReader> reader;
+        {
+            epicsGuard<epicsMutex> G(storageLock);
+            reader = new LockedReader(ReaderFactory::create(idx, ReaderFactory::Raw, 0.0));
+        }
+        if(!reader->find(pvname, 0))
+            return VerifyNoData;
+
+        AutoPtr<DataReader> ahead;
+        if(opts.readahead)
+            ahead = new ReadAheadReader(*reader, opts.readahead);
+        V.verify(ahead ? *ahead : *reader);
+        return V.nmismatch ? VerifyMismatch : VerifyOk;
+    } catch(std::exception& e) {
+        std::cerr<<"ERROR: "<<pvname.c_str()<<": "<<e.what()<<"\n";
+        return VerifyFailed;
+    }
+}
+
+// The PVs to verify, taken in order by the workers
+struct PVList
+{
+    epicsMutex lock;
+    std::vector<stdString> names;
+    size_t next;
+
+    PVList() :next(0) {}
+
+    bool pop(stdString& name)
+    {
+        epicsGuard<epicsMutex> G(lock);
+        if(next==names.size())
+            return false;
+        name = names[next++];
+        return true;
+    }
+};
+
+struct VerifyWorker : public epicsThreadRunable
+{
+    Index& idx;
+    PVList& pvs;
+    VerifySummary& summary;
+    const VerifyOptions& opts;
+    epicsThread worker;
+
+    VerifyWorker(Index& idx, PVList& pvs, VerifySummary& summary, const VerifyOptions& opts)
+        :idx(idx)
+        ,pvs(pvs)
+        ,summary(summary)
+        ,opts(opts)
+        ,worker(*this, "pbverify",
+                epicsThreadGetStackSize(epicsThreadStackBig),
+                epicsThreadPriorityMedium)
+    {}
+    virtual ~VerifyWorker() {}
+
+    virtual void run()
+    {
+        stdString name;
+        while(pvs.pop(name)) {
+            PVVerifier V(name, opts.partition);
+            VerifyResult result = verifyPV(idx, name, opts, V);
+            summary.add(name, result, V);
+        }
+    }
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    google::protobuf::LogSilencer *silencer = new google::protobuf::LogSilencer();
+
+    CmdArgParser parser(argc, argv);
+    parser.setArgumentsInfo(" <index file>");
+    parser.setFooter("\nPV names are read from stdin, one per line, as for pbexport.\n"
+                     "Files are found relative to the current directory.\n"
+                     "For each PV, a line is printed to stdout with columns\n"
+                     "  name result samples mismatches checksum\n"
+                     "where result is one of ok, mismatch, nodata, or failed.\n"
+                     "Exits with 1 if any PV is not ok or nodata.\n");
+    CmdArgInt jobs(parser, "jobs", "<N>", "Verify with N worker threads (default 1)");
+    CmdArgFlag allpvs(parser, "all", "Verify every PV in the index instead of reading stdin");
+    CmdArgInt readahead(parser, "readahead", "<N>", "Read up to N samples ahead of comparing in a second thread");
+    CmdArgString partition(parser, "partition", "<span>", "Files were exported with this -partition (default year)");
+
+    if(!parser.parse())
+        return 2;
+    if(parser.getArguments().size()!=1) {
+        parser.usage();
+        return 2;
+    }
+    size_t njobs = jobs>0 ? size_t(jobs) : 1u;
+    VerifyOptions opts;
+    if(readahead>0)
+        opts.readahead = readahead;
+    if(!partition.get().empty() && !parsePartition(partition.get().c_str(), &opts.partition)) {
+        std::cerr<<"ERROR: Invalid -partition '"<<partition.get().c_str()<<"'\n";
+        return 2;
+    }
+
+    try{
+    {
+        char *seps = getenv("NAMESEPS");
+        if(seps)
+            pvseps = seps;
+    }
+    AutoIndex idx;
+    idx.open(parser.getArgument(0));
+
+    PVList pvs;
+    if(allpvs) {
+        Index::NameIterator iter;
+        if(idx.getFirstChannel(iter)) {
+            do {
+                pvs.names.push_back(iter.getName());
+            } while(idx.getNextChannel(iter));
+        }
+    } else {
+        std::string line;
+        while(std::getline(std::cin, line).good()) {
+            // ignore the columns after a name from 'listpvs -cost'
+            line = line.substr(0, line.find('\t'));
+            if(!line.empty())
+                pvs.names.push_back(line.c_str());
+        }
+    }
+
+    std::cerr<<"Verifying "<<pvs.names.size()<<" PVs with "<<njobs<<" workers\n";
+
+    VerifySummary summary;
+    double started = monotonicSeconds();
+    {
+        std::vector<VerifyWorker*> workers(njobs);
+        for(size_t i=0; i<njobs; i++)
+            workers[i] = new VerifyWorker(idx, pvs, summary, opts);
+        for(size_t i=0; i<njobs; i++)
+            workers[i]->worker.start();
+        for(size_t i=0; i<njobs; i++) {
+            workers[i]->worker.exitWait();
+            delete workers[i];
+        }
+    }
+    double elapsed = monotonicSeconds() - started;
+
+    std::cerr<<"PVs: "<<pvs.names.size()
+             <<" ok: "<<summary.nok
+             <<" mismatched: "<<summary.nmismatch
+             <<" no data: "<<summary.nnodata
+             <<" failed: "<<summary.nfailed<<"\n"
+             <<"Samples: "<<summary.nsamples
+             <<" in "<<elapsed<<" sec";
+    if(elapsed>0)
+        std::cerr<<" ("<<(summary.nsamples/elapsed)<<" samples/sec)";
+    std::cerr<<"\n";
+
+    delete silencer;
+    return summary.nmismatch || summary.nfailed ? 1 : 0;
+}catch(std::exception& e){
+    std::cerr<<"Exception: "<<e.what()<<"\n";
+    return 1;
+}
+}
@@ -0,0 +1,497 @@
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+// Tools
+#include <GenericException.h>
+
+#include "pbwriter.h"
+#include "pbencode.h"
+#include "pbeutil.h"
+#include "EPICSEvent.pb.h"
+
+#include <google/protobuf/io/coded_stream.h>
+
+void encodeMetadata(std::string& out, DbrType dbr, bool isarray, const CtrlInfo& info)
+{
+    std::stringstream ss;
+    if (dbr == DBR_TIME_SHORT || dbr == DBR_TIME_INT || dbr == DBR_TIME_LONG || dbr == DBR_TIME_FLOAT
+            || dbr == DBR_TIME_DOUBLE) {
+        ss << info.getDisplayHigh();
+        pbwire::appendFieldValue(out, "HOPR", ss.str());
+        ss.str(""); ss.clear(); ss << info.getDisplayLow();
+        pbwire::appendFieldValue(out, "LOPR", ss.str());
+        ss.str(""); ss.clear(); ss << info.getUnits();
+        pbwire::appendFieldValue(out, "EGU", ss.str());
+        if (!isarray) {
+            ss.str(""); ss.clear(); ss << info.getHighAlarm();
+            pbwire::appendFieldValue(out, "HIHI", ss.str());
+            ss.str(""); ss.clear(); ss << info.getHighWarning();
+            pbwire::appendFieldValue(out, "HIGH", ss.str());
+            ss.str(""); ss.clear(); ss << info.getLowWarning();
+            pbwire::appendFieldValue(out, "LOW", ss.str());
+            ss.str(""); ss.clear(); ss << info.getLowAlarm();
+            pbwire::appendFieldValue(out, "LOLO", ss.str());
+        }
+    }
+    if (dbr == DBR_TIME_FLOAT || dbr == DBR_TIME_DOUBLE) {
+        ss.str(""); ss.clear(); ss << info.getPrecision();
+        pbwire::appendFieldValue(out, "PREC", ss.str());
+    }
+    if (dbr == DBR_TIME_ENUM) {
+        stdString state;
+        if (info.getType() == CtrlInfo::Enumerated) {
+            size_t i, num = info.getNumStates();
+            if (num > 0) {
+                info.getState(0,state);
+                ss <<state.c_str();
+                for (i = 1; i < num; i++) {
+                    info.getState(i,state);
+                    ss << ";" << state.c_str();
+                }
+                pbwire::appendFieldValue(out, "states", ss.str());
+            }
+        }
+    }
+}
+
+// Write the lines completed by a samplerun
+static void writeRun(PBWriter& self, pbwire::samplerun& run, unsigned long& nwrote)
+{
+    std::vector<char>& lines = run.lines();
+    if(!lines.empty()) {
+        self.outpb.write(&lines[0], lines.size());
+        lines.clear();
+    }
+    nwrote += run.nlines;
+    self.nwrote += run.nlines;
+    run.nlines = 0;
+}
+
+template<int dbr, int isarray>
+void transcode_samples(PBWriter& self)
+{
+    typedef const typename dbrstruct<dbr,isarray>::dbrtype sample_t;
+
+    escapingarraystream encbuf;
+    // with ExportOptions::collapse
+    pbwire::samplerun run;
+    // pre-encoded metadata, and the fieldvalues of the current sample
+    std::string metafields, samplefields, newmeta;
+    char num[24];
+
+    epicsUInt32& disconnected_epoch = self.disconnected_epoch;
+    int& prev_severity = self.prev_severity;
+    unsigned long nwrote=0;
+    // one in StageStats::sampling samples is timed
+    unsigned long nread=0;
+    bool timed;
+
+    // metadata is written with the first sample of each file, when it changes,
+    // and every 'heartbeat' seconds
+    encodeMetadata(metafields, dbr, isarray, self.reader.getInfo());
+    bool write_meta = true;
+    epicsUInt32 last_period = 0;
+
+    DbrType previousType = self.reader.getType();
+    do{
+        timed = (nread++ % StageStats::sampling)==0;
+        if (self.reader.getType() != previousType) {
+            std::cerr<<"ERROR: The type of PV "<<self.name.c_str()<<" changed from " << previousType << " to " << self.reader.getType() << "\n";
+            std::cerr<<"wrote: "<<nwrote<<"\n";
+            self.typeChangeError += 1;
+            run.finish();
+            writeRun(self, run, nwrote);
+            return;
+        }
+        previousType = self.reader.getType();
+        sample_t *sample = (sample_t*)self.samp;
+
+        if((self.until.secPastEpoch || self.until.nsec) && notAfter(self.until, sample->stamp)) {
+            // the end of the window, so the rest isn't read
+            run.finish();
+            writeRun(self, run, nwrote);
+            self.samp = 0;
+            return;
+        }
+        if(sample->stamp.secPastEpoch>=self.endofpartition.secPastEpoch) {
+            std::cerr<<"Partition boundary "<<sample->stamp.secPastEpoch<<" "<<self.endofpartition.secPastEpoch <<"\n";
+            std::cerr<<"wrote: "<<nwrote<<"\n";
+            self.typeChangeError = 0;
+            run.finish();
+            writeRun(self, run, nwrote);
+            return;
+        }
+        unsigned int secintoyear = sample->stamp.secPastEpoch - self.startofyear.secPastEpoch;
+
+        samplefields.clear();
+
+        if (self.reader.changedInfo()) {
+            newmeta.clear();
+            encodeMetadata(newmeta, dbr, isarray, self.reader.getInfo());
+            if (newmeta != metafields) {
+                metafields.swap(newmeta);
+                write_meta = true;
+            }
+        }
+        if (self.heartbeat && sample->stamp.secPastEpoch/self.heartbeat != last_period) {
+            write_meta = true;
+        }
+
+        dbr_short_t sevr = sample->severity;
+
+        if ((sevr == 3904) || (sevr == 3872) || (sevr == 3848)) {
+            if (disconnected_epoch == 0) {
+                disconnected_epoch = sample->stamp.secPastEpoch;
+                self.ndisconnects++;
+            }
+            if ((sevr == 3872 || sevr == 3848) && prev_severity < 4) {
+                prev_severity = sevr;
+            }
+            continue; //don't write fields if disconnected
+        } else if (sevr > 3) {
+            //sevr == 3856 || sevr == 3968
+            std::cerr<<"WARN: "<<self.name.c_str()<<": Severity "<< sevr<<" encountered\n";
+            //don't write fields if special severity
+        } else {
+            if (disconnected_epoch != 0) {
+                //this is the first sample with value after a disconnected one
+                pbwire::appendFieldValue(samplefields, "cnxlostepsecs", num,
+                                         formatDecimal(num, disconnected_epoch + POSIX_TIME_AT_EPICS_EPOCH));
+                pbwire::appendFieldValue(samplefields, "cnxregainedepsecs", num,
+                                         formatDecimal(num, sample->stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH));
+
+                if (prev_severity == 3872) {
+                    pbwire::appendFieldValue(samplefields, "startup", "true");
+                } else if (prev_severity == 3848) {
+                    pbwire::appendFieldValue(samplefields, "resume", "true");
+                }
+                prev_severity = sevr;
+                disconnected_epoch = 0;
+            }
+
+            if (write_meta && !metafields.empty()) {
+                samplefields += metafields;
+                write_meta = false;
+                if (self.heartbeat)
+                    last_period = sample->stamp.secPastEpoch/self.heartbeat;
+            }
+        }
+
+        try{
+            if(self.collapse) {
+                {
+                    StageTimer T(self.stats, StageStats::Encode, timed);
+                    pbwire::sampleencoder<dbr,isarray> encoder(sample, self.reader.getCount(),
+                                                               secintoyear, samplefields);
+                    run.add(encoder);
+                }
+                writeRun(self, run, nwrote);
+                self.last = sample->stamp;
+                continue;
+            }
+            {
+                StageTimer T(self.stats, StageStats::Encode, timed);
+                pbwire::sampleencoder<dbr,isarray> encoder(sample, self.reader.getCount(),
+                                                           secintoyear, samplefields);
+                pbwire::encode(encbuf, encoder);
+            }
+            {
+                StageTimer T(self.stats, StageStats::Escape, timed);
+                encbuf.finalize();
+            }
+            self.outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+            nwrote++;
+            self.nwrote++;
+            self.last = sample->stamp;
+        }catch(std::exception& e) {
+            std::cerr<<"ERROR encoding sample! : "<<e.what()<<"\n";
+            encbuf.reset();
+            // skip
+        }
+
+    }while(self.outpb.good() && (self.samp=self.next(timed)));
+
+    run.finish();
+    writeRun(self, run, nwrote);
+
+    std::cerr<<"End file "<<self.samp<<" "<<self.outpb.good()<<"\n";
+    std::cerr<<"Wrote "<<nwrote<<"\n";
+}
+
+template<int dbr, int array>
+void skip(PBWriter& self, int fd, const char* file)
+{
+	typedef typename dbrstruct<dbr,array>::pbtype decoder;
+
+    //find the last sample that was written into the given file and skip forward the reader to the first
+    //sample that has a timestamp later than the last sample in the file
+    std::vector<char> temp;
+    bool header;
+    if(!readLastLine(fd, temp, &header) || header)
+        return; // no samples yet
+
+    decoder sample;
+    if(temp.empty()) {
+        std::cerr<<"WARN: "<<self.name.c_str()<<": Empty line at the end of "<<file<<"\n";
+        return;
+    }
+    {
+        std::vector<char> buf(unescape_plan(&temp[0], temp.size()));
+        // the value may be missing, but the time is all we need
+        if(unescape(&temp[0], temp.size(), &buf[0], buf.size()) ||
+                !sample.ParsePartialFromArray(&buf[0], buf.size()) ||
+                !sample.has_secondsintoyear() || !sample.has_nano()) {
+            std::cerr<<"WARN: "<<self.name.c_str()<<": Can't parse the last sample of "<<file<<"\n";
+            return;
+        }
+    }
+    epicsTimeStamp last;
+    last.secPastEpoch = sample.secondsintoyear() + self.startofyear.secPastEpoch;
+    last.nsec = sample.nano();
+
+    if((self.until.secPastEpoch || self.until.nsec) && notAfter(self.until, last)) {
+        // samples are only appended, so what is missing can't be inserted
+        std::cerr<<"ERROR: "<<self.name.c_str()<<": "<<file
+                 <<" already has samples after the end of the window\n";
+        self.windowclash = true;
+        self.samp = 0;
+        return;
+    }
+
+    if(!self.samp || !notAfter(self.samp->stamp, last))
+        return; // already past
+
+    // seek to the last sample written, then step over it and any others with the same time
+    epicsTime lasttime(last);
+    self.samp = self.reader.find(self.reader.channel_name, &lasttime);
+    while(self.samp && notAfter(self.samp->stamp, last))
+        self.samp = self.reader.next();
+}
+
+void PBWriter::prepFile()
+{
+    getYear(samp->stamp, &year);
+    getStartOfYear(year, &startofyear);
+    epicsTimeStamp startofpartition;
+    std::string partname;
+    getPartition(samp->stamp, partition, &startofpartition, &endofpartition, &partname);
+
+    dtype = reader.getType();
+    isarray = reader.getCount()!=1;
+
+    EPICS::PayloadInfo header;
+
+    std::cerr<<"is a "<<(isarray?"array\n":"scalar\n");
+    if(!isarray) {
+        // Scalars
+        switch(dtype)
+        {
+#define CASE(DBR) case DBR: transcode = &transcode_samples<DBR, 0>; \
+		skipForward = &skip<DBR, 0>; \
+    header.set_type((EPICS::PayloadType)dbrstruct<DBR, 0>::pbcode); break
+        CASE(DBR_TIME_STRING);
+        CASE(DBR_TIME_CHAR);
+        CASE(DBR_TIME_SHORT);
+        CASE(DBR_TIME_ENUM);
+        CASE(DBR_TIME_LONG);
+        CASE(DBR_TIME_FLOAT);
+        CASE(DBR_TIME_DOUBLE);
+#undef CASE
+        default: {
+            std::ostringstream msg;
+            msg<<"Unsupported type "<<dtype;
+            throw std::runtime_error(msg.str());
+        }
+        }
+    } else {
+        // Vectors
+        switch(dtype)
+        {
+#define CASE(DBR) case DBR: transcode = &transcode_samples<DBR, 1>; \
+        skipForward = &skip<DBR, 1>; \
+    header.set_type((EPICS::PayloadType)dbrstruct<DBR, 1>::pbcode); break
+        CASE(DBR_TIME_STRING);
+        CASE(DBR_TIME_CHAR);
+        CASE(DBR_TIME_SHORT);
+        CASE(DBR_TIME_ENUM);
+        CASE(DBR_TIME_LONG);
+        CASE(DBR_TIME_FLOAT);
+        CASE(DBR_TIME_DOUBLE);
+#undef CASE
+        default: {
+            std::ostringstream msg;
+            msg<<"Unsupported type "<<dtype;
+            throw std::runtime_error(msg.str());
+        }
+        }
+    }
+
+    header.set_elementcount(reader.getCount());
+    header.set_year(year);
+    header.set_pvname(reader.channel_name.c_str());
+
+    std::ostringstream fname;
+    if (typeChangeError > 0) {
+        fname << pvpathname(reader.channel_name.c_str())<<":"<<partname<<".pb."<<typeChangeError;
+    } else {
+        fname << pvpathname(reader.channel_name.c_str())<<":"<<partname<<".pb";
+    }
+
+    // Opened once, both to find what is already written and to append
+    std::string fnamestr(fname.str());
+    int fd;
+    bool fileexists = false;
+    if(dryrun) {
+        fd = ::open("/dev/null", O_WRONLY);
+    } else {
+        fd = dirs->open(fnamestr, O_RDWR|O_APPEND|O_CREAT);
+        struct stat st;
+        // An empty file is missing its header, as from a crash just after creation
+        fileexists = fd!=-1 && fstat(fd, &st)==0 && st.st_size>0;
+    }
+    if(fileexists) {
+        StageTimer T(stats, StageStats::Skip);
+        try {
+            (*skipForward)(*this, fd, fnamestr.c_str());
+        } catch(...) {
+            close(fd);
+            throw;
+        }
+        // a torn header line is truncated away, so must be written again
+        struct stat st;
+        fileexists = fstat(fd, &st)==0 && st.st_size>0;
+    }
+    if(std::find(files.begin(), files.end(), fnamestr)==files.end())
+        files.push_back(fnamestr);
+    if(!samp) {
+        // everything was already written
+        close(fd);
+        return;
+    }
+    if(reader.getType()!=dtype) {
+        // The samples after those already written are of another type, so
+        // go to the next file, as they would have without the resume
+        close(fd);
+        typeChangeError++;
+        prepFile();
+        return;
+    }
+
+    std::cerr<<"Starting to write "<<fnamestr<<"\n";
+    for(current=0; current<census.size() && census[current].file!=fnamestr; current++) {}
+    if(current==census.size()) {
+        census.push_back(FileCensus());
+        census.back().file = fnamestr;
+        census.back().year = year;
+        census.back().pbtype = header.type();
+        census.back().elements = reader.getCount();
+    }
+
+    escapingarraystream encbuf;
+    {
+        if (!fileexists) {
+            google::protobuf::io::CodedOutputStream encstrm(&encbuf);
+            header.SerializeToCodedStream(&encstrm);
+        }
+    }
+    encbuf.finalize();
+
+    outpb.open(fd, fnamestr.c_str());
+    if (!fileexists) { //if file exists do not write header
+        outpb.write(&encbuf.outbuf[0], encbuf.outbuf.size());
+    }
+}
+
+PBWriter::PBWriter(DataReader& reader, stdString pv, const ExportOptions& opts)
+    :reader(reader)
+    ,info(reader.getInfo())
+    ,year(0)
+    ,partition(opts.partition)
+    ,collapse(opts.collapse)
+    ,dryrun(opts.census!=0)
+    ,dirs(opts.dirs)
+    ,outpb(opts.bufsize, opts.uring)
+    ,heartbeat(opts.heartbeat)
+    ,name(pv)
+    ,nwrote(0)
+    ,current(0)
+    ,ndisconnects(0)
+    ,disconnected_epoch(0)
+    ,prev_severity(0)
+    ,onlyyear(0)
+{
+    last.secPastEpoch = last.nsec = 0;
+    until.secPastEpoch = until.nsec = 0;
+    windowclash = false;
+    samp = reader.get();
+    outpb.preallocate(opts.prealloc);
+    outpb.throttle(opts.throttle);
+    // on disk before the manifest records them
+    outpb.syncOnClose(opts.manifest!=0);
+    if(!dirs) {
+        owndirs = new DirCache;
+        dirs = owndirs;
+    }
+}
+
+void PBWriter::write()
+{
+    typeChangeError = 0;
+    while(samp) {
+        if(onlyyear) {
+            int y;
+            getYear(samp->stamp, &y);
+            if(y!=onlyyear)
+                break;
+        }
+        const unsigned long nwrote0 = nwrote, ndisconnects0 = ndisconnects;
+        const size_t nbytes0 = outpb.nbytes;
+        current = census.size();
+        try {
+            prepFile();
+            if (!samp) break;
+            (*transcode)(*this);
+        } catch (GenericException& up) {
+            if (std::strstr(up.what(),"Error in data header")) {
+                // From RawDataReader::getHeader()
+                //Error in the data header means a corrupted sample data.
+                //It can happen in the prepFile or in the transcode. Either way the resolution is the same.
+                //We try to move ahead. If it doesn't work, abort.
+                std::cerr<<"ERROR: "<<name.c_str()<<": Corrupted header, continuing with the next sample.\n"<<up.what()<<"\n";
+                samp = reader.next();
+            } else {
+                //tough luck
+                outpb.close();
+                throw;
+            }
+        } catch(...) {
+            outpb.close();
+            throw;
+        }
+
+        if(current<census.size()) {
+            FileCensus& C = census[current];
+            C.samples += nwrote-nwrote0;
+            C.disconnects += ndisconnects-ndisconnects0;
+            C.bytes += outpb.nbytes-nbytes0;
+        }
+
+        bool ok = outpb.good();
+        outpb.close();
+        if(!ok) {
+            std::cerr<<"Error writing file\n";
+            break;
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef PBWRITER_H
+#define PBWRITER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+// Tools
+#include <AutoPtr.h>
+// Storage
+#include <DataReader.h>
+
+#include "pbstreams.h"
+#include "pbstats.h"
+#include "pbeutil.h"
+#include "pbdircache.h"
+
+class Manifest;
+class Throttle;
+
+// Settings which apply to every PV exported
+struct ExportOptions
+{
+    // Size of the output buffer of each PBWriter
+    size_t bufsize;
+    // Record of previous exports, or NULL
+    Manifest *manifest;
+    // Seconds between repeats of unchanged metadata, 0 to only write on change
+    unsigned heartbeat;
+    // Per PV statistics, or NULL
+    StatsReporter *stats;
+    // Samples read ahead by a second thread, 0 to read between writes
+    size_t readahead;
+    // PVs spanning this many years are exported as one job per year, 0 never
+    unsigned splityears;
+    // Time covered by each file
+    Partition partition;
+    // Output directories shared by all writers, or NULL for one cache per PBWriter
+    DirCache *dirs;
+    // Write runs of identical samples as one, with repeatcount (see pbwire::samplerun)
+    bool collapse;
+    // Seconds in each bin of numeric scalars written by BinWriter, 0 for raw samples
+    unsigned binsize;
+    // If not NULL, a dry run.  PBWriter writes to /dev/null, and what would
+    // have been written to each file is reported here.
+    CensusReporter *census;
+    // Buffers of bufsize written through an io_uring, 0 to write synchronously
+    unsigned uring;
+    // Bytes of disk space reserved at a time ahead of writes, 0 for none
+    size_t prealloc;
+    // Only samples in this window are exported
+    TimeWindow window;
+    // The windows of PVs which have their own, in place of 'window', or NULL
+    const std::map<std::string, TimeWindow> *pvwindows;
+    // Limits the rate of reading and writing, or NULL
+    Throttle *throttle;
+
+    ExportOptions() :bufsize(1024*1024), manifest(0), heartbeat(86400), stats(0), readahead(0), splityears(0),
+        partition(PartitionYear), dirs(0), collapse(false), binsize(0), census(0), uring(0), prealloc(0),
+        pvwindows(0), throttle(0) {}
+};
+
+/* Encode the metadata fieldvalues of a PV
+ * numeric values have all except PREC, which is only for DOUBLE and FLOAT
+ * enum has only labels, string has nothing
+ */
+void encodeMetadata(std::string& out, DbrType dbr, bool isarray, const CtrlInfo& info);
+
+struct PBWriter
+{
+    DataReader& reader;
+    // Last returned sample, or NULL if all consumed
+    const RawValue::Data *samp;
+    const CtrlInfo& info;
+
+    // The year currently being exported
+    int year;
+    DbrType dtype;
+    bool isarray;
+    epicsTimeStamp startofyear;
+    // The partition of the file being written, within that year
+    const Partition partition;
+    epicsTimeStamp endofpartition;
+    const bool collapse;
+    // Write to /dev/null, as if no file existed (ExportOptions::census)
+    const bool dryrun;
+    // Opens the output files
+    DirCache *dirs;
+    AutoPtr<DirCache> owndirs;
+
+    bufferedfile outpb;
+    int typeChangeError;
+    const unsigned heartbeat;
+    const stdString name;
+
+    // Total number of samples written, over all files
+    unsigned long nwrote;
+    // Time of the last sample written, if nwrote>0
+    epicsTimeStamp last;
+    // Files written to
+    std::vector<std::string> files;
+    // What was written to each of them, and the entry of the open file
+    std::vector<FileCensus> census;
+    size_t current;
+    // Periods of disconnection, over all files
+    unsigned long ndisconnects;
+    // Time spent reading, encoding, and writing
+    StageStats stats;
+
+    // Kept from one file to the next, so the first sample after a
+    // disconnection notes it even when that is in the next year.
+    // Time of the first disconnected sample, or 0 if connected
+    epicsUInt32 disconnected_epoch;
+    int prev_severity;
+    // If not zero, stop at the end of this year
+    int onlyyear;
+    // If not 0, stop before the first sample at or after this time
+    epicsTimeStamp until;
+    // A file already had samples at or after 'until', so the window
+    // could not be appended to it, and nothing more was written
+    bool windowclash;
+
+    PBWriter(DataReader& reader, stdString pv, const ExportOptions& opts);
+    void write(); // all work is done through this method
+
+    void prepFile();
+
+    // reader.next(), timed if 'sample'
+    const RawValue::Data *next(bool sample)
+    {
+        StageTimer T(stats, StageStats::Read, sample);
+        return reader.next();
+    }
+
+    // Step the reader past the samples already in the open file
+    void (*skipForward)(PBWriter&, int fd, const char *file);
+
+    void (*transcode)(PBWriter&); // Points to a transcode_samples<>() specialization
+};
+
+#endif // PBWRITER_H
@@ -1,15 +1,34 @@
 
 #include <sstream>
+#include <fstream>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utime.h>
 #include <algorithm>
 
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
 
 #include <epicsUnitTest.h>
+#include <epicsThread.h>
+#include <dbDefs.h>
 #include <testMain.h>
+// Tools
+#include <GenericException.h>
 
 #include "pbstreams.h"
 #include "pbeutil.h"
+#include "pbmanifest.h"
+#include "pbencode.h"
+#include "pbreadahead.h"
+#include "pbfile.h"
+#include "pbdircache.h"
+#include "pbmerge.h"
+#include "pbthrottle.h"
+#include "pbstats.h"
 #include "EPICSEvent.pb.h"
 
 static void testTime()
@@ -29,6 +48,80 @@ static void testTime()
            (unsigned long)ts2.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
 }
 
+static void testParseTime()
+{
+    testDiag("parseTime()");
+    static const struct {
+        const char *txt;
+        bool ok;
+        unsigned long sec, nsec; // POSIX
+    } cases[] = {
+        {"2015-03-04T18:46:20Z", true, 1425494780, 0},
+        {"2015-03-04 18:46:20.5", true, 1425494780, 500000000},
+        {"2015-03-04T18:46:20.123456789Z", true, 1425494780, 123456789},
+        {"2015-03-04T18:46", true, 1425494760, 0},
+        {"2015-03-04", true, 1425427200, 0},
+        {"2015-13-04", false, 0, 0},
+        {"2015-03-04T18", false, 0, 0},
+        {"2015-03-04T18:46:20.", false, 0, 0},
+        {"2015-03-04Tx", false, 0, 0},
+        {"junk", false, 0, 0},
+    };
+    for(size_t i=0; i<NELEMENTS(cases); i++) {
+        epicsTimeStamp t = {0, 0};
+        bool ok = parseTime(cases[i].txt, &t);
+        testOk(ok==cases[i].ok && (!ok || (t.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH==cases[i].sec
+                                           && t.nsec==cases[i].nsec)),
+               "'%s' -> %d %lu.%09u", cases[i].txt, ok,
+               (unsigned long)t.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH, (unsigned)t.nsec);
+    }
+}
+
+static void testPartition()
+{
+    testDiag("getPartition()");
+    static const struct {
+        unsigned long t; // POSIX
+        Partition part;
+        const char *name;
+        unsigned long start, end;
+    } cases[] = {
+        {1425494780, PartitionYear, "2015", 1420070400, 1451606400},
+        {1425494780, PartitionMonth, "2015_03", 1425168000, 1427846400},
+        {1425494780, PartitionDay, "2015_03_04", 1425427200, 1425513600},
+        {1425494780, PartitionHour, "2015_03_04_18", 1425492000, 1425495600},
+        {1451606399, PartitionMonth, "2015_12", 1448928000, 1451606400},
+        {1451606399, PartitionHour, "2015_12_31_23", 1451602800, 1451606400},
+    };
+    for(size_t i=0; i<NELEMENTS(cases); i++) {
+        epicsTimeStamp t = {epicsUInt32(cases[i].t-POSIX_TIME_AT_EPICS_EPOCH), 5}, start, end;
+        std::string name;
+        getPartition(t, cases[i].part, &start, &end, &name);
+        testOk(name==cases[i].name && start.nsec==0 && end.nsec==0
+               && start.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH==cases[i].start
+               && end.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH==cases[i].end,
+               "%s [%lu, %lu)", name.c_str(),
+               (unsigned long)start.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH,
+               (unsigned long)end.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
+    }
+
+    Partition part = PartitionYear;
+    testOk1(parsePartition("day", &part) && part==PartitionDay);
+    testOk1(!parsePartition("week", &part) && part==PartitionDay);
+}
+
+static void testFormatDecimal()
+{
+    static const unsigned long vals[] = {0, 9, 10, 1425494790, (unsigned long)-1};
+    testDiag("Test integer formatting");
+    for(size_t i=0; i<NELEMENTS(vals); i++) {
+        char buf[24], expect[24];
+        size_t n = formatDecimal(buf, vals[i]);
+        sprintf(expect, "%lu", vals[i]);
+        testOk(std::string(buf, n)==expect, "%s", expect);
+    }
+}
+
 static void testEscape()
 {
     static const char input[] = "hello\nworld";
@@ -49,6 +142,631 @@ static void testEscape()
     testOk1(std::string(expect)==std::string(&encbuf.outbuf[0], encbuf.outbuf.size()));
 }
 
+// reference implementation of the PlainPB escaping
+static std::string refEscape(const std::string& in)
+{
+    std::string out;
+    for(size_t i=0; i<in.size(); i++) {
+        switch(in[i]) {
+        case '\x1b': out += "\x1b\x01"; break;
+        case '\n': out += "\x1b\x02"; break;
+        case '\r': out += "\x1b\x03"; break;
+        default: out += in[i];
+        }
+    }
+    return out;
+}
+
+static void testEscapeLong()
+{
+    static const char specials[] = "\n\r\x1b";
+    testDiag("Escaping across vector widths");
+
+    // special bytes at every offset from start and end of an unaligned buffer
+    bool ok = true;
+    for(size_t len=0; len<100; len++) {
+        for(size_t at=0; at<len; at++) {
+            std::string input;
+            for(size_t i=0; i<len; i++)
+                input += char('a'+i%26);
+            input[at] = specials[at%3];
+            input[len-1-at] = specials[(at+1)%3];
+
+            escapingarraystream encbuf;
+            encbuf.escape(input.c_str(), input.size());
+            if(std::string(encbuf.outbuf.begin(), encbuf.outbuf.end())!=refEscape(input)) {
+                testDiag("Mismatch len=%u at=%u", (unsigned)len, (unsigned)at);
+                ok = false;
+            }
+        }
+    }
+    testOk(ok, "escape() matches reference");
+
+    std::string dense(1000, '\n');
+    for(size_t i=0; i<dense.size(); i+=3)
+        dense[i] = '\x1b';
+    escapingarraystream encbuf;
+    encbuf.escape(dense.c_str(), dense.size());
+    testOk1(std::string(encbuf.outbuf.begin(), encbuf.outbuf.end())==refEscape(dense));
+}
+
+/* Sample values for the encoder tests, chosen to hit the boundaries of
+ * each encoding, and the bytes which must be escaped.
+ */
+static void testValue(dbr_string_t& v, unsigned i)
+{
+    static const char * const vals[] = {"", "hello", "with\nnewline\r\x1b",
+                                        "012345678901234567890123456789012345678"};
+    strncpy(v, vals[i%NELEMENTS(vals)], MAX_STRING_SIZE-1);
+    v[MAX_STRING_SIZE-1] = '\0';
+}
+static void testValue(dbr_char_t& v, unsigned i)
+{
+    static const dbr_char_t vals[] = {'a', 0, '\n', 0x1b, 0xff, '\r', 0x7f};
+    v = vals[i%NELEMENTS(vals)];
+}
+static void testValue(dbr_short_t& v, unsigned i)
+{
+    static const dbr_short_t vals[] = {0, 1, -1, 63, -64, 64, -65, 8191, -8192, 32767, -32768};
+    v = vals[i%NELEMENTS(vals)];
+}
+static void testValue(dbr_enum_t& v, unsigned i)
+{
+    static const dbr_enum_t vals[] = {0, 1, 5, 63, 64, 8191, 8192, 65535};
+    v = vals[i%NELEMENTS(vals)];
+}
+static void testValue(dbr_long_t& v, unsigned i)
+{
+    static const dbr_long_t vals[] = {0, 1, -1, 0x0a0d1b00, 2147483647, -2147483647-1};
+    v = vals[i%NELEMENTS(vals)];
+}
+static void testValue(dbr_float_t& v, unsigned i)
+{
+    static const dbr_float_t vals[] = {0.0f, -0.0f, 1.5f, -1e30f, 3.4e38f, 1e-40f};
+    v = vals[i%NELEMENTS(vals)];
+    if(i%8==7)
+        v = v/v; // NaN
+}
+static void testValue(dbr_double_t& v, unsigned i)
+{
+    static const dbr_double_t vals[] = {0.0, -0.0, 1.5, -1e300, 1e-310, 3.14159265358979};
+    v = vals[i%NELEMENTS(vals)];
+    if(i%8==7)
+        v = 1.0/v; // inf
+}
+
+// Compare sampleencoder<> with the generated classes
+template<int dbr, int isarray>
+static void testEncodeType(const char *name)
+{
+    typedef typename dbrstruct<dbr,isarray>::dbrtype dbrtype;
+    typedef typename dbrstruct<dbr,isarray>::pbtype pbtype;
+    typedef std::vector<std::pair<std::string, std::string> > fieldvalues_t;
+
+    static const DbrCount counts[] = {1, 0, 5, 200, 65536};
+    static const dbr_short_t sevstat[][2] = {{0,0}, {2,0}, {0,7}, {3856,4}, {-5,-2}};
+
+    fieldvalues_t fields[3];
+    fields[1].push_back(std::make_pair("EGU", "mm"));
+    fields[2].push_back(std::make_pair("cnxlostepsecs", "1425494780"));
+    fields[2].push_back(std::make_pair("states", std::string(200, 'x')+"\n"));
+
+    unsigned ncases = 0, nfail = 0;
+    for(unsigned c=0; c<(isarray ? NELEMENTS(counts) : 1u); c++) {
+        DbrCount count = counts[c];
+        std::vector<char> buf(sizeof(dbrtype)+count*sizeof(((dbrtype*)0)->value));
+        dbrtype *sample = (dbrtype*)&buf[0];
+
+        for(unsigned v=0; v<8; v++) {
+            // the last variant has only values which encode to one byte
+            for(DbrCount i=0; i<std::max(count, (DbrCount)1); i++)
+                testValue((&sample->value)[i], v==7 ? i%4 : v+i);
+
+            for(unsigned ss=0; ss<NELEMENTS(sevstat); ss++) {
+                sample->severity = sevstat[ss][0];
+                sample->status = sevstat[ss][1];
+                sample->stamp.secPastEpoch = 1234567+v;
+                sample->stamp.nsec = v*123456789u;
+
+                for(unsigned f=0; f<NELEMENTS(fields); f++) {
+                    epicsUInt32 secintoyear = v*4000000u;
+
+                    pbtype ref;
+                    ref.set_secondsintoyear(secintoyear);
+                    ref.set_nano(sample->stamp.nsec);
+                    valueop<dbr, isarray>::set(ref, sample, count);
+                    if(sample->severity!=0)
+                        ref.set_severity(sample->severity);
+                    if(sample->status!=0)
+                        ref.set_status(sample->status);
+
+                    std::string block;
+                    for(size_t i=0; i<fields[f].size(); i++) {
+                        EPICS::FieldValue* FV(ref.add_fieldvalues());
+                        FV->set_name(fields[f][i].first);
+                        FV->set_val(fields[f][i].second);
+                        pbwire::appendFieldValue(block, fields[f][i].first, fields[f][i].second);
+                    }
+                    std::string expect(ref.SerializePartialAsString());
+
+                    pbtype timeonly;
+                    timeonly.set_secondsintoyear(secintoyear);
+                    timeonly.set_nano(sample->stamp.nsec);
+
+                    pbwire::sampleencoder<dbr,isarray> enc(sample, count, secintoyear, block);
+                    std::vector<char> actual(enc.size()+16, '\xaa');
+                    char *end = enc.encode(&actual[0]);
+
+                    escapingarraystream encbuf;
+                    pbwire::serialize(encbuf, enc);
+
+                    ncases++;
+                    if(enc.size()!=expect.size() || size_t(end-&actual[0])!=expect.size()
+                            || enc.valueOffset()!=timeonly.SerializePartialAsString().size()
+                            || enc.fieldsOffset()!=expect.size()-block.size()
+                            || expect!=std::string(&actual[0], expect.size())
+                            || refEscape(expect)+"\n"!=std::string(&encbuf.outbuf[0], encbuf.outbuf.size())) {
+                        if(!nfail++)
+                            testDiag("%s count=%u value=%u sevr=%d stat=%d fields=%u differs",
+                                     name, (unsigned)count, v, sample->severity, sample->status, f);
+                    }
+                }
+            }
+        }
+    }
+    testOk(nfail==0, "%s: %u of %u samples encoded differently", name, nfail, ncases);
+}
+
+static void testEncode()
+{
+    testDiag("Compare direct encoding with the generated classes");
+    testEncodeType<DBR_TIME_STRING, 0>("ScalarString");
+    testEncodeType<DBR_TIME_CHAR, 0>("ScalarByte");
+    testEncodeType<DBR_TIME_SHORT, 0>("ScalarShort");
+    testEncodeType<DBR_TIME_ENUM, 0>("ScalarEnum");
+    testEncodeType<DBR_TIME_LONG, 0>("ScalarInt");
+    testEncodeType<DBR_TIME_FLOAT, 0>("ScalarFloat");
+    testEncodeType<DBR_TIME_DOUBLE, 0>("ScalarDouble");
+    testEncodeType<DBR_TIME_STRING, 1>("VectorString");
+    testEncodeType<DBR_TIME_CHAR, 1>("VectorChar");
+    testEncodeType<DBR_TIME_SHORT, 1>("VectorShort");
+    testEncodeType<DBR_TIME_ENUM, 1>("VectorEnum");
+    testEncodeType<DBR_TIME_LONG, 1>("VectorInt");
+    testEncodeType<DBR_TIME_FLOAT, 1>("VectorFloat");
+    testEncodeType<DBR_TIME_DOUBLE, 1>("VectorDouble");
+}
+
+static void testSampleRun()
+{
+    testDiag("Collapse runs of samples with repeatcount");
+    static const struct {
+        epicsInt32 value;
+        bool fields, folded;
+    } samples[] = {
+        {1, true, false},
+        {1, false, true},
+        {1, false, true},
+        {2, false, false},
+        {2, true, false}, // noting a disconnection, starts a run
+        {2, false, true},
+    };
+
+    pbwire::samplerun run;
+    dbr_time_long sample;
+    sample.severity = sample.status = 0;
+    sample.stamp.nsec = 0;
+    bool foldok = true;
+    for(unsigned i=0; i<NELEMENTS(samples); i++) {
+        std::string fields;
+        if(samples[i].fields)
+            pbwire::appendFieldValue(fields, "EGU", "mm");
+        sample.value = samples[i].value;
+        sample.stamp.secPastEpoch = 100+i;
+        pbwire::sampleencoder<DBR_TIME_LONG,0> enc(&sample, 1, 10+i, fields);
+        foldok &= run.add(enc)==samples[i].folded;
+    }
+    testOk1(foldok);
+    testOk(run.nlines==2, "%u lines before finish()", (unsigned)run.nlines);
+    run.finish();
+    testOk(run.nlines==4, "%u lines", (unsigned)run.nlines);
+
+    std::vector<std::string> lines;
+    {
+        std::string all(run.lines().begin(), run.lines().end());
+        size_t start = 0, eol;
+        while((eol = all.find('\n', start))!=std::string::npos) {
+            std::string line(all.substr(start, eol-start));
+            std::vector<char> buf(unescape_plan(line.data(), line.size()));
+            unescape(line.data(), line.size(), buf.empty() ? 0 : &buf[0], buf.size());
+            lines.push_back(std::string(buf.begin(), buf.end()));
+            start = eol+1;
+        }
+    }
+    testOk(lines.size()==4, "%u lines", (unsigned)lines.size());
+    lines.resize(4);
+
+    // the first of a run keeps its time, and counts those folded into it
+    EPICS::ScalarInt ref;
+    ref.set_secondsintoyear(10);
+    ref.set_nano(0);
+    ref.set_val(1);
+    ref.set_repeatcount(2);
+    EPICS::FieldValue *FV = ref.add_fieldvalues();
+    FV->set_name("EGU");
+    FV->set_val("mm");
+    testOk1(lines[0]==ref.SerializeAsString());
+
+    EPICS::ScalarInt A, B, C;
+    testOk1(A.ParseFromString(lines[1]) && A.secondsintoyear()==13 && !A.has_repeatcount());
+    testOk1(B.ParseFromString(lines[2]) && B.secondsintoyear()==14 && !B.has_repeatcount()
+            && B.fieldvalues_size()==1);
+    // the last of a file is written by itself
+    testOk1(C.ParseFromString(lines[3]) && C.secondsintoyear()==15 && !C.has_repeatcount()
+            && C.fieldvalues_size()==0);
+}
+
+static void writeLargeSample()
+{
+    testDiag("escapingarraystream with many chunks");
+    EPICS::VectorDouble encoder;
+
+    encoder.set_secondsintoyear(1234);
+    encoder.set_nano(5678);
+    // 2.0000000000000018 is encoded as 0a 00 00 00 00 00 00 40
+    for(size_t i=0; i<10000; i++)
+        encoder.add_val(i%2 ? 2.0000000000000018 : double(i));
+
+    std::string outstr(encoder.SerializeAsString());
+
+    escapingarraystream encbuf;
+    for(int i=0; i<2; i++) {
+        {
+            google::protobuf::io::CodedOutputStream encstrm(&encbuf);
+            testOk1(encoder.SerializeToCodedStream(&encstrm));
+        }
+        testOk((size_t)encbuf.ByteCount()==outstr.size(), "ByteCount %u", (unsigned)encbuf.ByteCount());
+        encbuf.finalize();
+        testOk1(std::string(encbuf.outbuf.begin(), encbuf.outbuf.end())==refEscape(outstr)+"\n");
+    }
+
+    testDiag("with size hint");
+    encbuf.reserve(encoder.ByteSize());
+    {
+        google::protobuf::io::CodedOutputStream encstrm(&encbuf);
+        testOk1(encoder.SerializeToCodedStream(&encstrm));
+    }
+    testOk1(encbuf.inbuf.size()==outstr.size());
+    encbuf.finalize();
+    testOk1(std::string(encbuf.outbuf.begin(), encbuf.outbuf.end())==refEscape(outstr)+"\n");
+}
+
+static void testBufferedFile()
+{
+    static const char fname[] = "testPB-bufferedfile.tmp";
+    testDiag("bufferedfile");
+    remove(fname);
+
+    {
+        bufferedfile out(16);
+        out.open(fname);
+        testOk1(out.good());
+        out.write("0123456789", 10);
+        testOk1(out.nsyscalls==0);
+        // overflows, written along with the buffer in one call
+        out.write("abcdefghij", 10);
+        testOk1(out.nsyscalls==1);
+        out.write("ABCDE", 5);
+        out.close();
+        testOk1(out.nsyscalls==2);
+        testOk1(out.nbytes==25);
+
+        // re-open appends
+        out.open(fname);
+        out.write("!", 1);
+        out.close();
+        testOk1(out.good());
+    }
+
+    std::ifstream inp(fname);
+    std::string content;
+    std::getline(inp, content);
+    testOk(content=="0123456789abcdefghijABCDE!", "%s", content.c_str());
+    remove(fname);
+}
+
+// Through an io_uring, if built with one, and preallocated
+static void testBufferedFileRing()
+{
+    static const char fname[] = "testPB-bufferedring.tmp";
+    testDiag("bufferedfile w/ io_uring %s", bufferedfile::haveRing() ? "built" : "not built");
+    remove(fname);
+
+    std::string expect;
+    {
+        bufferedfile out(16, 3);
+        out.preallocate(64);
+        out.open(fname);
+        testOk1(out.good());
+        testDiag("io_uring %s", out.ringing() ? "in use" : "not in use");
+        // fills all of the buffers more than once, some across buffers
+        for(unsigned i=0; i<20; i++) {
+            std::string chunk(i%7+1, char('a'+i));
+            if(i==10)
+                chunk.assign(40, 'X');
+            out.write(chunk.c_str(), chunk.size());
+            expect += chunk;
+        }
+        out.close();
+        testOk1(out.good());
+
+        // re-open appends
+        out.open(fname);
+        out.write("!", 1);
+        expect += "!";
+        out.close();
+        testOk1(out.good());
+        testOk1(out.nbytes==expect.size());
+    }
+
+    struct stat st;
+    int ret = stat(fname, &st);
+    testOk(ret==0 && size_t(st.st_size)==expect.size(), "size %u", unsigned(st.st_size));
+    std::ifstream inp(fname);
+    std::string content;
+    std::getline(inp, content);
+    testOk(content==expect, "%s", content.c_str());
+    remove(fname);
+}
+
+static void testThrottle()
+{
+    static const char sharename[] = "testPB-throttle.shared",
+                      ctlname[] = "testPB-throttle.ctl";
+    testDiag("Throttle");
+    remove(sharename);
+    remove(ctlname);
+
+    ThrottleLimits limits;
+    limits.writebytes = 100000;
+    {
+        // a full second to start, then waits for the debt
+        Throttle T(limits);
+        double start = monotonicSeconds();
+        T.write(100000);
+        T.write(50000);
+        double elapsed = monotonicSeconds()-start;
+        testOk(elapsed>=0.45 && elapsed<5.0, "elapsed %f", elapsed);
+        testOk(T.waited()>=0.45, "waited %f", T.waited());
+    }
+
+    limits.writebytes = 0;
+    limits.readbytes = 100000;
+    {
+        // one process's reads leave less for the other
+        Throttle A(limits), B(limits);
+        A.share(sharename);
+        B.share(sharename);
+        A.read(100000);
+        testOk(A.waited()==0.0, "waited %f", A.waited());
+        B.read(20000);
+        testOk(B.waited()>=0.15, "waited %f", B.waited());
+    }
+
+    {
+        Throttle T(limits);
+        {
+            std::ofstream F(ctlname);
+            F<<"# comment\nwritekB 2\nwriteops 5\n";
+        }
+        T.control(ctlname);
+        ThrottleLimits L(T.limits());
+        testOk(L.readbytes==0.0 && L.writebytes==2048.0 && L.writeops==5.0,
+               "limits %f %f %f", L.readbytes, L.writebytes, L.writeops);
+        testOk1(!T.reload()); // unchanged
+
+        {
+            std::ofstream F(ctlname);
+            F<<"writekB many\n";
+        }
+        struct utimbuf later = {time(0)+10, time(0)+10};
+        utime(ctlname, &later);
+        testOk1(!T.reload());
+        L = T.limits();
+        testOk(L.writebytes==2048.0, "limits %f", L.writebytes);
+    }
+    remove(sharename);
+    remove(ctlname);
+}
+
+static void testDirCache()
+{
+    testDiag("DirCache");
+    static const char a[] = "testPB-dircache/x/y/a.pb",
+                      b[] = "testPB-dircache/x/y/b.pb",
+                      c[] = "testPB-dircache/x//z/c.pb";
+
+    {
+        DirCache dirs(1);
+        int fd = dirs.open(a, O_RDWR|O_APPEND|O_CREAT);
+        testOk(fd!=-1, "create %s", a);
+        testOk(dirs.hits==0 && dirs.misses==3, "hits %u misses %u", (unsigned)dirs.hits, (unsigned)dirs.misses);
+        if(fd!=-1) {
+            testOk1(write(fd, "A", 1)==1);
+            close(fd);
+        } else {
+            testSkip(1, "no file");
+        }
+
+        // the directory is still open
+        fd = dirs.open(b, O_RDWR|O_APPEND|O_CREAT);
+        testOk(fd!=-1 && dirs.hits==1 && dirs.misses==3, "hits %u misses %u", (unsigned)dirs.hits, (unsigned)dirs.misses);
+        if(fd!=-1)
+            close(fd);
+
+        // only the last directory is kept open, so the path is walked again
+        fd = dirs.open(c, O_RDWR|O_APPEND|O_CREAT);
+        testOk(fd!=-1 && dirs.misses==6, "hits %u misses %u", (unsigned)dirs.hits, (unsigned)dirs.misses);
+        if(fd!=-1)
+            close(fd);
+
+        // existing file opened for append
+        fd = dirs.open(a, O_RDWR|O_APPEND|O_CREAT);
+        struct stat info;
+        testOk1(fd!=-1 && fstat(fd, &info)==0 && info.st_size==1);
+        if(fd!=-1)
+            close(fd);
+
+        errno = 0;
+        testOk1(dirs.open("testPB-dircache/missing/d.pb", O_RDONLY)==-1 && errno==ENOENT);
+    }
+
+    std::ifstream inp(a);
+    std::string content;
+    std::getline(inp, content);
+    testOk1(content=="A");
+
+    remove(a);
+    remove(b);
+    remove(c);
+    remove("testPB-dircache/missing");
+    remove("testPB-dircache/x/y");
+    remove("testPB-dircache/x/z");
+    remove("testPB-dircache/x");
+    remove("testPB-dircache");
+}
+
+static void testLastLine()
+{
+    static const char fname[] = "testPB-lastline.tmp";
+    testDiag("readLastLine()");
+
+    std::string longline(10000, 'x');
+    longline[0] = 'L';
+
+    struct {
+        const char *content;
+        size_t len;
+        bool found, first;
+        const char *expect;
+        size_t after; // file size after
+    } cases[] = {
+        {"", 0, false, false, "", 0},
+        {"Header", 6, false, false, "", 0},
+        {"H\n", 2, true, true, "H", 2},
+        {"H\nA\nBB\n", 7, true, false, "BB", 7},
+        {"H\nA\nBBtorn", 10, true, false, "A", 4},
+        {"H\nA\n\n", 5, true, false, "", 5},
+    };
+
+    for(size_t i=0; i<NELEMENTS(cases); i++) {
+        {
+            std::ofstream out(fname, std::ios::trunc);
+            out.write(cases[i].content, cases[i].len);
+        }
+        int fd = open(fname, O_RDWR);
+        std::vector<char> line;
+        bool first = false;
+        bool found = readLastLine(fd, line, &first);
+        struct stat info;
+        fstat(fd, &info);
+        close(fd);
+
+        testOk(found==cases[i].found && first==cases[i].first
+               && std::string(line.begin(), line.end())==cases[i].expect
+               && size_t(info.st_size)==cases[i].after,
+               "case %u found=%d first=%d '%s' size=%u", (unsigned)i, found, first,
+               std::string(line.begin(), line.end()).c_str(), (unsigned)info.st_size);
+    }
+
+    {
+        std::ofstream out(fname, std::ios::trunc);
+        out<<"H\n"<<longline<<"\n"<<longline<<"\nabc";
+    }
+    int fd = open(fname, O_RDWR);
+    std::vector<char> line;
+    bool first = true;
+    testOk1(readLastLine(fd, line, &first));
+    testOk1(!first);
+    testOk1(std::string(line.begin(), line.end())==longline);
+    close(fd);
+    remove(fname);
+}
+
+static void testManifest()
+{
+    static const char fname[] = "testPB-manifest.tmp";
+    testDiag("Manifest");
+    remove(fname);
+
+    Manifest::Entry entry, entry2;
+    entry.end.secPastEpoch = 1425494790-POSIX_TIME_AT_EPICS_EPOCH;
+    entry.end.nsec = 100;
+    entry.last = entry.end;
+    entry.count = 11;
+    entry.files.push_back("pv/counter:2015.pb");
+    entry.files.push_back("pv/counter:2016.pb");
+
+    std::string line(Manifest::format("pv-counter", entry));
+    testOk(line=="pv-counter\t1425494790.000000100\t1425494790.000000100\t11\tpv/counter:2015.pb\tpv/counter:2016.pb\n",
+           "%s", line.c_str());
+
+    std::string pv;
+    testOk1(Manifest::parse(line.substr(0, line.size()-1), pv, entry2));
+    testOk1(pv=="pv-counter");
+    testOk1(entry2.count==11 && entry2.files==entry.files);
+    testOk1(entry2.last.secPastEpoch==entry.last.secPastEpoch && entry2.last.nsec==100);
+    testOk1(!Manifest::parse("pv-counter\t1425494790.000000100\t1425494790", pv, entry2));
+
+    {
+        Manifest M(fname);
+        testOk1(M.size()==0);
+        M.update("pv-counter", entry);
+        entry.count = 12;
+        M.update("pv-counter", entry);
+        M.update("other", entry);
+        testOk1(M.size()==2);
+    }
+    {
+        // torn line from an interrupted update
+        std::ofstream out(fname, std::ios::app);
+        out<<"third\t1425494790.0000";
+    }
+    {
+        Manifest M(fname);
+        testOk1(M.size()==2);
+        testOk1(M.lookup("pv-counter", entry2) && entry2.count==12);
+        testOk1(!M.lookup("third", entry2));
+    }
+    {
+        // compacted to one line per PV
+        std::ifstream inp(fname);
+        std::string line;
+        size_t nlines = 0;
+        while(std::getline(inp, line))
+            nlines++;
+        testOk(nlines==2, "nlines %u", (unsigned)nlines);
+    }
+    {
+        // compacted while open, as by many -follow cycles
+        Manifest M(fname);
+        for(unsigned i=0; i<100; i++) {
+            entry.count = 100+i;
+            M.update("pv-counter", entry);
+        }
+    }
+    {
+        std::ifstream inp(fname);
+        std::string line;
+        size_t nlines = 0;
+        while(std::getline(inp, line))
+            nlines++;
+        testOk(nlines<=4, "nlines %u", (unsigned)nlines);
+        Manifest M(fname);
+        testOk1(M.size()==2 && M.lookup("pv-counter", entry2) && entry2.count==199);
+    }
+    remove(fname);
+}
+
 static void writeSample()
 {
     EPICS::ScalarInt encoder;
@@ -118,11 +836,334 @@ static void writeSample()
     }
 }
 
+/* The current sample of the fake readers below, a double of up to
+ * 'maxcount' elements.
+ */
+class DoubleReader : public DataReader
+{
+    std::vector<double> buf;
+    bool valid;
+protected:
+    CtrlInfo info;
+
+    explicit DoubleReader(DbrCount maxcount)
+        :buf(RawValue::getSize(DBR_TIME_DOUBLE, maxcount)/sizeof(double)+1)
+        ,valid(false)
+    {}
+    // The sample at 't', with elements val, val+step, ...
+    const RawValue::Data *set(epicsUInt32 t, DbrCount count, double val, double step)
+    {
+        RawValue::Data *samp = (RawValue::Data*)&buf[0];
+        samp->stamp.secPastEpoch = t;
+        samp->stamp.nsec = 0;
+        samp->status = samp->severity = 0;
+        for(size_t j=0; j<count; j++)
+            (&samp->value)[j] = val+j*step;
+        valid = true;
+        return samp;
+    }
+    // No more samples
+    const RawValue::Data *end()
+    {
+        valid = false;
+        return 0;
+    }
+public:
+    virtual const RawValue::Data *get() const { return valid ? (const RawValue::Data*)&buf[0] : 0; }
+    virtual DbrType getType() const { return DBR_TIME_DOUBLE; }
+    virtual const CtrlInfo &getInfo() const { return info; }
+};
+
+/* Serves samples 0..n-1 of a double, with time and value both i.
+ * From 'arrayAt' the samples have 3 elements, from 'infoAt' the
+ * precision is 3, and next() throws once, instead of returning 'throwAt'.
+ */
+class FakeReader : public DoubleReader
+{
+    const size_t n, arrayAt, infoAt, throwAt;
+    size_t i;
+    bool thrown;
+
+    const RawValue::Data *fill()
+    {
+        if(i>=n)
+            return end();
+        info.setNumeric(i>=infoAt ? 3 : 0, "mm", 0, 10, 0, 0, 0, 0);
+        return set(i, getCount(), i, 1);
+    }
+public:
+    FakeReader(size_t n, size_t arrayAt, size_t infoAt, size_t throwAt)
+        :DoubleReader(3)
+        ,n(n), arrayAt(arrayAt), infoAt(infoAt), throwAt(throwAt), i(0), thrown(false)
+    {
+        channel_name = "fake";
+        fill();
+    }
+    virtual const RawValue::Data *find(const stdString &, const epicsTime *start)
+    {
+        i = start ? epicsTimeStamp(*start).secPastEpoch : 0;
+        return fill();
+    }
+    virtual const RawValue::Data *next()
+    {
+        // a slow disk
+        if(i%64==0)
+            epicsThreadSleep(0.001);
+        if(i+1==throwAt && !thrown) {
+            thrown = true;
+            throw GenericException(__FILE__, __LINE__, "Error in data header");
+        }
+        i++;
+        return fill();
+    }
+    virtual DbrCount getCount() const { return i>=arrayAt ? 3 : 1; }
+    virtual bool changedType() { return i==arrayAt; }
+    virtual bool changedInfo() { return i==infoAt; }
+};
+
+static void testReadAhead()
+{
+    testDiag("Test ReadAheadReader");
+    FakeReader fake(1000, 600, 300, 700);
+    ReadAheadReader reader(fake, 8);
+
+    bool inorder = true, counts = true, infos = true, threw = false;
+    size_t expect = 0, changes = 0;
+    const RawValue::Data *samp = reader.get();
+    while(samp) {
+        size_t count = expect>=600 ? 3 : 1;
+        inorder &= samp->stamp.secPastEpoch==expect && reader.getCount()==count;
+        for(size_t j=0; j<reader.getCount(); j++)
+            counts &= (&samp->value)[j]==expect+j;
+        infos &= reader.getInfo().getPrecision()==(expect>=300 ? 3 : 0);
+        if(reader.changedType())
+            changes++;
+        expect++;
+        try {
+            samp = reader.next();
+        } catch(GenericException& e) {
+            threw = expect==700 && strstr(e.what(), "Error in data header");
+            samp = reader.next(); // carry on
+        }
+    }
+    testOk(inorder && expect==1000, "Samples in order, stopped at %u", (unsigned)expect);
+    testOk1(counts);
+    testOk1(infos);
+    testOk(changes==1, "type changed %u times", (unsigned)changes);
+    testOk1(threw);
+    testOk1(!reader.next() && !reader.get());
+
+    epicsTimeStamp ts;
+    ts.secPastEpoch = 500;
+    ts.nsec = 0;
+    epicsTime start(ts);
+    samp = reader.find("fake", &start);
+    testOk(samp && samp->stamp.secPastEpoch==500, "find() 500");
+    for(expect=501; expect<550 && (samp=reader.next()); expect++) {
+        if(samp->stamp.secPastEpoch!=expect)
+            break;
+    }
+    testOk(expect==550, "continue after find() to %u", (unsigned)expect);
+    // destroyed with the worker blocked on a full ring
+}
+
+/* Serves a list of samples of a double with 'count' elements.
+ * The value of each is 'tag' plus its time.
+ */
+class ListReader : public DoubleReader
+{
+    const std::vector<epicsUInt32> times;
+    const DbrCount count;
+    const double tag;
+    size_t i;
+
+    const RawValue::Data *fill()
+    {
+        if(i>=times.size())
+            return end();
+        return set(times[i], count, tag+times[i], 0);
+    }
+public:
+    ListReader(const epicsUInt32 *T, size_t n, DbrCount count, double tag)
+        :DoubleReader(count)
+        ,times(T, T+n), count(count), tag(tag), i(0)
+    {
+        info.setNumeric(0, "mm", 0, 10, 0, 0, 0, 0);
+    }
+    // the last sample at or before 'start', or the first
+    virtual const RawValue::Data *find(const stdString &, const epicsTime *start)
+    {
+        i = 0;
+        if(start) {
+            epicsUInt32 t = epicsTimeStamp(*start).secPastEpoch;
+            while(i+1<times.size() && times[i+1]<=t)
+                i++;
+        }
+        return fill();
+    }
+    virtual const RawValue::Data *next()
+    {
+        i++;
+        return fill();
+    }
+    virtual DbrCount getCount() const { return count; }
+    virtual bool changedType() { return false; }
+    virtual bool changedInfo() { return i==0; }
+};
+
+// "time/tag" of each sample, and where the type changed
+static std::string readMerged(MergeReader& reader, const RawValue::Data *samp, unsigned *ntypes)
+{
+    std::ostringstream strm;
+    *ntypes = 0;
+    for(; samp; samp = reader.next()) {
+        double val = samp->value;
+        strm<<samp->stamp.secPastEpoch<<"/"<<unsigned(val-samp->stamp.secPastEpoch)<<" ";
+        if(reader.changedType())
+            (*ntypes)++;
+    }
+    return strm.str();
+}
+
+static void testMerge()
+{
+    testDiag("Test MergeReader");
+    static const epicsUInt32 A[] = {1, 3, 5, 7},
+                             B[] = {2, 3, 6, 9},
+                             C[] = {8};
+    std::vector<DataReader*> readers;
+    readers.push_back(new ListReader(A, NELEMENTS(A), 1, 0));
+    readers.push_back(new ListReader(B, NELEMENTS(B), 1, 100));
+    readers.push_back(new ListReader(C, 0, 1, 200));
+    readers.push_back(new ListReader(C, NELEMENTS(C), 2, 300));
+    MergeReader reader(readers);
+
+    unsigned ntypes;
+    std::string merged = readMerged(reader, reader.find("list", 0), &ntypes);
+    testOk(merged=="1/0 2/100 3/0 5/0 6/100 7/0 8/300 9/100 ", "merged %s", merged.c_str());
+    testOk(reader.ndropped==1, "dropped %lu", reader.ndropped);
+    testOk(ntypes==2, "type changed %u times", ntypes);
+    testOk1(!reader.get() && !reader.next());
+
+    epicsTimeStamp ts;
+    ts.secPastEpoch = 4;
+    ts.nsec = 0;
+    epicsTime start(ts);
+    merged = readMerged(reader, reader.find("list", &start), &ntypes);
+    testOk(merged=="3/0 5/0 6/100 7/0 8/300 9/100 ", "find() 4 %s", merged.c_str());
+    testOk(reader.ndropped==2, "dropped %lu", reader.ndropped);
+}
+
+static void testPBFile()
+{
+    static const char fname[] = "testPB-file.tmp";
+    testDiag("PBFile lookup by time");
+
+    // times chosen so that encoded samples contain bytes which are escaped
+    static const struct {
+        epicsUInt32 sec, nano;
+        epicsInt32 val;
+    } samples[] = {
+        {1, 0, 1},
+        {10, 0, 2},
+        {10, 10, 3},
+        {27, 0x1b, 4},
+        {27, 0x1b, 5},
+        {30, 0, 10},
+        {40, 13, 6},
+    };
+
+    {
+        std::ofstream out(fname, std::ios::trunc);
+        EPICS::PayloadInfo info;
+        info.set_type(EPICS::SCALAR_INT);
+        info.set_pvname("test:file");
+        info.set_year(2015);
+        out<<refEscape(info.SerializeAsString())<<"\n";
+        for(size_t i=0; i<NELEMENTS(samples); i++) {
+            EPICS::ScalarInt samp;
+            samp.set_secondsintoyear(samples[i].sec);
+            samp.set_nano(samples[i].nano);
+            samp.set_val(samples[i].val);
+            out<<refEscape(samp.SerializeAsString())<<"\n";
+        }
+        out<<"abc";
+    }
+
+    PBFile F(fname);
+    testOk(F.header().pvname()=="test:file" && F.header().year()==2015
+           && F.header().type()==EPICS::SCALAR_INT, "header");
+    testOk(F.partial()==3, "partial %u", (unsigned)F.partial());
+
+    std::vector<const char*> lines;
+    for(const char *line = F.begin(); line<F.end(); line = F.next(line))
+        lines.push_back(line);
+    testOk(lines.size()==NELEMENTS(samples), "%u lines", (unsigned)lines.size());
+
+    bool timesok = lines.size()==NELEMENTS(samples);
+    for(size_t i=0; timesok && i<lines.size(); i++) {
+        epicsTimeStamp t;
+        timesok = F.time(lines[i], &t)
+                && t.secPastEpoch==F.startOfYear().secPastEpoch+samples[i].sec
+                && t.nsec==samples[i].nano
+                && F.lineOf(lines[i]+1)==lines[i];
+    }
+    testOk(timesok, "times");
+
+    static const struct {
+        epicsUInt32 sec, nano;
+    } queries[] = {
+        {0, 0}, {10, 0}, {10, 5}, {10, 10}, {27, 0x1b}, {28, 0}, {40, 14}, {100, 0},
+    };
+    for(size_t q=0; q<NELEMENTS(queries); q++) {
+        epicsTimeStamp t;
+        t.secPastEpoch = F.startOfYear().secPastEpoch+queries[q].sec;
+        t.nsec = queries[q].nano;
+        size_t expect = 0;
+        while(expect<NELEMENTS(samples) && (samples[expect].sec<queries[q].sec ||
+              (samples[expect].sec==queries[q].sec && samples[expect].nano<queries[q].nano)))
+            expect++;
+        const char *found = F.lowerBound(t);
+        testOk(found==(expect<lines.size() ? lines[expect] : F.end()),
+               "lowerBound(%u.%u) -> line %u", (unsigned)queries[q].sec, (unsigned)queries[q].nano,
+               (unsigned)expect);
+    }
+
+    std::vector<char> buf;
+    EPICS::ScalarInt samp;
+    testOk(lines.size()>5 && F.unescapeLine(lines[5], buf)
+           && samp.ParseFromArray(&buf[0], buf.size()) && samp.val()==10, "decode line 5");
+
+    remove(fname);
+    try {
+        PBFile missing(fname);
+        testFail("opened missing file");
+    } catch(std::runtime_error& e) {
+        testPass("missing file: %s", e.what());
+    }
+}
+
 MAIN(testPB)
 {
-    testPlan(26);
+    testPlan(162);
     testTime();
+    testParseTime();
+    testPartition();
+    testFormatDecimal();
     testEscape();
+    testEscapeLong();
+    testBufferedFile();
+    testBufferedFileRing();
+    testThrottle();
+    testDirCache();
+    testLastLine();
+    testManifest();
     writeSample();
+    writeLargeSample();
+    testEncode();
+    testSampleRun();
+    testReadAhead();
+    testMerge();
+    testPBFile();
     return testDone();
 }
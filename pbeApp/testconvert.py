@@ -1,7 +1,7 @@
 #!/usr/bin/env python
 
 import os, os.path, re
-import datetime, calendar
+import datetime, calendar, json
 import unittest
 
 import EPICSEvent_pb2 as pb
@@ -9,6 +9,8 @@ import EPICSEvent_pb2 as pb
 pbgentestdata = os.path.join(os.getcwd(), 'pbgentestdata')
 listpvs = os.path.join(os.getcwd(), 'listpvs')
 pbexport = os.path.join(os.getcwd(), 'pbexport')
+pbquery = os.path.join(os.getcwd(), 'pbquery')
+pbverify = os.path.join(os.getcwd(), 'pbverify')
 
 # Proto buffer instances for decoding individual samples
 _fields = {
@@ -70,13 +72,33 @@ class TestDate(unittest.TestCase):
     def cleanupDir(self):
         pass
 
-    def convertPV(self, name):
+    def convertPV(self, name, *args):
         import subprocess as SP
-        worker = SP.Popen([pbexport, os.getcwd()+'/index'], stdin=SP.PIPE)
+        worker = SP.Popen([pbexport]+list(args)+[os.getcwd()+'/index'], stdin=SP.PIPE)
         worker.stdin.write(name+'\n')
         worker.stdin.write('<>exit\n')
         self.assertEqual(worker.wait(), 0)
-        
+
+    def convertAll(self, jobs, *args):
+        import subprocess as SP
+        worker = SP.Popen([pbexport, '-jobs', str(jobs), '-all']+list(args)+[os.getcwd()+'/index'],
+                          stdout=SP.PIPE)
+        out, _err = worker.communicate()
+        self.assertEqual(worker.returncode, 0)
+        return out
+
+    def readAll(self):
+        """The contents of every .pb file, by path, which are then removed
+        """
+        files = {}
+        for dname, _dirs, fnames in os.walk('.'):
+            for fname in fnames:
+                if '.pb' in fname:
+                    with open(os.path.join(dname, fname), 'rb') as F:
+                        files[os.path.join(dname, fname)] = F.read()
+                    os.remove(os.path.join(dname, fname))
+        return files
+
     def run(self, *args, **kws):
         with TempDir() as dname:
             self.prepareDir()
@@ -151,6 +173,42 @@ class TestDate(unittest.TestCase):
                 (10,{'sec':1425494790, 'ns':100}),
                 ])
 
+    def test_resume(self):
+        self.convertPV('pv-counter')
+        fname = 'pv/counter:2015.pb'
+        with open(fname, 'r') as F:
+            lines = F.readlines()
+        # keep header and 5 samples, then simulate an interrupted write
+        with open(fname, 'w') as F:
+            F.write(''.join(lines[:6]))
+            F.write(lines[6][:3])
+        self.convertPV('pv-counter')
+        # the first sample written after resuming carries the fields again
+        fields = [('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                  ('HIGH', '0'),('LOW', '0'),('LOLO', '0')]
+        self.assertPBFile(fname,
+            head={'year':2015, 'type':5},
+            contents=[(0, {'sec':1425494780, 'ns':0, 'fv':fields})]
+                    +[(i, {'sec':1425494780+i, 'ns':10*i}) for i in range(1,5)]
+                    +[(5, {'sec':1425494785, 'ns':50, 'fv':fields})]
+                    +[(i, {'sec':1425494780+i, 'ns':10*i}) for i in range(6,11)])
+
+    def test_resume_header(self):
+        self.convertPV('pv-counter')
+        fname = 'pv/counter:2015.pb'
+        with open(fname, 'r') as F:
+            lines = F.readlines()
+        # interrupted while writing the header
+        with open(fname, 'w') as F:
+            F.write(lines[0][:5])
+        self.convertPV('pv-counter')
+        fields = [('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                  ('HIGH', '0'),('LOW', '0'),('LOLO', '0')]
+        self.assertPBFile(fname,
+            head={'year':2015, 'type':5},
+            contents=[(0, {'sec':1425494780, 'ns':0, 'fv':fields})]
+                    +[(i, {'sec':1425494780+i, 'ns':10*i}) for i in range(1,11)])
+
     def test_enum(self):
         self.convertPV('enum:pv')
         self.assertPBFile('enum/pv:2015.pb',
@@ -214,5 +272,469 @@ class TestDate(unittest.TestCase):
                 (42, {'sec':1425494790, 'ns':4000}),
                 ])
 
+    def test_ctrlchange(self):
+        self.convertPV('pv:ctrlchange1')
+        self.assertPBFile('pv/ctrlchange1:2015.pb',
+            head={'year':2015, 'type':6},
+            contents=[
+                (0, {'sec':1425494780, 'fv':[
+                    ('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),('PREC', '0'),
+                    ]}),
+                (1, {'sec':1425494781}),
+                (2, {'sec':1425494782}),
+                (3, {'sec':1425494783, 'fv':[
+                    ('HOPR', '20'),('LOPR', '0'),('EGU', 'mm'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),('PREC', '1'),
+                    ]}),
+                (4, {'sec':1425494784}),
+                ])
+
+    def test_heartbeat(self):
+        self.convertPV('pv-counter', '-heartbeat', '2')
+        fields = [('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                  ('HIGH', '0'),('LOW', '0'),('LOLO', '0')]
+        self.assertPBFile('pv/counter:2015.pb',
+            head={'year':2015, 'type':5},
+            contents=[(i, {'sec':1425494780+i, 'ns':10*i, 'fv':fields if i%2==0 else []})
+                      for i in range(11)])
+
+        # only on change
+        self.convertPV('pv:ctrlchange1', '-heartbeat', '0')
+        self.assertPBFile('pv/ctrlchange1:2015.pb',
+            head={'year':2015, 'type':6},
+            contents=[
+                (0, {'sec':1425494780, 'fv':[
+                    ('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),('PREC', '0'),
+                    ]}),
+                (1, {'sec':1425494781}),
+                (2, {'sec':1425494782}),
+                (3, {'sec':1425494783, 'fv':[
+                    ('HOPR', '20'),('LOPR', '0'),('EGU', 'mm'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),('PREC', '1'),
+                    ]}),
+                (4, {'sec':1425494784}),
+                ])
+
+    def test_parallel(self):
+        out = self.convertAll(3)
+        self.assertTrue('PVs: 9 exported: 9 unchanged: 0 no data: 0 failed: 0' in out, out)
+        for fname in ['a/string/pv:2015.pb', 'pv/counter:2015.pb', 'enum/pv:2015.pb',
+                      'pv/discon1:2015.pb', 'pv/restart1:2015.pb', 'pv/disable1:2015.pb',
+                      'pv/repeat1:2015.pb', 'pv/ctrlchange1:2015.pb']:
+            self.assertTrue(os.path.isfile(fname), fname)
+        self.assertPBFile('enum/pv:2015.pb',
+            head={'year':2015, 'type':3},
+            contents=[
+                (2, {'sec':1425494780, 'fv':[('states','A;B;third')]}),
+                (0, {'sec':1425494781}),
+                (3, {'sec':1425494782}),
+                ])
+
+    def test_manifest(self):
+        out = self.convertAll(2, '-manifest', 'test.manifest')
+        self.assertTrue('PVs: 9 exported: 9 unchanged: 0 no data: 0 failed: 0' in out, out)
+        with open('test.manifest', 'r') as F:
+            lines = sorted(F.readlines())
+        self.assertEqual(len(lines), 9)
+        self.assertEqual(lines[2].split('\t'),
+                         ['pv-counter', '1425494790.000000100', '1425494790.000000100', '11',
+                          'pv/counter:2015.pb\n'])
+
+        # nothing new, so nothing is opened
+        os.remove('pv/counter:2015.pb')
+        out = self.convertAll(2, '-manifest', 'test.manifest')
+        self.assertTrue('PVs: 9 exported: 0 unchanged: 9 no data: 0 failed: 0' in out, out)
+        self.assertFalse(os.path.exists('pv/counter:2015.pb'))
+
+    def test_readahead(self):
+        files = ['a/string/pv:2015.pb', 'pv/counter:2015.pb', 'enum/pv:2015.pb',
+                 'pv/discon1:2015.pb', 'pv/restart1:2015.pb', 'pv/disable1:2015.pb',
+                 'pv/repeat1:2015.pb', 'pv/ctrlchange1:2015.pb']
+        self.convertAll(2)
+        expect = {}
+        for fname in files:
+            with open(fname, 'rb') as F:
+                expect[fname] = F.read()
+            os.remove(fname)
+
+        # a ring smaller than most PVs
+        out = self.convertAll(2, '-readahead', '2')
+        self.assertTrue('PVs: 9 exported: 9 unchanged: 0 no data: 0 failed: 0' in out, out)
+        for fname in files:
+            with open(fname, 'rb') as F:
+                self.assertEqual(F.read(), expect[fname], fname)
+
+    def test_years(self):
+        files = ['pv/years1:2014.pb', 'pv/years1:2015.pb', 'pv/years1:2016.pb',
+                 'pv/years1:2016.pb.1', 'pv/years1:2017.pb']
+        meta = [('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                ('HIGH', '0'),('LOW', '0'),('LOLO', '0')]
+        self.convertPV('pv:years1')
+        # the disconnection before the new year is noted after it
+        self.assertPBFile('pv/years1:2015.pb',
+            head={'year':2015, 'type':6},
+            contents=[
+                (2, {'sec':1420070405, 'fv':[
+                    ('cnxlostepsecs', '1420070395'), ('cnxregainedepsecs', '1420070405'),
+                    ('startup', 'true')]+meta+[('PREC', '0')]}),
+                (3, {'sec':1420070500}),
+                ])
+        self.assertPBFile('pv/years1:2016.pb.1',
+            head={'year':2016, 'type':5},
+            contents=[
+                (5, {'sec':1451606410, 'fv':meta}),
+                ])
+        expect = {}
+        for fname in files:
+            with open(fname, 'rb') as F:
+                expect[fname] = F.read()
+            os.remove(fname)
+
+        out = self.convertAll(3, '-splityears', '2', '-manifest', 'test.manifest')
+        self.assertTrue('PVs: 9 exported: 9 unchanged: 0 no data: 0 failed: 0' in out, out)
+        for fname in files:
+            with open(fname, 'rb') as F:
+                self.assertEqual(F.read(), expect[fname], fname)
+
+        with open('test.manifest', 'r') as F:
+            lines = [L for L in F.readlines() if L.startswith('pv:years1\t')]
+        self.assertEqual(len(lines), 1)
+        self.assertEqual(lines[0].rstrip('\n').split('\t')[3:], ['6']+files)
+
+    def test_listpvs(self):
+        import subprocess as SP
+        out = SP.check_output([listpvs, '-cost', '-pv', '^pv:', os.getcwd()+'/index'])
+        lines = dict([(L.split('\t')[0], L.split('\t')[1:]) for L in out.splitlines()])
+        self.assertEqual(sorted(lines.keys()), ['pv:ctrlchange1', 'pv:disable1', 'pv:discon1',
+                                                'pv:repeat1', 'pv:restart1', 'pv:years1'])
+        # cost, span, blocks, elements
+        self.assertEqual(lines['pv:discon1'], ['1', '10', '1', '1'])
+        self.assertEqual(lines['pv:years1'][2:], ['2', '1'])
+        self.assertEqual(int(lines['pv:years1'][1]), 1483228805-1420070390)
+
+        with open('list.txt', 'w') as F:
+            F.write('pv-counter\n  enum:pv \nno:such:pv\n')
+        out = SP.check_output([listpvs, '-pvlist', 'list.txt', os.getcwd()+'/index'])
+        self.assertEqual(out.splitlines(), ['enum:pv', 'pv-counter'])
+
+        # the most costly first
+        worker = SP.Popen([pbexport, '-jobs', '1', os.getcwd()+'/index'],
+                          stdin=SP.PIPE, stdout=SP.PIPE, stderr=SP.PIPE)
+        _out, err = worker.communicate('enum:pv\t1\tx\npv:years1\t5\npv-counter\t2\n')
+        self.assertEqual(worker.returncode, 0)
+        visits = [L.split()[2] for L in err.splitlines() if L.startswith('Visit PV ')]
+        self.assertEqual(visits, ['pv:years1', 'pv-counter', 'enum:pv'])
+
+    def test_query(self):
+        import subprocess as SP
+        self.convertPV('pv-counter')
+        fname = 'pv/counter:2015.pb'
+
+        out = SP.check_output([pbquery, '-start', '2015-03-04T18:46:22Z',
+                               '-end', '2015-03-04 18:46:25', fname])
+        rows = [L.split('\t') for L in out.splitlines()]
+        self.assertEqual([R[0] for R in rows], ['2015-03-04T18:46:22.000000020Z',
+                                                '2015-03-04T18:46:23.000000030Z',
+                                                '2015-03-04T18:46:24.000000040Z'])
+        self.assertEqual([R[1:4] for R in rows], [['2', '0', '0'], ['3', '0', '0'], ['4', '0', '0']])
+
+        # the end is exclusive, the start inclusive to the nanosecond
+        out = SP.check_output([pbquery, '-count', '-start', '2015-03-04T18:46:22.00000002',
+                               '-end', '2015-03-04T18:46:24.00000004', fname])
+        self.assertEqual(out, '2\n')
+        out = SP.check_output([pbquery, '-count', '-start', '2015-03-04T18:46:22.000000021', fname])
+        self.assertEqual(out, '8\n')
+        out = SP.check_output([pbquery, '-count', '-end', '2016-01-01', fname])
+        self.assertEqual(out, '11\n')
+
+        out = SP.check_output([pbquery, '-end', '2015-03-04T18:46:20.000000001', fname])
+        self.assertTrue(out.startswith('2015-03-04T18:46:20.000000000Z\t0\t0\t0\tHOPR=10\t'), out)
+
+    def test_verify(self):
+        import subprocess as SP
+        self.convertAll(2)
+        out = SP.check_output([pbverify, '-jobs', '3', '-all', os.getcwd()+'/index'])
+        rows = dict([(L.split('\t')[0], L.split('\t')[1:]) for L in out.splitlines()])
+        self.assertEqual(len(rows), 9)
+        for name, R in rows.items():
+            self.assertEqual(R[0], 'ok', (name, R))
+            self.assertEqual(R[2], '0', (name, R))
+        self.assertEqual(rows['pv-counter'][1], '11')
+        # disconnected samples are not expected
+        self.assertEqual(rows['pv:years1'][1], '6')
+
+        # drop a sample, and a whole file
+        with open('pv/counter:2015.pb', 'rb') as F:
+            lines = F.readlines()
+        with open('pv/counter:2015.pb', 'wb') as F:
+            F.writelines(lines[:4]+lines[5:])
+        os.remove('pv/years1:2017.pb')
+        worker = SP.Popen([pbverify, '-readahead', '4', os.getcwd()+'/index'],
+                          stdin=SP.PIPE, stdout=SP.PIPE, stderr=SP.PIPE)
+        out, err = worker.communicate('pv-counter\npv:years1\tx\n')
+        self.assertEqual(worker.returncode, 1)
+        rows = dict([(L.split('\t')[0], L.split('\t')[1:]) for L in out.splitlines()])
+        self.assertEqual(rows['pv-counter'][:3], ['mismatch', '11', '1'])
+        self.assertEqual(rows['pv:years1'][:3], ['mismatch', '6', '2'])
+        self.assertTrue('pv/counter:2015.pb:' in err and 'Missing sample at 2015-03-04T18:46:23.000000030Z' in err, err)
+        self.assertTrue('pv/years1:2017.pb: Can\'t open' in err, err)
+
+    def test_partition(self):
+        import subprocess as SP
+        meta = [('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                ('HIGH', '0'),('LOW', '0'),('LOLO', '0')]
+        self.convertPV('pv-counter', '-partition', 'hour')
+        self.assertFalse(os.path.exists('pv/counter:2015.pb'))
+        # secondsintoyear is still from the start of the year
+        self.assertPBFile('pv/counter:2015_03_04_18.pb',
+            head={'year':2015, 'type':5},
+            contents=[(0, {'sec':1425494780, 'ns':0, 'fv':meta})]+
+                     [(i, {'sec':1425494780+i, 'ns':10*i}) for i in range(1, 11)])
+
+        self.convertPV('pv:years1', '-partition', 'month')
+        self.assertEqual(sorted(os.listdir('pv')), ['counter:2015_03_04_18.pb',
+                                                    'years1:2014_12.pb', 'years1:2015_01.pb',
+                                                    'years1:2016_01.pb', 'years1:2016_01.pb.1',
+                                                    'years1:2017_01.pb'])
+        # resumed in the last file
+        self.convertPV('pv:years1', '-partition', 'month')
+        self.assertPBFile('pv/years1:2017_01.pb',
+            head={'year':2017, 'type':5},
+            contents=[(6, {'sec':1483228805, 'fv':meta})])
+
+        worker = SP.Popen([pbverify, '-partition', 'month', os.getcwd()+'/index'],
+                          stdin=SP.PIPE, stdout=SP.PIPE, stderr=SP.PIPE)
+        out, err = worker.communicate('pv:years1\n')
+        self.assertEqual(worker.returncode, 0, err)
+        self.assertEqual(out.split('\t')[:4], ['pv:years1', 'ok', '6', '0'])
+
+    def test_collapse(self):
+        import subprocess as SP
+        # none of the test PVs repeat a sample, so nothing is folded
+        self.convertAll(2, '-collapse')
+        out = SP.check_output([pbverify, '-all', os.getcwd()+'/index'])
+        self.assertEqual(len(out.splitlines()), 9)
+        for L in out.splitlines():
+            self.assertEqual(L.split('\t')[1], 'ok', L)
+        collapsed = self.readAll()
+        self.convertAll(2)
+        self.assertEqual(collapsed, self.readAll())
+
+    def test_bin(self):
+        meta = [('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),('PREC', '0')]
+        self.convertPV('pv-counter', '-bin', '4')
+        self.assertFalse(os.path.exists('pv/counter:2015.pb'))
+        self.assertPBFile('pv/counter_mean_4:2015.pb',
+            head={'year':2015, 'type':6, 'pvname':'pv-counter_mean_4'},
+            contents=[(1.5, {'sec':1425494780, 'fv':meta}),
+                      (5.5, {'sec':1425494784}),
+                      (9.0, {'sec':1425494788})])
+        self.assertPBFile('pv/counter_max_4:2015.pb',
+            head={'year':2015, 'type':6},
+            contents=[(3, {'sec':1425494780, 'fv':meta}),
+                      (7, {'sec':1425494784}),
+                      (10, {'sec':1425494788})])
+        self.assertPBFile('pv/counter_count_4:2015.pb',
+            head={'year':2015, 'type':5},
+            contents=[(4, {'sec':1425494780}),
+                      (4, {'sec':1425494784}),
+                      (3, {'sec':1425494788})])
+
+        # the first bin after a disconnection notes it
+        self.convertPV('pv:discon1', '-bin', '4')
+        self.assertPBFile('pv/discon1_last_4:2015.pb',
+            head={'year':2015, 'type':6},
+            contents=[(42, {'sec':1425494780, 'fv':meta}),
+                      (42, {'sec':1425494788, 'fv':[('cnxlostepsecs', '1425494785'),
+                                                    ('cnxregainedepsecs', '1425494790')]})])
+
+        # bins already written are not written again
+        self.convertPV('pv-counter', '-bin', '4')
+        with open('pv/counter_min_4:2015.pb', 'rb') as F:
+            self.assertEqual(len(F.readlines()), 4)
+
+        # strings are written as samples
+        self.convertPV('a:string:pv', '-bin', '4')
+        self.assertTrue(os.path.exists('a/string/pv:2015.pb'))
+
+    def test_follow(self):
+        import subprocess as SP
+        # a cycle stops taking PVs once over budget, and the next starts with the rest
+        worker = SP.Popen([pbexport, '-follow', '1', '-cycles', '2', '-budget', '1', '-all',
+                           '-manifest', 'test.manifest', os.getcwd()+'/index'],
+                          stdout=SP.PIPE)
+        out, _err = worker.communicate()
+        self.assertEqual(worker.returncode, 0)
+        cycles = out.split('Cycle ')[1:]
+        self.assertEqual(len(cycles), 2, out)
+        self.assertTrue('PVs: 1 exported: 1 unchanged: 0' in cycles[0], out)
+        self.assertTrue('Deferred: 8 PVs' in cycles[0], out)
+        self.assertTrue('PVs: 1 exported: 1 unchanged: 0' in cycles[1], out)
+        self.assertTrue('Deferred: 8 PVs' in cycles[1], out)
+
+        # without new data, only the remaining PVs are exported
+        worker = SP.Popen([pbexport, '-follow', '1', '-cycles', '2', '-all', '-jobs', '2',
+                           '-manifest', 'test.manifest', os.getcwd()+'/index'],
+                          stdout=SP.PIPE)
+        out, _err = worker.communicate()
+        self.assertEqual(worker.returncode, 0)
+        cycles = out.split('Cycle ')[1:]
+        self.assertTrue('PVs: 9 exported: 7 unchanged: 2 no data: 0 failed: 0' in cycles[0], out)
+        self.assertTrue('PVs: 9 exported: 0 unchanged: 9 no data: 0 failed: 0' in cycles[1], out)
+        self.assertPBFile('pv/counter:2015.pb', head={'year':2015, 'type':5},
+            contents=[(0, {'sec':1425494780, 'fv':[
+                    ('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                    ('HIGH', '0'),('LOW', '0'),('LOLO', '0'),
+                    ]})]+[(i, {'sec':1425494780+i, 'ns':10*i}) for i in range(1, 11)])
+
+    def test_merge(self):
+        import subprocess as SP
+        self.convertAll(2)
+        single = self.readAll()
+        self.assertTrue(single)
+
+        # the samples of an overlapping archive are only written once
+        os.mkdir('other')
+        SP.check_call([pbgentestdata, os.getcwd()+'/other/index'])
+        worker = SP.Popen([pbexport, '-jobs', '2', '-all', os.getcwd()+'/index',
+                           os.getcwd()+'/other/index', os.getcwd()+'/index'],
+                          stdout=SP.PIPE)
+        out, _err = worker.communicate()
+        self.assertEqual(worker.returncode, 0)
+        self.assertTrue('PVs: 9 exported: 9' in out, out)
+        self.assertEqual(single, self.readAll())
+
+        # again, into files which are complete, then once more, which changes nothing
+        for i in range(2):
+            worker = SP.Popen([pbexport, '-jobs', '2', '-all', os.getcwd()+'/index',
+                               os.getcwd()+'/other/index'], stdout=SP.PIPE)
+            out, _err = worker.communicate()
+            self.assertEqual(worker.returncode, 0)
+            self.assertTrue('PVs: 9 exported: 9' in out, out)
+        self.assertEqual(single, self.readAll())
+
+    def test_window(self):
+        import subprocess as SP
+        fields = [('HOPR', '10'),('LOPR', '0'),('EGU', 'tick'),('HIHI', '0'),
+                  ('HIGH', '0'),('LOW', '0'),('LOLO', '0')]
+        self.convertPV('pv-counter', '-start', '2015-03-04T18:46:22Z', '-end', '2015-03-04T18:46:25Z')
+        self.assertPBFile('pv/counter:2015.pb',
+            head={'year':2015, 'type':5},
+            contents=[(2, {'sec':1425494782, 'ns':20, 'fv':fields}),
+                      (3, {'sec':1425494783, 'ns':30}),
+                      (4, {'sec':1425494784, 'ns':40})])
+        os.remove('pv/counter:2015.pb')
+
+        self.convertPV('pv:years1')
+        with open('pv/years1:2015.pb', 'rb') as F:
+            whole = F.read()
+        for dname, _dirs, fnames in os.walk('pv'):
+            for fname in fnames:
+                os.remove(os.path.join(dname, fname))
+
+        # windows of each PV on stdin, within the window of all
+        pvs = ('pv-counter\tstart=2015-03-04T18:46:28Z\n'
+               'pv:years1\t2\tstart=2015-01-01\tend=2016-01-01\n'
+               'pv:discon1\tend=1999-01-01\n')
+        worker = SP.Popen([pbexport, '-jobs', '2', '-end', '2016-06-01', os.getcwd()+'/index'],
+                          stdin=SP.PIPE, stdout=SP.PIPE)
+        out, _err = worker.communicate(pvs)
+        self.assertEqual(worker.returncode, 0)
+        self.assertTrue('PVs: 3 exported: 2 unchanged: 0 no data: 1 failed: 0' in out, out)
+        self.assertPBFile('pv/counter:2015.pb',
+            head={'year':2015, 'type':5},
+            contents=[(8, {'sec':1425494788, 'ns':80, 'fv':fields}),
+                      (9, {'sec':1425494789, 'ns':90}),
+                      (10,{'sec':1425494790, 'ns':100})])
+        # the disconnection before the start is still noted
+        with open('pv/years1:2015.pb', 'rb') as F:
+            self.assertEqual(F.read(), whole)
+        self.assertEqual(sorted(os.listdir('pv')), ['counter:2015.pb', 'years1:2015.pb'])
+
+        # a window into an existing file resumes after its last sample,
+        # but one which ends before that can't be inserted, so fails
+        with open('pv/counter:2015.pb', 'rb') as F:
+            before = F.read()
+        for start, end, result in [('2015-03-04T18:46:25Z', '2016-01-01', 'exported: 1'),
+                                   ('2015-03-04T18:46:22Z', '2015-03-04T18:46:25Z', 'failed: 1')]:
+            worker = SP.Popen([pbexport, '-jobs', '1', '-start', start, '-end', end,
+                               os.getcwd()+'/index'],
+                              stdin=SP.PIPE, stdout=SP.PIPE)
+            out, _err = worker.communicate('pv-counter\n')
+            self.assertEqual(worker.returncode, 0)
+            self.assertTrue(result in out, out)
+            with open('pv/counter:2015.pb', 'rb') as F:
+                self.assertEqual(F.read(), before)
+
+    def test_throttle(self):
+        import subprocess as SP
+        self.convertAll(2)
+        expect = self.readAll()
+
+        # more files than writes allowed in the first second
+        with open('throttle.ctl', 'w') as F:
+            F.write('writeops 10\n')
+        worker = SP.Popen([pbexport, '-jobs', '2', '-all', '-maxwrite', '1000',
+                           '-throttle', 'throttle.ctl', '-throttleshare', 'throttle.shared',
+                           os.getcwd()+'/index'], stdout=SP.PIPE, stderr=SP.PIPE)
+        out, err = worker.communicate()
+        self.assertEqual(worker.returncode, 0)
+        self.assertTrue('PVs: 9 exported: 9' in out, out)
+        self.assertTrue('Throttle readkB 0 writekB 0 writeops 10' in err, err)
+        waited = [float(L.split()[1]) for L in err.splitlines() if L.startswith('Waited ')]
+        self.assertEqual(len(waited), 1)
+        self.assertTrue(waited[0]>0.0, waited)
+        self.assertEqual(expect, self.readAll())
+
+    def test_census(self):
+        import csv
+        self.convertAll(2, '-census', 'census.csv')
+        self.convertAll(1, '-census', 'census.json')
+        for dname, _dirs, fnames in os.walk('.'):
+            for fname in fnames:
+                self.assertFalse('.pb' in fname, fname)
+        with open('census.csv', 'r') as F:
+            rows = list(csv.DictReader(F))
+        with open('census.json', 'r') as F:
+            self.assertEqual(len(F.readlines()), len(rows))
+        years = [R for R in rows if R['pv']=='pv:years1']
+        self.assertTrue(len(years)>1, years)
+
+        # the same as written by an export
+        self.convertAll(2)
+        for R in rows:
+            with open(R['file'], 'rb') as F:
+                content = F.read()
+            self.assertEqual(int(R['bytes']), len(content), R)
+            self.assertEqual(int(R['samples']), content.count(b'\n')-1, R)
+        counter = [R for R in rows if R['pv']=='pv-counter'][0]
+        self.assertEqual(counter['type'], 'SCALAR_INT')
+        self.assertEqual(counter['elements'], '1')
+        discon = [R for R in rows if R['pv']=='pv:discon1'][0]
+        self.assertTrue(int(discon['disconnects'])>0, discon)
+
+    def test_stats(self):
+        self.convertAll(2, '-stats', 'stats.json', '-prom', 'metrics.prom')
+        with open('stats.json', 'r') as F:
+            lines = [json.loads(L) for L in F.readlines()]
+        self.assertEqual(len(lines), 9)
+        self.assertEqual(sorted([L['done'] for L in lines]), list(range(1, 10)))
+        for L in lines:
+            self.assertEqual(L['total'], 9)
+            self.assertEqual(L['result'], 'ok')
+            for key in ['lookup_sec', 'read_sec', 'encode_sec', 'write_sec']:
+                self.assertTrue(L[key]>=0.0, (key, L))
+        counter = [L for L in lines if L['pv']=='pv-counter'][0]
+        self.assertEqual(counter['samples'], 11)
+
+        with open('metrics.prom', 'r') as F:
+            metrics = F.read()
+        self.assertTrue('pbexport_samples_total %d\n'%sum([L['samples'] for L in lines]) in metrics, metrics)
+        self.assertTrue('pbexport_pvs_total{result="ok"} 9\n' in metrics, metrics)
+        self.assertTrue('pbexport_pvs_remaining 0\n' in metrics, metrics)
+
 if __name__=='__main__':
     unittest.main()